@@ -19,6 +19,60 @@ IoIn32:
     in eax, dx
     ret
 
+global IoOut8  ; void IoOut8(uint16_t addr, uint8_t data);
+IoOut8:
+    mov dx, di    ; dx = addr
+    mov al, sil   ; al = data
+    out dx, al
+    ret
+
+global IoIn8  ; uint8_t IoIn8(uint16_t addr);
+IoIn8:
+    mov dx, di    ; dx = addr
+    xor eax, eax
+    in al, dx
+    ret
+
+global ReadTSC  ; uint64_t ReadTSC(void);
+ReadTSC:
+    rdtsc         ; edx:eax = time stamp counter
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadMSR  ; uint64_t ReadMSR(uint32_t msr);
+ReadMSR:
+    mov ecx, edi
+    rdmsr         ; edx:eax = MSR[ecx]
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global WriteMSR  ; void WriteMSR(uint32_t msr, uint64_t value);
+WriteMSR:
+    mov ecx, edi
+    mov eax, esi  ; low 32 bits
+    mov rdx, rsi
+    shr rdx, 32   ; high 32 bits
+    wrmsr
+    ret
+
+; rbx is callee-saved, cpuid clobbers it
+global ReadCPUID  ; void ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d);
+ReadCPUID:
+    push rbx
+    mov r10, rdx  ; a
+    mov r11, rcx  ; b
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r10], eax
+    mov [r11], ebx
+    mov [r8], ecx
+    mov [r9], edx
+    pop rbx
+    ret
+
 global GetCS  ; uint16_t GetCS(void);
 GetCS:
     xor eax, eax  ; also clears upper 32 bits of rax
@@ -82,6 +136,11 @@ SetDSAll:
     mov gs, di
     ret
 
+global GetCR3  ; uint64_t GetCR3(void);
+GetCR3:
+    mov rax, cr3
+    ret
+
 global SetCR3  ; void SetCR3(uint64_t value);
 SetCR3:
 ; Enter Long Mode (Seems not need since UEFI start from 64 bit)
@@ -106,6 +165,107 @@ SetCR3:
 
     ret
 
+; Switch kernel threads: save the callee-saved registers, RFLAGS and the
+; x87/SSE state of the current thread, and resume the next one
+; ThreadContext layout: [0] rsp, [16] 512-byte FXSAVE area (16-byte aligned)
+; The caller-saved registers are dead at a call (or saved by an interrupt handler)
+global SwitchContext  ; void SwitchContext(ThreadContext *next, ThreadContext *current);
+SwitchContext:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    pushfq          ; IF belongs to the thread, e.g. it was switched out in an interrupt handler
+    fxsave [rsi + 16]
+    mov [rsi], rsp
+
+    mov rsp, [rdi]  ; the next thread's stack, the same frame as above
+    fxrstor [rdi + 16]
+    popfq
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret             ; to where the next thread called SwitchContext(), or its entry
+
+; AP startup trampoline; copied to a page below 1 MiB by StartAPs() (cpu.cpp),
+; never run in place. After the SIPI an AP starts at CS:IP = (page >> 4):0 in
+; real mode, and goes to long mode in one step: PAE + EFER.LME, then PG | PE,
+; then a far jump to a 64-bit code segment of its own GDT.
+; Position independent: the 16-bit part addresses through DS = CS, the 64-bit
+; part RIP-relative; the addresses in the params are relative to APTrampoline
+; until StartAPs() adds the page base.
+bits 16
+global APTrampoline
+APTrampoline:
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+    mov eax, (1 << 10) | (1 << 9) | (1 << 5)  ; CR4: OSXMMEXCPT | OSFXSR | PAE
+    mov cr4, eax
+    mov eax, [APTrampolineParams - APTrampoline]  ; cr3
+    mov cr3, eax
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8       ; LME
+    wrmsr
+    o32 lgdt [APTrampolineParams - APTrampoline + 10]
+    mov eax, cr0
+    and eax, ~((1 << 30) | (1 << 29) | (1 << 2))  ; clear CD, NW, EM
+    or eax, (1 << 31) | (1 << 5) | (1 << 1) | 1   ; PG | NE | MP | PE
+    mov cr0, eax
+    o32 jmp far [APTrampolineParams - APTrampoline + 4]  ; long_mode_entry:long_mode_cs
+
+bits 64
+APTrampolineLongMode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor eax, eax
+    mov fs, ax
+    mov gs, ax
+    mov eax, 1
+    lock xadd [rel APTrampolineParams + 40], eax  ; eax = next_index++, this CPU's index
+    cmp eax, [rel APTrampolineParams + 44]        ; max_index
+    jae .halt
+    mov edi, eax                        ; 1st arg: the CPU index
+    mov ecx, eax
+    imul rcx, [rel APTrampolineParams + 24]  ; stack_size
+    add rcx, [rel APTrampolineParams + 16]   ; stack_base
+    mov rsp, rcx                        ; the top of the stack of this index
+    call [rel APTrampolineParams + 32]  ; entry; never returns
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+; struct APTrampolineParamsLayout (cpu.cpp)
+align 8
+global APTrampolineParams
+APTrampolineParams:
+    dd 0                                    ; +0  cr3
+    dd APTrampolineLongMode - APTrampoline  ; +4  long_mode_entry
+    dw 0x08                                 ; +8  long_mode_cs
+    dw 3 * 8 - 1                            ; +10 gdt_limit
+    dd APTrampolineGDT - APTrampoline       ; +12 gdt_base
+    dq 0                                    ; +16 stack_base
+    dq 0                                    ; +24 stack_size
+    dq 0                                    ; +32 entry
+    dd 0                                    ; +40 next_index
+    dd 0                                    ; +44 max_index
+APTrampolineGDT:                            ; +48 gdt
+    dq 0
+    dq 0x00af9a000000ffff  ; 0x08: 64-bit code
+    dq 0x00cf92000000ffff  ; 0x10: data
+global APTrampolineEnd
+APTrampolineEnd:
+
 extern kernel_main_stack
 extern KernelMainNewStack
 
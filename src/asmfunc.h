@@ -2,10 +2,19 @@
 
 #include <stdint.h>
 
+struct ThreadContext;
+
 extern "C"
 {
   void __attribute__((sysv_abi)) IoOut32(uint16_t addr, uint32_t data);
   uint32_t __attribute__((sysv_abi)) IoIn32(uint16_t addr);
+  void __attribute__((sysv_abi)) IoOut8(uint16_t addr, uint8_t data);
+  uint8_t __attribute__((sysv_abi)) IoIn8(uint16_t addr);
+  uint64_t __attribute__((sysv_abi)) ReadTSC(void);
+  uint64_t __attribute__((sysv_abi)) ReadMSR(uint32_t msr);
+  void __attribute__((sysv_abi)) WriteMSR(uint32_t msr, uint64_t value);
+  void __attribute__((sysv_abi)) ReadCPUID(uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c,
+                                           uint32_t *d);
   uint16_t __attribute__((sysv_abi)) GetCS(void);
   void __attribute__((sysv_abi)) LoadIDT(uint16_t limit, uint64_t offset);
   void __attribute__((sysv_abi)) LoadGDT(uint16_t limit, uint64_t offset);
@@ -14,5 +23,11 @@ extern "C"
    * Set DS, ES, FS, GS to value
    */
   void __attribute__((sysv_abi)) SetDSAll(uint16_t value);
+  uint64_t __attribute__((sysv_abi)) GetCR3(void);
   void __attribute__((sysv_abi)) SetCR3(uint64_t value);
+  /**
+   * Save the current thread into `current`, and resume `next`;
+   * returns when `current` is resumed
+   */
+  void __attribute__((sysv_abi)) SwitchContext(ThreadContext *next, ThreadContext *current);
 }
@@ -11,8 +11,6 @@
 #define OS_IDT_AR_INTGATE32 0x8e // access bit for intgate32
 /* Max process allowed when multi-tasking */
 #define OS_MPROCESS_TASK_MAX 1000
-/* The first TSS segment in GDT */
-#define OS_MPROCESS_TSS_GDT_INDEX_START 3
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define OS_MEMORY_ALIGN 16
@@ -29,9 +27,14 @@
 
 /* Max (total) numbers of timer that can exist in the OS */
 #define OS_MAX_TIMER 500
+/* 1: program the PIT in one-shot mode for the next timer, instead of a 100Hz periodic interrupt */
+#define OS_TIMER_TICKLESS 1
 
+/* 1: record the acquisitions, spin and hold cycles of the shared locks (LOCKSTAT, util/spinlock.h) */
+#define OS_LOCKSTAT 0
+
+/* At most 32, the non-empty levels are tracked in a uint32_t bitmap */
 #define OS_MPROCESS_TASKLEVELS_MAX 10
-#define OS_MPROCESS_TASKLEVEL_TASKS_MAX 100
 
 /* Max bytes can present in one line (line buffer) */
 # define OS_TEXTBOX_LINE_BUFFER_SIZE 4096 * 10
@@ -45,5 +48,7 @@
 
 #define DEBUG_NO_TIMER 0
 #define DEBUG_NO_MULTITASK 0
+/* Run the benchmarks (test.c) on boot */
+#define DEBUG_BENCH 0
 #endif
 
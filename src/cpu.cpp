@@ -0,0 +1,224 @@
+/**
+ * @file cpu.cpp
+ *
+ * Per-CPU data and the AP (Application Processor) startup
+ */
+
+#include "cpu.hpp"
+
+#include <cstring>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "timer.hpp"
+
+std::array<CPU, kMaxCPUs> cpus;
+
+extern "C"
+{
+  /* asmfunc.asm; the trampoline is copied, these are never run in place */
+  extern uint8_t APTrampoline[];
+  extern uint8_t APTrampolineParams[];
+  extern uint8_t APTrampolineEnd[];
+}
+
+namespace
+{
+/**
+ * Local APIC registers
+ * Intel SDM Vol.3A Table 11-1. Local APIC Register Address Map
+ */
+const uint64_t kLAPICID = 0xfee00020;
+const uint64_t kLAPICSpuriousVector = 0xfee000f0;
+const uint64_t kLAPICICRLow = 0xfee00300;
+const uint64_t kLAPICICRHigh = 0xfee00310;
+/* Spurious Interrupt Vector Register: bit 8 APIC software enable */
+const uint32_t kLAPICSoftwareEnable = 1u << 8;
+const uint32_t kSpuriousVector = 0xff;
+/**
+ * Interrupt Command Register (Intel SDM Vol.3A 11.6.1)
+ *   - bit 10:8 delivery mode: 000 fixed, 101 INIT, 110 Start-Up
+ *   - bit 12 delivery status (1: send pending), bit 14 level (1: assert)
+ *   - bit 19:18 destination shorthand: 11 all excluding self
+ */
+const uint32_t kICRFixed = 0b000u << 8;
+const uint32_t kICRINIT = 0b101u << 8;
+const uint32_t kICRStartUp = 0b110u << 8;
+const uint32_t kICRSendPending = 1u << 12;
+const uint32_t kICRAssert = 1u << 14;
+const uint32_t kICRAllExcludingSelf = 0b11u << 18;
+
+const uint32_t kMSRGSBase = 0xc0000101;
+
+/* 64 KiB per AP */
+const size_t kAPStackFrames = 16;
+/* The SIPI vector is the page number of the trampoline, which must be below 1 MiB */
+const size_t kRealModeFrames = 1024 * 1024 / kBytesPerFrame;
+
+/**
+ * Intel SDM Vol.3A 9.4.4.1 Typical BSP Initialization Sequence: 10ms after
+ * INIT, 200us after each SIPI
+ */
+const uint64_t kINITDelayNs = 10000000;
+const uint64_t kSIPIDelayNs = 200000;
+/* How long the APs are given to arrive, then to get online */
+const uint64_t kAPArriveTimeoutNs = 100000000;
+const uint64_t kAPOnlineTimeoutNs = 1000000000;
+
+/**
+ * The data part of the trampoline; the layout is shared with asmfunc.asm
+ *   - every field is naturally aligned, no packing
+ *   - the addresses assembled in are relative to APTrampoline; StartAPs() adds the page base
+ */
+struct APTrampolineParamsLayout
+{
+  /* The BSP's CR3; the page table is below 4 GiB (the kernel image) */
+  uint32_t cr3;
+  /* m16:32 pointer for the far jump to long mode */
+  uint32_t long_mode_entry;
+  uint16_t long_mode_cs;
+  /* GDTR of the trampoline's own GDT, for the 32-bit `lgdt` in real mode */
+  uint16_t gdt_limit;
+  uint32_t gdt_base;
+  /* AP n runs on [stack_base + (n - 1) * stack_size, stack_base + n * stack_size) */
+  uint64_t stack_base;
+  uint64_t stack_size;
+  uint64_t entry;
+  /* Each AP takes one (lock xadd); the ones >= max_index halt */
+  uint32_t next_index;
+  uint32_t max_index;
+  uint64_t gdt[3];
+};
+
+static_assert(offsetof(APTrampolineParamsLayout, long_mode_entry) == 4, "see APTrampolineParams in asmfunc.asm");
+static_assert(offsetof(APTrampolineParamsLayout, gdt_limit) == 10, "see APTrampolineParams in asmfunc.asm");
+static_assert(offsetof(APTrampolineParamsLayout, stack_base) == 16, "see APTrampolineParams in asmfunc.asm");
+static_assert(offsetof(APTrampolineParamsLayout, next_index) == 40, "see APTrampolineParams in asmfunc.asm");
+static_assert(offsetof(APTrampolineParamsLayout, gdt) == 48, "see APTrampolineParams in asmfunc.asm");
+
+volatile uint32_t &LAPICRegister(uint64_t addr)
+{
+  return *reinterpret_cast<volatile uint32_t *>(addr);
+}
+
+void WaitNanoseconds(uint64_t ns)
+{
+  const uint64_t end = NowNanoseconds() + ns;
+  while (NowNanoseconds() < end)
+  {
+    __builtin_ia32_pause();
+  }
+}
+
+/* Interrupts must be off: the two halves of the ICR are not written atomically */
+void SendICR(uint8_t apic_id, uint32_t command)
+{
+  while (LAPICRegister(kLAPICICRLow) & kICRSendPending)
+  {
+    __builtin_ia32_pause();
+  }
+  LAPICRegister(kLAPICICRHigh) = static_cast<uint32_t>(apic_id) << 24;
+  /* Writing the low half sends */
+  LAPICRegister(kLAPICICRLow) = command;
+}
+} // namespace
+
+void InitializeCPU(int index)
+{
+  CPU &cpu = cpus[index];
+  cpu.self = &cpu;
+  cpu.index = index;
+  cpu.apic_id = LAPICRegister(kLAPICID) >> 24;
+  WriteMSR(kMSRGSBase, reinterpret_cast<uint64_t>(&cpu));
+  /* The Local APIC of an AP is software disabled after INIT */
+  LAPICRegister(kLAPICSpuriousVector) = kLAPICSoftwareEnable | kSpuriousVector;
+}
+
+int OnlineCPUCount()
+{
+  int count = 0;
+  for (auto &cpu : cpus)
+  {
+    if (__atomic_load_n(&cpu.online, __ATOMIC_ACQUIRE))
+    {
+      ++count;
+    }
+  }
+  return count;
+}
+
+void SendIPI(int index, uint8_t vector)
+{
+  InterruptGuard guard;
+  SendICR(cpus[index].apic_id, kICRAssert | kICRFixed | vector);
+}
+
+Error StartAPs(APEntry *entry)
+{
+  /* The INIT-SIPI-SIPI delays are timed with NowNanoseconds(): not running without a calibrated TSC */
+  if (TSCFrequency() == 0)
+  {
+    return MAKE_ERROR(Error::kNoTimerSource);
+  }
+  const size_t trampoline_size = APTrampolineEnd - APTrampoline;
+  const auto page = memory_manager->Allocate(1);
+  if (page.error)
+  {
+    return page.error;
+  }
+  /* The lowest free frame is taken; nothing is left below 1 MiB otherwise */
+  if (page.value.ID() >= kRealModeFrames || trampoline_size > kBytesPerFrame)
+  {
+    memory_manager->Free(page.value, 1);
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  const auto stacks = memory_manager->Allocate(kAPStackFrames * (kMaxCPUs - 1));
+  if (stacks.error)
+  {
+    memory_manager->Free(page.value, 1);
+    return stacks.error;
+  }
+
+  uint8_t *const trampoline = reinterpret_cast<uint8_t *>(page.value.Frame());
+  const uint32_t base = reinterpret_cast<uintptr_t>(trampoline);
+  memcpy(trampoline, APTrampoline, trampoline_size);
+  auto &params = *reinterpret_cast<APTrampolineParamsLayout *>(trampoline + (APTrampolineParams - APTrampoline));
+  params.cr3 = GetCR3();
+  params.long_mode_entry += base;
+  params.gdt_base += base;
+  params.stack_base = reinterpret_cast<uint64_t>(stacks.value.Frame());
+  params.stack_size = kAPStackFrames * kBytesPerFrame;
+  params.entry = reinterpret_cast<uint64_t>(entry);
+  params.next_index = 1;
+  params.max_index = kMaxCPUs;
+
+  {
+    InterruptGuard guard;
+    SendICR(0, kICRAllExcludingSelf | kICRAssert | kICRINIT);
+    WaitNanoseconds(kINITDelayNs);
+    /* The second SIPI is for the APs that missed the first one; an AP already running ignores it */
+    for (int i = 0; i < 2; ++i)
+    {
+      SendICR(0, kICRAllExcludingSelf | kICRAssert | kICRStartUp | static_cast<uint32_t>(page.value.ID()));
+      WaitNanoseconds(kSIPIDelayNs);
+    }
+  }
+
+  const uint64_t start = NowNanoseconds();
+  WaitNanoseconds(kAPArriveTimeoutNs);
+  uint32_t arrived = __atomic_load_n(&params.next_index, __ATOMIC_ACQUIRE);
+  if (arrived > static_cast<uint32_t>(kMaxCPUs))
+  {
+    Log(kWarn, "StartAPs: %u APs, only %d CPUs are used\n", arrived - 1, kMaxCPUs);
+    arrived = kMaxCPUs;
+  }
+  while (OnlineCPUCount() < static_cast<int>(arrived) && NowNanoseconds() - start < kAPOnlineTimeoutNs)
+  {
+    __builtin_ia32_pause();
+  }
+  Log(kInfo, "StartAPs: %d of %u CPUs online\n", OnlineCPUCount(), arrived);
+  /* The trampoline page and the stacks are kept: a late AP may still take them */
+  return MAKE_ERROR(Error::kSuccess);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file cpu.hpp
+ *
+ * Per-CPU data and the AP (Application Processor) startup
+ *
+ *   - Each CPU's IA32_GS_BASE points to its `CPU`; CurrentCPU() is one %gs load
+ *   - The APs are started by an INIT-SIPI-SIPI broadcast: they run the
+ *   trampoline (asmfunc.asm) from a page below 1 MiB, switch from real mode to
+ *   long mode with the BSP's page table, and call the entry on their own stack
+ *   - There is no ACPI (MADT) parser: the APs count themselves as they arrive,
+ *   up to kMaxCPUs
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+static const int kMaxCPUs = 16;
+
+struct CPU
+{
+  /* %gs:0 */
+  CPU *self;
+  /* 0 is the BSP; the APs in the order they arrived */
+  int index;
+  uint8_t apic_id;
+  /* Set once the CPU schedules threads (ThreadManager) */
+  bool online;
+};
+
+extern std::array<CPU, kMaxCPUs> cpus;
+
+inline CPU &CurrentCPU()
+{
+  CPU *cpu;
+  __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+  return *cpu;
+}
+
+/** @brief Point this CPU's GS base to cpus[index], and enable its Local APIC
+ *
+ * After SetDSAll(): loading GS may clear the base
+ */
+void InitializeCPU(int index);
+
+/** @brief The number of CPUs online, the BSP included */
+int OnlineCPUCount();
+
+/** @brief Send the interrupt `vector` to CPU `index` (fixed delivery, physical destination) */
+void SendIPI(int index, uint8_t vector);
+
+/* The AP's entry from the trampoline, on its own stack, with interrupts off; must not return */
+using APEntry = void(int cpu_index);
+
+/** @brief Start every AP, and wait for them to be online (or for the timeout)
+ *
+ * Needs NowNanoseconds() (the delays of the INIT-SIPI-SIPI sequence), and the
+ * frame allocator (the trampoline page and the AP stacks)
+ * @return Error::kNoTimerSource if InitializeTimekeeping() has failed: the BSP runs alone
+ */
+Error StartAPs(APEntry *entry);
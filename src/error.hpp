@@ -30,6 +30,9 @@ public:
     kNoWaiter,
     kEndpointNotInCharge,
     kNoPCIMSI,
+    kNoTimerSource,
+    kNoSuchTimer,
+    kCommandFailed,
     kLastOfCode, // It should always be the last element of the "enum Code"
   };
 
@@ -57,6 +60,9 @@ private:
       "kNoWaiter",
       "kEndpointNotInCharge",
       "kNoPCIMSI",
+      "kNoTimerSource",
+      "kNoSuchTimer",
+      "kCommandFailed",
   };
   /* The numeric expression of the last enum elment should equal to the array size */
   static_assert(Error::Code::kLastOfCode == code_names_.size());
@@ -12,7 +12,8 @@ static int32_t path_valid_format(const char* filename)
 	{
 		return 0;
 	}
-	int32_t len = kstrnlen(filename, OS_PATH_MAX_LENGTH);
+	/* Only "0:/" is checked, no need to scan further */
+	int32_t len = kstrnlen(filename, 3);
 	return (len >= 3 && is_digit(filename[0]) && (kmemcmp((void*)&filename[1], ":/", 2) == 0));
 }
 
@@ -41,7 +42,11 @@ static PATH_ROOT* path_create_root(int32_t driver_number)
 	return pr;
 }
 
-/* Get the "foo" from "///foo/bar" */
+/*
+ * Get the "foo" from "///foo/bar"
+ * `i` is kstrlen(path_part) (the buffer is zeroed and only non-zero bytes are
+ * written), so the part is never rescanned
+ */
 static const char* path_get_path_part(const char** path)
 {
 	char* path_part = kzalloc(OS_PATH_MAX_LENGTH);
@@ -51,7 +56,7 @@ static const char* path_get_path_part(const char** path)
 		if (**path == 0)
 			break;
 		// If already found some path_part, on encountering the '/', stop and return
-		if (**path == '/' && kstrnlen(path_part, OS_PATH_MAX_LENGTH) != 0)
+		if (**path == '/' && i != 0)
 		{
 			(*path)++;
 			return path_part;
@@ -59,7 +64,7 @@ static const char* path_get_path_part(const char** path)
 		path_part[i] = **path;
 		(*path)++;
 	}
-	if (kstrnlen(path_part, OS_PATH_MAX_LENGTH) == 0)
+	if (i == 0)
 	{
 		kfree(path_part);
 		return NULL;
@@ -122,7 +127,7 @@ PATH_ROOT* path_parse(const char* path_str, const char* current_dir_path)
 	const char* tmp_p_ptr = path_str;
 	PATH_ROOT* path_root = 0;
 
-	if (kstrlen(path_str) > OS_PATH_MAX_LENGTH)
+	if (kstrnlen(path_str, OS_PATH_MAX_LENGTH + 1) > OS_PATH_MAX_LENGTH)
 		return NULL;
 	drive_number = path_get_drive_number_by_path(&tmp_p_ptr);
 	if (drive_number < 0)
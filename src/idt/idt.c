@@ -34,7 +34,7 @@ MPFIFO32* get_keymousefifo()
 
 void idt_init()
 {
-	mpfifo32_init(&keymousefifo, _keymousefifobuf, (sizeof(_keymousefifobuf) / sizeof(_keymousefifobuf[0])), NULL);
+	mpfifo32_init(&keymousefifo, _keymousefifobuf, (sizeof(_keymousefifobuf) / sizeof(_keymousefifobuf[0])));
 
 	/* Initialize the IDTR */
 	idtr.size = (uint16_t)(sizeof(idts) - 1);
@@ -58,6 +58,11 @@ public:
   enum Number
   {
     kXHCI = 0x40,
+    kLAPICTimer = 0x41,
+    /* IPI: a thread was made runnable on the target CPU, or there is work to steal */
+    kReschedule = 0x42,
+    /* xHCI interrupter 1 (MSI-X entry 1): the bulk/isochronous transfer events */
+    kXHCIBulk = 0x43,
   };
 };
 
@@ -72,3 +77,30 @@ struct InterruptFrame
 };
 
 void __attribute__((no_caller_saved_registers)) NotifyEndOfInterrupt();
+
+/**
+ * Disable interrupts in a scope, and restore RFLAGS.IF on exit
+ *   - nests: an inner guard leaves interrupts off when the outer one turned them off
+ *   - usable inside an interrupt handler (IF is already 0)
+ */
+class InterruptGuard
+{
+public:
+  InterruptGuard()
+  {
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags_) : : "memory");
+  }
+  ~InterruptGuard()
+  {
+    if (rflags_ & kRFLAGSInterruptFlag)
+    {
+      __asm__ volatile("sti" : : : "memory");
+    }
+  }
+  InterruptGuard(const InterruptGuard &) = delete;
+  InterruptGuard &operator=(const InterruptGuard &) = delete;
+
+private:
+  static const uint64_t kRFLAGSInterruptFlag = 1u << 9;
+  uint64_t rflags_;
+};
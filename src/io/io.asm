@@ -9,6 +9,7 @@ global _io_hlt, _io_cli, _io_sti, _io_stihlt
 global _io_in8, _io_in16, _io_in32
 global _io_out8, _io_out16, _io_out32
 global _io_get_eflags, _io_set_eflags, _io_get_cr0, _io_set_cr0
+global _io_rdtsc
 
 _io_hlt: ; void _io_hlt(void);
     HLT
@@ -121,6 +122,10 @@ _io_set_cr0: ; uint32_t _io_set_cr0(uint32_t cr0);
     pop ebp
     ret
 
+_io_rdtsc: ; uint64_t _io_rdtsc(void);
+    RDTSC				; edx:eax, which is also how a uint64_t is returned
+    RET
+
 _io_write_mem8: ; void write_mem8(uint32_t addr, uint8_t data);
     push ebp
     mov ebp, esp
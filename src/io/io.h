@@ -66,6 +66,8 @@ uint32_t _io_get_cr0(void);
 /* Set the cr0 flags */
 uint32_t _io_set_cr0(uint32_t cr0);
 bool io_get_is_cli(void);
+/* Read the Time-Stamp Counter */
+uint64_t _io_rdtsc(void);
 
 #endif
 
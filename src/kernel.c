@@ -56,6 +56,8 @@ int32_t get_guard()
  */
 void kernel_main(void)
 {
+	/* Pick the kmem* implementations first, everything below uses them */
+	kutil_init();
 	fifo32_init(&fifo32_common, __fifo32_buffer, 4096);
 	idt_init();
 
@@ -87,6 +89,8 @@ void kernel_main(void)
 	}
 
 	// heap_debug();
+	if (DEBUG_BENCH)
+		bench_all();
 
 	/* Import GDTR0 and switch to the GDTR1 */
 	gdt_migration();
@@ -101,33 +105,20 @@ void kernel_main(void)
 
 		task4 = mprocess_task_alloc();
 		/**
-		 * -8 if __tss_b_main(...) has 1 parameter (to keep ESP+4 inbound), or
-		 * -12 if use a far call; anyway, far jumping is used here.
+		 * -8 if __tss_b_main(...) has 1 parameter (to keep ESP+4 inbound);
+		 * [esp] is the return address, see mprocess_task_set_entry()
 		 */
-		task4->tss.esp = (uint32_t) (uintptr_t) kzalloc(4096 * 16) + 4096*16 - 4;
-		task4->tss.eip = (uint32_t) &__tss4_main;
-		task4->tss.cs = OS_GDT_KERNEL_CODE_SEGMENT_SELECTOR;
-		task4->tss.es = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		task4->tss.ss = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		task4->tss.ds = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		task4->tss.fs = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		task4->tss.gs = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
+		mprocess_task_set_entry(task4, (uint32_t) &__tss4_main, (uint32_t) (uintptr_t) kzalloc(4096 * 16) + 4096*16 - 4);
 		mprocess_task_run(task4, 2, 1);
 
 		taskConsole = mprocess_task_alloc();
 		/**
-		 * -8 if __tss_b_main(...) has 1 parameter (to keep ESP+4 inbound), or
-		 * -12 if use a far call; anyway, far jumping is used here.
+		 * -8 if __tss_b_main(...) has 1 parameter (to keep ESP+4 inbound);
+		 * [esp] is the return address, see mprocess_task_set_entry()
 		 */
-		taskConsole->tss.esp = (uint32_t) (uintptr_t) kzalloc(4096 * 16) + 4096*16 - 8;
-		*(uint32_t *)(taskConsole->tss.esp + 4) = (uint32_t) get_sheet_console();
-		taskConsole->tss.eip = (uint32_t) &console_main;
-		taskConsole->tss.cs = OS_GDT_KERNEL_CODE_SEGMENT_SELECTOR;
-		taskConsole->tss.es = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		taskConsole->tss.ss = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		taskConsole->tss.ds = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		taskConsole->tss.fs = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-		taskConsole->tss.gs = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
+		uint32_t espConsole = (uint32_t) (uintptr_t) kzalloc(4096 * 16) + 4096*16 - 8;
+		*(uint32_t *)(espConsole + 4) = (uint32_t) get_sheet_console();
+		mprocess_task_set_entry(taskConsole, (uint32_t) &console_main, espConsole);
 		mprocess_task_run(taskConsole, 2, 2);
 		_io_sti();
 	}
@@ -140,11 +131,9 @@ void eventloop(void)
 {
 	int32_t data = 0;
 	int32_t data_keymouse = 0;
-	int32_t keymousefifobuf_usedBytes = 0;
 	MPFIFO32 *keymousefifo = get_keymousefifo();
-	keymousefifo->task = task3;
 
-	mpfifo32_init(&fifoTSS3, __fifobuf3, 4096, task3);
+	mpfifo32_init(&fifoTSS3, __fifobuf3, 4096);
 	TIMER *timer_put = NULL, *timer_1s = NULL;
 	(void) timer_put;
 
@@ -152,61 +141,42 @@ void eventloop(void)
 	timer_settimer(timer_1s, 100, 1);
 
 	int32_t countTSS3 = 0;
+	/* The timers first */
+	MPFIFO32 *sources[] = {&fifoTSS3, keymousefifo};
 
 	for(;;)
 	{
 		countTSS3++;
-		/**
-		 * Without cli(), it seems the printf in some cases cannot finish (may be buffed sometime)
-		 */
-		_io_cli();
-		keymousefifobuf_usedBytes = mpfifo32_status_getUsageB(keymousefifo);
-		if (!mpfifo32_status_getUsageB(&fifoTSS3) && keymousefifobuf_usedBytes <= 0)
+		/* Sleeps until an event; the events are handled with interrupts on */
+		const int32_t source = mpfifo32_wait_any(sources, sizeof(sources) / sizeof(sources[0]), MPFIFO32_WAIT_FOREVER);
+
+		if (source == 0)
 		{
-			mprocess_task_sleep(task3);
-			_io_sti();
-			//asm("pause");
+			data = mpfifo32_dequeue(&fifoTSS3);
+			if (data == 1)
+			{
+				timer_settimer(timer_1s, 100, 1);
+			}
+
+			/* TIMER timer_render */
+			if (data == 6)
+			{
+				// timer_settimer(timer_render, 10, 6);
+			}
 			continue;
 		}
+		if (source != 1)
+			continue;
+
 		/**
+		 * Keyboard and Mouse PIC interruptions handling
 		 * Every data in the fifo buffer should be sent by an interrupt
 		 * e.g. One mouse move emits 3 data packets, in 3 intterrupts
 		 */
-		if (!mpfifo32_status_getUsageB(&fifoTSS3))
-		{
-			goto keymouse;
-			// goto wait_next_event;
-		}
-
-		data = mpfifo32_dequeue(&fifoTSS3);
-
-		if (data < 0)
-		{
-			goto wait_next_event;
-		}
-
-		if (data == 1)
-		{
-			timer_settimer(timer_1s, 100, 1);
-		}
-
-		/* TIMER timer_render */
-		if (data == 6)
-		{
-			// timer_settimer(timer_render, 10, 6);
-		}
-
-keymouse:
-		/* Keyboard and Mouse PIC interruptions handling */
-		if (keymousefifobuf_usedBytes == 0)
-		{
-			goto wait_next_event;
-		}
 		data_keymouse = mpfifo32_dequeue(keymousefifo);
 		/* May be -EIO */
 		if (data_keymouse < 0)
-			// continue;
-			goto wait_next_event;
+			continue;
 
 		/**
 		 * Keyboard;
@@ -217,17 +187,15 @@ keymouse:
 		{
 			int32_t kbdscancode = data_keymouse - DEV_FIFO_KBD_START;
 			SHEET *sc = get_sheet_console();
-			if (!sc)
+			SHEET *focus = sc ? sc->ctl->sheets[sc->ctl->zTop - 1] : NULL;
+			/* No console to send to */
+			if (!sc || (focus == sc && !mpfifo32Console))
 			{
-fallback:
 				int21h_handler(kbdscancode & 0xff);
 				continue;
 			}
-			SHEET *focus = sc->ctl->sheets[sc->ctl->zTop - 1];
 			if (focus == sc)
 			{
-				if (!mpfifo32Console)
-					goto fallback;
 				mpfifo32_enqueue(mpfifo32Console, data_keymouse);
 			} else {
 				//printf("d");
@@ -238,11 +206,6 @@ fallback:
 			int32_t mousescancode = data_keymouse - DEV_FIFO_MOUSE_START;
 			int2ch_handler(mousescancode & 0xff);
 		}
-
-wait_next_event:
-		_io_sti();
-		/* Somewhere (e.g. here or in the first "if" block), a pause is necessary. Because without a pause, the loop will be infinite _cli() forever */
-		// asm("pause");
 	}
 }
 
@@ -253,7 +216,7 @@ void __tss4_main()
 	int32_t data = 0;
 	int32_t color = COL8_FFFFFF;
 
-	mpfifo32_init(&fifoTSS4, __fifobuf4, 4096, task4);
+	mpfifo32_init(&fifoTSS4, __fifobuf4, 4096);
 	TIMER *timer_render = NULL, *timer_1s = NULL, *timer_5s = NULL;
 	timer_1s = timer_alloc_customfifo(&fifoTSS4);
 	timer_settimer(timer_1s, 100, 11);
@@ -267,17 +230,8 @@ void __tss4_main()
 	for (;;)
 	{
 		counterTSS4++;
-		_io_cli();
-
-		if (mpfifo32_status_getUsageB(&fifoTSS4) <= 0)
-		{
-			/* Sleep first, then sti(), to avoid interrupt */
-			mprocess_task_sleep(task4);
-			_io_sti();
-			//asm("pause");
-
+		if (mpfifo32_wait(&fifoTSS4, MPFIFO32_WAIT_FOREVER) < 0)
 			continue;
-		}
 
 		data = mpfifo32_dequeue(&fifoTSS4);
 
@@ -374,10 +328,9 @@ void int2ch_handler(uint8_t scancode)
 
 void console_main(SHEET *sheet)
 {
-	TASK *task = mprocess_task_get_current();
 	mpfifo32Console = kzalloc(sizeof(MPFIFO32));
 	int32_t *__fifobuf = kzalloc(sizeof(int32_t) * 512);
-	mpfifo32_init(mpfifo32Console, __fifobuf, 512, task);
+	mpfifo32_init(mpfifo32Console, __fifobuf, 512);
 
 	TEXTBOX *t = sheet->textbox;
 
@@ -396,13 +349,8 @@ void console_main(SHEET *sheet)
 
 	for (;;)
 	{
-		_io_cli();
-		if (mpfifo32_status_getUsageB(mpfifo32Console) == 0) {
-			mprocess_task_sleep(task);
-			_io_sti();
-		} else {
+		if (mpfifo32_wait(mpfifo32Console, MPFIFO32_WAIT_FOREVER) >= 0) {
 			i = mpfifo32_dequeue(mpfifo32Console);
-			_io_sti();
 			if (i >= DEV_FIFO_KBD_START && i < DEV_FIFO_KBD_END)
 			{
 				int32_t kbdscancode = i - DEV_FIFO_KBD_START;
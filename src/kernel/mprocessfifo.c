@@ -1,19 +1,26 @@
 /**
  * A wrapper of FIFO32 used in multitasking
- *   - When data enqueue, add the task back to scheduler list, if it was asleep
+ *   - The FIFO32 is locked (SPINLOCK, irqsave) for the enqueue and the dequeue;
+ *   the status is a plain read
+ *   - A consumer blocks in mpfifo32_wait_any() until one of its FIFOs has data,
+ *   or the timeout; each enqueue wakes the tasks waiting on that FIFO only
  */
 #include "kernel/mprocessfifo.h"
+#include "kernel/waitqueue.h"
+#include "pic/timer.h"
 #include "util/fifo.h"
+#include "io/io.h"
 #include "status.h"
 
-void mpfifo32_init(MPFIFO32 *f, int32_t *buf, int32_t size, TASK *task)
+void mpfifo32_init(MPFIFO32 *f, int32_t *buf, int32_t size)
 {
 	if (!f)
 		return;
 	if (!buf)
 		return;
+	spinlock_init(&f->lock, NULL);
 	fifo32_init(&f->fifo32, buf, size);
-	f->task = task;
+	waitqueue_init(&f->readers);
 	return;
 }
 
@@ -21,19 +28,22 @@ int32_t mpfifo32_enqueue(MPFIFO32 *f, int32_t data)
 {
 	if (!f)
 		return -EIO;
+	const bool isCli = spinlock_lock_irqsave(&f->lock);
 	const int32_t res = fifo32_enqueue(&f->fifo32, data);
-	TASK *t = f->task;
-	if (!t)
-		return res;
-	/* Should be asleep, awaiting awakening */
-	if (t->flags == MPROCESS_FLAGS_ALLOCATED)
-		mprocess_task_run(t, -1, 0); /* Keep the priority unchanged */
+	spinlock_unlock_irqrestore(&f->lock, isCli);
+	if (res == 0)
+		waitqueue_wake_all(&f->readers);
 	return res;
 }
 
 int32_t mpfifo32_dequeue(MPFIFO32 *f)
 {
-	return fifo32_dequeue(&f->fifo32);
+	if (!f)
+		return -EIO;
+	const bool isCli = spinlock_lock_irqsave(&f->lock);
+	const int32_t data = fifo32_dequeue(&f->fifo32);
+	spinlock_unlock_irqrestore(&f->lock, isCli);
+	return data;
 }
 
 int32_t mpfifo32_peek(const MPFIFO32 *f)
@@ -46,3 +56,118 @@ int32_t mpfifo32_status_getUsageB(const MPFIFO32 *f)
 	return fifo32_status_getUsageB(&f->fifo32);
 }
 
+/* The first FIFO with data, -1 if none */
+static int32_t __mpfifo32_first_ready(MPFIFO32 *fifos[], int32_t n)
+{
+	for (int32_t i = 0; i < n; i++)
+	{
+		if (mpfifo32_status_getUsageB(fifos[i]) > 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Block the current task until one of `fifos` has data
+ *   - Return the index of the first FIFO with data (lower indexes first), the
+ *   data is left to dequeue
+ *   - Return -ETIMEDOUT after `timeout` ticks (0: do not block;
+ *   MPFIFO32_WAIT_FOREVER: no deadline)
+ *   - The deadline is a timer pushing into a private FIFO, waited on with the others
+ */
+int32_t mpfifo32_wait_any(MPFIFO32 *fifos[], int32_t n, uint32_t timeout)
+{
+	if (!fifos || n <= 0 || n > MPFIFO32_WAIT_MAX)
+		return -EINVARG;
+	int32_t ready = __mpfifo32_first_ready(fifos, n);
+	if (ready >= 0)
+		return ready;
+	if (timeout == 0)
+		return -ETIMEDOUT;
+
+	/* NULL before mprocess_init(): halt until the next interrupt instead of sleeping */
+	TASK *task = mprocess_task_get_current();
+	WAITER waiters[MPFIFO32_WAIT_MAX + 1];
+	int32_t timeoutBuf[1];
+	MPFIFO32 timeoutFifo;
+	TIMER *timer = NULL;
+	if (timeout != MPFIFO32_WAIT_FOREVER)
+	{
+		mpfifo32_init(&timeoutFifo, timeoutBuf, 1);
+		timer = timer_alloc_customfifo(&timeoutFifo);
+		if (!timer)
+			return -ENOMEM;
+		waitqueue_add(&timeoutFifo.readers, &waiters[n], task);
+		timer_settimer(timer, timeout, 1);
+	}
+	for (int32_t i = 0; i < n; i++)
+		waitqueue_add(&fifos[i]->readers, &waiters[i], task);
+
+	/* Check and sleep with interrupts off, or a wakeup in between is lost */
+	const bool isCli = io_get_is_cli();
+	if (!isCli)
+		_io_cli();
+	for (;;)
+	{
+		ready = __mpfifo32_first_ready(fifos, n);
+		if (ready >= 0)
+			break;
+		if (timer && mpfifo32_status_getUsageB(&timeoutFifo) > 0)
+		{
+			ready = -ETIMEDOUT;
+			break;
+		}
+		if (task)
+		{
+			mprocess_task_sleep(task);
+		} else {
+			_io_stihlt();
+			_io_cli();
+		}
+	}
+	if (!isCli)
+		_io_sti();
+
+	for (int32_t i = 0; i < n; i++)
+		waitqueue_remove(&waiters[i]);
+	if (timer)
+	{
+		/* Stops the timer; timeoutFifo is not freed, it is not owned by the timer */
+		timer_free(timer);
+		waitqueue_remove(&waiters[n]);
+	}
+	return ready;
+}
+
+int32_t mpfifo32_wait(MPFIFO32 *f, uint32_t timeout)
+{
+	MPFIFO32 *fifos[1] = {f};
+	return mpfifo32_wait_any(fifos, 1, timeout);
+}
+
+/**
+ * The non-blocking paths of mpfifo32_wait_any()
+ */
+bool test_mpfifo32(void)
+{
+	MPFIFO32 a, b;
+	int32_t bufa[4], bufb[4];
+	mpfifo32_init(&a, bufa, 4);
+	mpfifo32_init(&b, bufb, 4);
+	MPFIFO32 *fifos[] = {&a, &b};
+
+	if (mpfifo32_wait_any(fifos, 2, 0) != -ETIMEDOUT)
+		return false;
+	if (mpfifo32_wait_any(fifos, 0, 0) != -EINVARG)
+		return false;
+	mpfifo32_enqueue(&b, 7);
+	if (mpfifo32_wait_any(fifos, 2, MPFIFO32_WAIT_FOREVER) != 1)
+		return false;
+	/* Lower indexes first */
+	mpfifo32_enqueue(&a, 3);
+	if (mpfifo32_wait_any(fifos, 2, 0) != 0)
+		return false;
+	if (mpfifo32_dequeue(&a) != 3 || mpfifo32_wait(&b, 0) != 0 || mpfifo32_dequeue(&b) != 7)
+		return false;
+	return mpfifo32_wait(&a, 0) == -ETIMEDOUT && waitqueue_is_empty(&a.readers);
+}
@@ -4,17 +4,30 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "util/fifo.h"
+#include "util/spinlock.h"
 #include "kernel/process.h"
+#include "kernel/waitqueue.h"
+
+/* mpfifo32_wait_any(): no deadline */
+#define MPFIFO32_WAIT_FOREVER UINT32_MAX
+/* mpfifo32_wait_any(): at most this many FIFOs at once */
+#define MPFIFO32_WAIT_MAX 8
 
 typedef struct MPFIFO32 {
+	/* fifo32; enqueued from the INT handlers, so taken with interrupts off */
+	SPINLOCK lock;
 	FIFO32 fifo32;
-	TASK *task;
+	/* The tasks in mpfifo32_wait_any(); woken on every enqueue */
+	WAITQUEUE readers;
 } MPFIFO32;
 
-void mpfifo32_init(MPFIFO32 *f, int32_t *buf, int32_t size, TASK *task);
+void mpfifo32_init(MPFIFO32 *f, int32_t *buf, int32_t size);
 int32_t mpfifo32_enqueue(MPFIFO32 *f, int32_t data);
 int32_t mpfifo32_dequeue(MPFIFO32 *f);
 int32_t mpfifo32_peek(const MPFIFO32 *f);
 int32_t mpfifo32_status_getUsageB(const MPFIFO32 *f);
+int32_t mpfifo32_wait_any(MPFIFO32 *fifos[], int32_t n, uint32_t timeout);
+int32_t mpfifo32_wait(MPFIFO32 *f, uint32_t timeout);
+bool test_mpfifo32(void);
 
 #endif
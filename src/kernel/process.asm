@@ -1,9 +1,21 @@
 SECTION .text
 
-global _farjmp:FUNCTION
-_farjmp:	; void farjmp(uint32_t eip, uint16_t cs)
-    JMP FAR[ESP + 4]	; a hack? "FF /5" "JMP m16:32" ==> jmp cs:eip; also eip is ignored
-    ret
+global _mprocess_switch:FUNCTION
+_mprocess_switch:	; void _mprocess_switch(uint32_t *espPrev, uint32_t espNext)
+    MOV EAX, [ESP + 4]	; espPrev
+    MOV EDX, [ESP + 8]	; espNext
+    PUSH EBP		; cdecl callee-saved registers; the caller-saved ones are already on the stack (or dead)
+    PUSH EBX
+    PUSH ESI
+    PUSH EDI
+    PUSHFD		; IF belongs to the task, e.g. it was switched out in an interrupt handler
+    MOV [EAX], ESP
+    MOV ESP, EDX	; the stack of the next task, the same frame as above
+    POPFD
+    POP EDI
+    POP ESI
+    POP EBX
+    POP EBP
+    RET			; to where the next task called _mprocess_switch(), or its entry
 
 times 512-($ - $$) db 0
-
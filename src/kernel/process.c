@@ -12,15 +12,34 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+_Static_assert(OS_MPROCESS_TASKLEVELS_MAX <= 32, "TASKCTL.levelBitmap is a uint32_t");
+
 TASKCTL *taskctl;
 int32_t __MPGUARD = 0;
 
+static void __mprocess_taskctl_init(TASKCTL *ctl)
+{
+	ctl->current = NULL;
+	ctl->levelBitmap = 0;
+	for (int32_t i = 0; i < OS_MPROCESS_TASKLEVELS_MAX; i++)
+	{
+		ctl->level[i].running = 0;
+		dlist_init(&ctl->level[i].ready);
+	}
+	dlist_init(&ctl->freelist);
+	for (int32_t i = 0; i < OS_MPROCESS_TASK_MAX; i++)
+	{
+		ctl->tasks0[i].flags = MPROCESS_FLAGS_FREE;
+		dlist_init(&ctl->tasks0[i].taskDL);
+		dlist_insert_before(&ctl->freelist, &ctl->tasks0[i].taskDL);
+	}
+}
+
 /**
  * Should be called after the gdtr migration
- *   - Append GDT1 with 1000 TSS segments
- *   - ltr the first
+ *   - Append GDT1 with the only TSS segment, and ltr it
  *   - Set the initial task_timer with NULL fifo
- *   - Return the first TASK
+ *   - Return the first TASK (the caller itself)
  */
 TASK *mprocess_init(void)
 {
@@ -36,54 +55,49 @@ TASK *mprocess_init(void)
 	GDTR32 *gdtr = gdt_get_gdtr();
 	GDT32SD *gdts = gdt_get_gdts();
 	taskctl = (TASKCTL *) kzalloc(sizeof(TASKCTL));
-	for (int32_t i = 0; i < OS_MPROCESS_TASK_MAX; i++)
-	{
-		taskctl->tasks0[i].flags = MPROCESS_FLAGS_FREE;
-		taskctl->tasks0[i].gdtSegmentSelector = (OS_MPROCESS_TSS_GDT_INDEX_START + i) * 8;
-		GDT32SD sd = {0};
-		/**
-		 * Intel Software Developer Manual, Volume 3-A.
-		 * Section 3.4.5: Segment Descriptors:
-		 *   - Offsets less than or equal to the segment limit generate
-		 * general-protection exceptions or stack-fault exceptions
-		 *
-		 * The `le` condition indicates the `limit` probably should not -1
-		 *
-		 * Use the recommended magic access_byte 0x89
-		 *
-		 */
-		gdt_set_segmdesc(&sd, sizeof(TSS32), (uint32_t) &taskctl->tasks0[i].tss, 0x89);
-		gdt_append(gdtr, gdts, &sd);
-	}
+	__mprocess_taskctl_init(taskctl);
+
+	/**
+	 * Tasks are switched in software; the TSS is only read by the CPU on a
+	 * ring transition (ss0:esp0), so a single one is enough
+	 */
+	taskctl->tss.ss0 = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
+	taskctl->tss.iopb = 0x40000000;
+	GDT32SD sd = {0};
+	/**
+	 * Intel Software Developer Manual, Volume 3-A.
+	 * Section 3.4.5: Segment Descriptors:
+	 *   - Offsets less than or equal to the segment limit generate
+	 * general-protection exceptions or stack-fault exceptions
+	 *
+	 * The `le` condition indicates the `limit` probably should not -1
+	 *
+	 * Use the recommended magic access_byte 0x89
+	 *
+	 */
+	gdt_set_segmdesc(&sd, sizeof(TSS32), (uint32_t) &taskctl->tss, 0x89);
+	taskctl->tssSegmentSelector = gdt_append(gdtr, gdts, &sd);
 
 	bool isCli = io_get_is_cli();
 	if (!isCli)
 		_io_cli();
 
 	gdt1_reload(gdtr);
+	_gdt_ltr(taskctl->tssSegmentSelector);
 
-	/* Init the current task */
+	/* Init the current task; its context is saved on the first switch */
 	task = mprocess_task_alloc();
-	task->flags = MPROCESS_FLAGS_RUNNING;
 	task->priority = 2;
 	task->level = 0;
 	__mprocess_task_add(task);
-	__mprocess_task_update_currentlv();
-	_gdt_ltr((uint16_t) task->gdtSegmentSelector);
+	taskctl->current = task;
 	TIMER *tssTimer = timer_get_tssTimer();
 	timer_settimer(tssTimer, task->priority, 0);
 
 	TASK *taskIdle = mprocess_task_alloc();
 	taskIdle->level = OS_MPROCESS_TASKLEVELS_MAX - 1;
 	taskIdle->priority = 1;
-	taskIdle->tss.esp = (uint32_t) (uintptr_t) kmalloc(4096) + 4096 - 4;
-	taskIdle->tss.eip = (uint32_t) &__mprocess_task_idle;
-	taskIdle->tss.cs = OS_GDT_KERNEL_CODE_SEGMENT_SELECTOR;
-	taskIdle->tss.es = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-	taskIdle->tss.ss = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-	taskIdle->tss.ds = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-	taskIdle->tss.fs = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
-	taskIdle->tss.gs = OS_GDT_KERNEL_DATA_SEGMENT_SELECTOR;
+	mprocess_task_set_entry(taskIdle, (uint32_t) &__mprocess_task_idle, (uint32_t) (uintptr_t) kmalloc(4096) + 4096 - 4);
 	mprocess_task_run(taskIdle, -1, 0);
 	if (!isCli)
 		_io_sti();
@@ -92,32 +106,54 @@ TASK *mprocess_init(void)
 
 TASK* mprocess_task_alloc(void)
 {
-	for (int32_t i = 0 ; i < OS_MPROCESS_TASK_MAX; i++)
-	{
-		if (taskctl->tasks0[i].flags == MPROCESS_FLAGS_FREE)
-		{
-			TASK *taskNew = &taskctl->tasks0[i];
-			taskNew->flags = MPROCESS_FLAGS_ALLOCATED;
-			taskNew->priority = 2;
- 			/* IF = 1 */
-			taskNew->tss.eflags = 0x00000202;
-			taskNew->tss.eax = 0;
-			taskNew->tss.ecx = 0;
-			taskNew->tss.edx = 0;
-			taskNew->tss.ebx = 0;
-			taskNew->tss.ebp = 0;
-			taskNew->tss.esi = 0;
-			taskNew->tss.edi = 0;
-			taskNew->tss.es = 0;
-			taskNew->tss.ds = 0;
-			taskNew->tss.fs = 0;
-			taskNew->tss.gs = 0;
-			taskNew->tss.ldtr = 0;
-			taskNew->tss.iopb = 0x40000000;
-			return taskNew;
-		}
-	}
-	return NULL;
+	if (taskctl->freelist.next == &taskctl->freelist)
+		return NULL;
+	TASK *taskNew = container_of(taskctl->freelist.next, TASK, taskDL);
+	dlist_remove(&taskNew->taskDL);
+	taskNew->flags = MPROCESS_FLAGS_ALLOCATED;
+	taskNew->priority = 2;
+	taskNew->esp = 0;
+	taskNew->esp0 = 0;
+	return taskNew;
+}
+
+/**
+ * Return a task to the free list; the stack is the caller's
+ *   - the current task cannot free itself (it is still running on its stack)
+ */
+void mprocess_task_free(TASK *task)
+{
+	if (!task || task->flags == MPROCESS_FLAGS_FREE || task == taskctl->current)
+		return;
+	mprocess_task_remove(task);
+	task->flags = MPROCESS_FLAGS_FREE;
+	dlist_insert_before(&taskctl->freelist, &task->taskDL);
+	return;
+}
+
+/**
+ * Make an ALLOCATED `task` start at `eip` when it is first switched to,
+ * as if `eip` was called with the stack pointer at `esp`:
+ *   - [esp] is the return address, set to __mprocess_task_exit()
+ *   - [esp + 4] ... are the arguments, left for the caller to fill in
+ *   - below [esp], the frame that _mprocess_switch() pops: eflags (IF = 1),
+ *   edi, esi, ebx, ebp, and `eip` to return to
+ */
+void mprocess_task_set_entry(TASK *task, uint32_t eip, uint32_t esp)
+{
+	if (!task)
+		return;
+	uint32_t *frame = (uint32_t *) (uintptr_t) esp;
+	frame[0] = (uint32_t) &__mprocess_task_exit;
+	frame -= 6;
+	frame[0] = 0x00000202;
+	frame[1] = 0; /* edi */
+	frame[2] = 0; /* esi */
+	frame[3] = 0; /* ebx */
+	frame[4] = 0; /* ebp */
+	frame[5] = eip;
+	task->esp = (uint32_t) (uintptr_t) frame;
+	return;
 }
 
 /**
@@ -145,7 +181,11 @@ void mprocess_task_run(TASK *task, int32_t level, uint32_t priority)
 		task->level = level;
 		__mprocess_task_add(task);
 	}
-	taskctl->lv_change = true;
+
+	/* The time slice may be off, see mprocess_task_autoswitch() */
+	TIMER *tssTimer = timer_get_tssTimer();
+	if (tssTimer && tssTimer->flags != TIMER_FLAGS_ONCOUNTDOWN)
+		timer_settimer(tssTimer, 1, 0);
 
 	return;
 }
@@ -159,25 +199,23 @@ void mprocess_task_run(TASK *task, int32_t level, uint32_t priority)
 void mprocess_task_autoswitch(void)
 {
 	TIMER *tssTimer = timer_get_tssTimer();
-	TASKLEVEL *tl = &taskctl->level[taskctl->now_lv];
-	TASK *taskNext = NULL, *taskCurrent = tl->tasks[tl->now];
+	TASK *taskNext = NULL, *taskCurrent = taskctl->current;
 
-	/**
-	 * A level change happens when higher level tasks[] are depleted
-	 * In that case, goto tlNext->tasks[0]
-	 */
-	tl->now++;
-	if (tl->now == tl->running)
-		tl->now = 0;
-	if (taskctl->lv_change == true)
+	/* Round robin: the current task goes after its peers (a no-op if it is alone) */
+	if (taskCurrent->flags == MPROCESS_FLAGS_RUNNING)
 	{
-		__mprocess_task_update_currentlv();
-		tl = &taskctl->level[taskctl->now_lv];
+		dlist_remove(&taskCurrent->taskDL);
+		dlist_insert_before(&taskctl->level[taskCurrent->level].ready, &taskCurrent->taskDL);
 	}
-	taskNext = tl->tasks[tl->now];
-	timer_settimer(tssTimer, taskNext->priority, 0);
-	if (taskNext != taskCurrent)
-		_farjmp(0, taskNext->gdtSegmentSelector);
+	taskNext = __mprocess_task_pick_next();
+	/**
+	 * The only runnable task (e.g., the idle task) needs no time slice;
+	 * leave the timer off so that a tickless PIT can sleep, until
+	 * mprocess_task_run() adds another task
+	 */
+	if (taskctl->level[taskNext->level].running > 1 || taskNext != taskCurrent)
+		timer_settimer(tssTimer, taskNext->priority, 0);
+	__mprocess_task_switch(taskNext);
 	return;
 }
 
@@ -199,11 +237,7 @@ void mprocess_task_sleep(TASK *task)
 	 *   - do switch
 	 */
 	if (task == taskCurrent)
-	{
-		__mprocess_task_update_currentlv();
-		taskCurrent = mprocess_task_get_current();
-		_farjmp(0, taskCurrent->gdtSegmentSelector);
-	}
+		__mprocess_task_switch(__mprocess_task_pick_next());
 	return;
 }
 
@@ -215,23 +249,64 @@ static void __mprocess_task_idle(void)
 	}
 }
 
+/**
+ * A task returned from its entry; sleep forever
+ * The task and its stack stay with whoever set the entry: once it sleeps,
+ * it is off the CPU and may be given back with mprocess_task_free()
+ */
+static void __mprocess_task_exit(void)
+{
+	_io_cli();
+	for (;;)
+	{
+		mprocess_task_sleep(taskctl->current);
+		_io_hlt();
+	}
+}
+
+/**
+ * Switch the CPU to `taskNext`; returns when the caller is switched back to
+ *   - interrupts are off during the switch, each task gets its own IF back
+ */
+static void __mprocess_task_switch(TASK *taskNext)
+{
+	TASK *taskPrev = taskctl->current;
+	if (taskNext == taskPrev)
+		return;
+	bool isCli = io_get_is_cli();
+	if (!isCli)
+		_io_cli();
+
+	taskctl->current = taskNext;
+	if (taskNext->esp0)
+		taskctl->tss.esp0 = taskNext->esp0;
+	_mprocess_switch(&taskPrev->esp, taskNext->esp);
+
+	if (!isCli)
+		_io_sti();
+	return;
+}
+
+/*
+ * Return NULL before mprocess_init()
+ */
 TASK* mprocess_task_get_current(void)
 {
-	TASKLEVEL *tl = &taskctl->level[taskctl->now_lv];
-	return tl->tasks[tl->now];
+	if (!taskctl)
+		return NULL;
+	return taskctl->current;
 }
 
+/* Append to the tail of its level */
 void __mprocess_task_add(TASK *task)
 {
-	TASKLEVEL *tl = &taskctl->level[task->level];
 	/* Prevent a task to be added multiple times */
-	for (int32_t i = 0; i < tl->running; i++)
-	{
-		if (tl->tasks[i] == task)
-			return;
-	}
-	tl->tasks[tl->running] = task;
+	if (task->flags == MPROCESS_FLAGS_RUNNING)
+		return;
+	TASKLEVEL *tl = &taskctl->level[task->level];
+	dlist_insert_before(&tl->ready, &task->taskDL);
 	tl->running++;
+	taskctl->levelBitmap |= 1u << task->level;
 	task->flags = MPROCESS_FLAGS_RUNNING;
 	return;
 }
@@ -240,43 +315,99 @@ void mprocess_task_remove(TASK *task)
 {
 	if (!task)
 		return;
-	int32_t i;
+	if (task->flags != MPROCESS_FLAGS_RUNNING)
+		return;
 	TASKLEVEL *tl = &taskctl->level[task->level];
-
-	for (i = 0; i < tl->running; i++)
-	{
-		if (tl->tasks[i] == task)
-			break; /* Found */
-	}
+	dlist_remove(&task->taskDL);
 	tl->running--;
-
-	if (i < tl->now)
-		tl->now--;
-	if (tl->now >= tl->running)
-		tl->now = 0;
-
-	task->flags = MPROCESS_FLAGS_ALLOCATED;
-
-	for (; i < tl->running; i++)
-		tl->tasks[i] = tl->tasks[i + 1];
 	if (tl->running == 0)
-		taskctl->lv_change = true;
+		taskctl->levelBitmap &= ~(1u << task->level);
+	task->flags = MPROCESS_FLAGS_ALLOCATED;
 	return;
+}
 
+/**
+ * The head of the highest (lowest numbered) non-empty level
+ *   - never empty after mprocess_init(), the idle task is always RUNNING
+ */
+static TASK *__mprocess_task_pick_next(void)
+{
+	if (!taskctl->levelBitmap)
+		return taskctl->current;
+	/* bsf */
+	int32_t lv = __builtin_ctz(taskctl->levelBitmap);
+	return container_of(taskctl->level[lv].ready.next, TASK, taskDL);
 }
 
-void __mprocess_task_update_currentlv(void)
+static TASKCTL __test_taskctl;
+
+/**
+ * Run queue operations on a private TASKCTL (no switch)
+ */
+bool test_mprocess(void)
 {
-	int32_t i = 0;
-	for (i = 0; i < OS_MPROCESS_TASKLEVELS_MAX; i++)
+	bool ok = true;
+	TASKCTL *saved = taskctl;
+	taskctl = &__test_taskctl;
+	__mprocess_taskctl_init(taskctl);
+
+	TASK *a = mprocess_task_alloc();
+	TASK *b = mprocess_task_alloc();
+	TASK *c = mprocess_task_alloc();
+	if (!a || !b || !c || a == b || b == c)
+		ok = false;
+	if (ok)
 	{
-		if (taskctl->level[i].running > 0)
-			break;
+		a->level = 3;
+		b->level = 3;
+		c->level = 5;
+		__mprocess_task_add(c);
+		__mprocess_task_add(a);
+		__mprocess_task_add(b);
+		/* Duplicated add is ignored */
+		__mprocess_task_add(a);
+		taskctl->current = a;
+		ok = ok && taskctl->levelBitmap == ((1u << 3) | (1u << 5));
+		ok = ok && taskctl->level[3].running == 2;
+		ok = ok && __mprocess_task_pick_next() == a;
+
+		/* Round robin within level 3, as mprocess_task_autoswitch() */
+		dlist_remove(&a->taskDL);
+		dlist_insert_before(&taskctl->level[3].ready, &a->taskDL);
+		ok = ok && __mprocess_task_pick_next() == b;
+
+		/* Level 3 depleted: fall to level 5 */
+		mprocess_task_remove(a);
+		mprocess_task_remove(b);
+		ok = ok && taskctl->levelBitmap == (1u << 5);
+		ok = ok && __mprocess_task_pick_next() == c;
+		ok = ok && a->flags == MPROCESS_FLAGS_ALLOCATED;
+
+		/* Freed tasks go back to the free list */
+		taskctl->current = c;
+		mprocess_task_free(a);
+		ok = ok && a->flags == MPROCESS_FLAGS_FREE;
+		ok = ok && mprocess_task_alloc() != NULL;
+		/* The current task is not freed */
+		mprocess_task_free(c);
+		ok = ok && c->flags == MPROCESS_FLAGS_RUNNING;
+
+		/* The boot task of mprocess_init(): linked and marked RUNNING by the add */
+		TASK *boot = mprocess_task_alloc();
+		ok = ok && boot != NULL;
+		if (ok)
+		{
+			boot->priority = 2;
+			boot->level = 0;
+			__mprocess_task_add(boot);
+			ok = ok && boot->flags == MPROCESS_FLAGS_RUNNING;
+			ok = ok && taskctl->level[0].ready.next == &boot->taskDL;
+			ok = ok && taskctl->level[0].running == 1;
+			ok = ok && (taskctl->levelBitmap & 1u);
+			ok = ok && __mprocess_task_pick_next() == boot;
+		}
 	}
-	if (i >= OS_MPROCESS_TASKLEVELS_MAX)
-		i = OS_MPROCESS_TASKLEVELS_MAX - 1;
-	taskctl->now_lv = i;
-	taskctl->lv_change = false;
-	return;
-}
 
+	taskctl = saved;
+	return ok;
+}
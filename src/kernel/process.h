@@ -2,6 +2,7 @@
 #define KERNEL_PROCESS_H_
 
 #include "config.h"
+#include "util/dlist.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -43,47 +44,76 @@ typedef struct TSS32 {
 	uint32_t ssp;
 } __attribute__((packed)) TSS32;
 
+/**
+ * A task is switched in software (_mprocess_switch()), on its own stack:
+ *   - the callee-saved registers and eflags are pushed on the stack of the
+ *   task being switched out, then `esp` is swapped
+ *   - there is a single TSS (TASKCTL.tss); it is only loaded for ring transitions
+ */
 typedef struct TASK
 {
-	uint32_t gdtSegmentSelector;
+	/* Saved stack pointer, valid while the task is not on the CPU */
+	uint32_t esp;
+	/* Loaded into TSS.esp0 on switch in, for a task with a ring 3 part; 0 for a kernel task */
+	uint32_t esp0;
 	uint32_t flags;
 	/* UINT32_MAX is the highest; affect the timer, as ticks; 0 is reserved, means to keep the current priority */
 	uint32_t priority;
 	/* 0 is the highest */
 	int32_t level;
-	TSS32 tss;
+	/* In its level's ready queue when RUNNING, in the free list when FREE; detached when ALLOCATED */
+	DLIST taskDL;
 } TASK;
 
+/**
+ * A ready queue (round robin) per level, and a bitmap of the non-empty levels:
+ *   - the next task is the head of the lowest set bit's queue (bsf)
+ *   - on a time slice, the current task moves to the tail of its queue
+ *   - add, remove, sleep and picking the next task are O(1)
+ */
 typedef struct TASKLEVEL
 {
 	/* Sum of active tasks */
 	int32_t running;
-	/* Current running TASK *task = taskctl.tasks[taskctl.now] */
-	int32_t now;
-	TASK *tasks[OS_MPROCESS_TASKLEVEL_TASKS_MAX];
+	/* The RUNNING tasks; the head is the next one to run */
+	DLIST ready;
 } TASKLEVEL;
 
 typedef struct TASKCTL
 {
-	/* Current running TASK *task = taskctl.tasks[taskctl.now] */
-	int32_t now_lv;
-	bool lv_change;
+	/* The task on the CPU; may already be removed from its level (sleeping) */
+	TASK *current;
+	/* bit n set: level[n].ready is not empty */
+	uint32_t levelBitmap;
 	TASKLEVEL level[OS_MPROCESS_TASKLEVELS_MAX];
+	/* The FREE tasks0[] */
+	DLIST freelist;
 	TASK tasks0[OS_MPROCESS_TASK_MAX];
+	TSS32 tss;
+	uint16_t tssSegmentSelector;
 } TASKCTL;
 
 
-extern void _farjmp(uint32_t eip, uint16_t cs);
+/**
+ * Save the context on the current stack, store esp in `*espPrev`, and
+ * continue from the context saved at `espNext`
+ */
+extern void _mprocess_switch(uint32_t *espPrev, uint32_t espNext);
 
 TASK *mprocess_init(void);
 TASK *mprocess_task_alloc(void);
+void mprocess_task_free(TASK *task);
+void mprocess_task_set_entry(TASK *task, uint32_t eip, uint32_t esp);
 void mprocess_task_run(TASK *task, int32_t level, uint32_t priority);
 void mprocess_task_autoswitch(void);
 void mprocess_task_sleep(TASK *task);
 static void __mprocess_task_idle(void);
+static void __mprocess_task_exit(void);
+static void __mprocess_task_switch(TASK *taskNext);
 
 TASK* mprocess_task_get_current(void);
 void __mprocess_task_add(TASK *task);
 void mprocess_task_remove(TASK *task);
-void __mprocess_task_update_currentlv(void);
+static TASK *__mprocess_task_pick_next(void);
+bool test_mprocess(void);
 #endif
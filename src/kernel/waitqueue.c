@@ -0,0 +1,95 @@
+/**
+ * Wait queues (see waitqueue.h)
+ *   - The lost wakeup: a task checks its condition and sleeps with interrupts
+ *   off, after adding its WAITERs; a producer changes the condition first,
+ *   then wakes the queue
+ */
+#include "kernel/waitqueue.h"
+#include "kernel/process.h"
+#include "util/dlist.h"
+#include <stddef.h>
+
+void waitqueue_init(WAITQUEUE *wq)
+{
+	if (!wq)
+		return;
+	spinlock_init(&wq->lock, NULL);
+	dlist_init(&wq->waiters);
+}
+
+void waitqueue_add(WAITQUEUE *wq, WAITER *w, TASK *task)
+{
+	if (!wq || !w)
+		return;
+	w->task = task;
+	w->wq = wq;
+	dlist_init(&w->waiterDL);
+	const bool isCli = spinlock_lock_irqsave(&wq->lock);
+	dlist_insert_before(&wq->waiters, &w->waiterDL);
+	spinlock_unlock_irqrestore(&wq->lock, isCli);
+}
+
+void waitqueue_remove(WAITER *w)
+{
+	if (!w || !w->wq)
+		return;
+	WAITQUEUE *wq = w->wq;
+	const bool isCli = spinlock_lock_irqsave(&wq->lock);
+	dlist_remove(&w->waiterDL);
+	w->wq = NULL;
+	spinlock_unlock_irqrestore(&wq->lock, isCli);
+}
+
+/*
+ * Make every waiting task RUNNING again (keep its level and priority)
+ *   - the WAITERs stay in the queue, the tasks remove their own
+ */
+void waitqueue_wake_all(WAITQUEUE *wq)
+{
+	if (!wq)
+		return;
+	const bool isCli = spinlock_lock_irqsave(&wq->lock);
+	WAITER *w;
+	list_for_each_entry(w, &wq->waiters, waiterDL)
+	{
+		if (w->task && w->task->flags == MPROCESS_FLAGS_ALLOCATED)
+			mprocess_task_run(w->task, -1, 0);
+	}
+	spinlock_unlock_irqrestore(&wq->lock, isCli);
+}
+
+bool waitqueue_is_empty(const WAITQUEUE *wq)
+{
+	return wq->waiters.next == &wq->waiters;
+}
+
+/**
+ * Queue operations only; a NULL task is never woken
+ */
+bool test_waitqueue(void)
+{
+	WAITQUEUE a, b;
+	WAITER w0, w1, w2;
+	waitqueue_init(&a);
+	waitqueue_init(&b);
+	if (!waitqueue_is_empty(&a))
+		return false;
+	waitqueue_add(&a, &w0, NULL);
+	waitqueue_add(&a, &w1, NULL);
+	waitqueue_add(&b, &w2, NULL);
+	if (waitqueue_is_empty(&a) || waitqueue_is_empty(&b))
+		return false;
+	if (a.waiters.next != &w0.waiterDL || w0.waiterDL.next != &w1.waiterDL)
+		return false;
+	waitqueue_wake_all(&a);
+	/* Waking does not dequeue */
+	if (a.waiters.next != &w0.waiterDL)
+		return false;
+	waitqueue_remove(&w0);
+	waitqueue_remove(&w0);
+	if (w0.wq || a.waiters.next != &w1.waiterDL)
+		return false;
+	waitqueue_remove(&w1);
+	waitqueue_remove(&w2);
+	return waitqueue_is_empty(&a) && waitqueue_is_empty(&b);
+}
@@ -0,0 +1,36 @@
+#ifndef KERNEL_WAITQUEUE_H_
+#define KERNEL_WAITQUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "util/dlist.h"
+#include "util/spinlock.h"
+#include "kernel/process.h"
+
+/**
+ * Tasks waiting for an event source (e.g. a MPFIFO32)
+ *   - a task waits on several queues at once with one WAITER per queue
+ *   - a wakeup makes every waiting task RUNNING again; a task checks its
+ *   condition again, and removes its WAITERs once it stops waiting
+ */
+typedef struct WAITQUEUE {
+	/* The WAITERs; also woken from the INT handlers (use the _irqsave variants) */
+	SPINLOCK lock;
+	DLIST waiters;
+} WAITQUEUE;
+
+typedef struct WAITER {
+	DLIST waiterDL;
+	TASK *task;
+	/* NULL when not in a queue */
+	WAITQUEUE *wq;
+} WAITER;
+
+void waitqueue_init(WAITQUEUE *wq);
+void waitqueue_add(WAITQUEUE *wq, WAITER *w, TASK *task);
+void waitqueue_remove(WAITER *w);
+void waitqueue_wake_all(WAITQUEUE *wq);
+bool waitqueue_is_empty(const WAITQUEUE *wq);
+bool test_waitqueue(void);
+
+#endif
@@ -5,6 +5,7 @@
 
 #include "asmfunc.h"
 #include "console.hpp"
+#include "cpu.hpp"
 #include "font.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
@@ -18,7 +19,10 @@
 #include "queue.hpp"
 #include "segment.hpp"
 #include "sys/_stdint.h"
+#include "thread.hpp"
+#include "timer.hpp"
 #include "usb/classdriver/mouse.hpp"
+#include "usb/classdriver/msc.hpp"
 #include "usb/device.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/trb.hpp"
@@ -50,6 +54,25 @@ void MouseObserver(int8_t displacement_x, int8_t displacement_y)
   mouse_cursor->MoveRelative({displacement_x, displacement_y});
 }
 
+/* Read from a USB storage device once it is ready, as a throughput benchmark */
+const uint64_t kStorageBenchmarkBytes = 32 * 1024 * 1024;
+
+void StorageObserver(usb::MassStorageDriver *driver)
+{
+  if (auto err = driver->StartReadBenchmark(kStorageBenchmarkBytes))
+  {
+    Log(kWarn, "usb-storage: no benchmark: %s\n", err.Name());
+  }
+}
+
+char timer_manager_buf[sizeof(TimerManager)];
+TimerManager *timer_manager;
+
+alignas(ThreadManager) char thread_manager_buf[sizeof(ThreadManager)];
+ThreadManager *thread_manager;
+/* The thread running KernelMainNewStack(), it consumes `main_queue` */
+Thread *main_thread;
+
 char pixel_writer_buf[sizeof(RGBResv8BitPerColorPixelWriter)];
 PixelWriter *pixel_writer;
 
@@ -127,14 +150,20 @@ struct Message
 {
   enum Type
   {
+    /* arg: the xHCI interrupter */
     kInterruptXHCI,
+    kInterruptLAPICTimer,
   } type;
+  uint64_t arg;
 };
 
 /**
  * FIFO interrupt queue
+ *   - Single producer: the interrupt handlers, all on the BSP (they do not nest)
+ *   - Single consumer: the main thread, pinned to the BSP
  */
-ArrayQueue<Message> *main_queue;
+using MainQueue = SPSCRing<Message, 64>;
+MainQueue *main_queue;
 
 /**
  * __attribute__((interrupt)):
@@ -153,8 +182,142 @@ ArrayQueue<Message> *main_queue;
 __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame *frame)
 {
   (void)frame;
-  main_queue->Push(Message{Message::kInterruptXHCI});
+  xhc->OnInterrupt(0);
+  main_queue->Push(Message{Message::kInterruptXHCI, 0});
+  thread_manager->Wakeup(main_thread);
+  NotifyEndOfInterrupt();
+  /* After the EOI: the switched-to thread may not return here for a while */
+  thread_manager->Preempt();
+}
+
+/* MSI-X only: interrupter 1, the bulk/isochronous transfer events */
+__attribute__((interrupt)) void IntHandlerXHCIBulk(InterruptFrame *frame)
+{
+  (void)frame;
+  xhc->OnInterrupt(1);
+  main_queue->Push(Message{Message::kInterruptXHCI, 1});
+  thread_manager->Wakeup(main_thread);
+  NotifyEndOfInterrupt();
+  thread_manager->Preempt();
+}
+
+/**
+ * The Local APIC timer is armed for the earliest deadline only (a TimerManager
+ * callback or the end of a time slice); the expired callbacks are run by the main loop
+ */
+__attribute__((interrupt)) void IntHandlerLAPICTimer(InterruptFrame *frame)
+{
+  (void)frame;
+  const LAPICTimerEvents events = LAPICTimerOnInterrupt();
+  if (events.timers)
+  {
+    main_queue->Push(Message{Message::kInterruptLAPICTimer, 0});
+    thread_manager->Wakeup(main_thread);
+  }
+  NotifyEndOfInterrupt();
+  if (events.time_slice)
+  {
+    thread_manager->Yield();
+  }
+  else
+  {
+    thread_manager->Preempt();
+  }
+}
+
+/**
+ * From another CPU: a thread was made runnable here (or put to sleep while
+ * running here), or there is a thread to steal; the idle loop steals after this
+ */
+__attribute__((interrupt)) void IntHandlerReschedule(InterruptFrame *frame)
+{
+  (void)frame;
   NotifyEndOfInterrupt();
+  thread_manager->Preempt();
+}
+
+/* 5s */
+const uint64_t kUtilizationReportNs = 5000000000;
+
+/**
+ * Log the busy time of each CPU (100% - its idle thread's share) since the last report, and the
+ * contention of its run queue lock since boot
+ */
+void ReportCPUUtilization(uint64_t now_ns, void *arg)
+{
+  static std::array<uint64_t, kMaxCPUs> last_idle_tsc{};
+  static uint64_t last_tsc = 0;
+  const uint64_t tsc = ReadTSC();
+  const uint64_t elapsed = tsc - last_tsc;
+  last_tsc = tsc;
+
+  char line[512];
+  int len = snprintf(line, sizeof(line), "CPU busy:");
+  for (int i = 0; i < kMaxCPUs; ++i)
+  {
+    if (!cpus[i].online)
+    {
+      continue;
+    }
+    const ThreadManager::CPUStats stats = thread_manager->Stats(i);
+    const uint64_t idle = stats.idle_tsc - last_idle_tsc[i];
+    last_idle_tsc[i] = stats.idle_tsc;
+    const uint64_t busy_percent = idle >= elapsed ? 0 : 100 - idle * 100 / elapsed;
+    if (len < static_cast<int>(sizeof(line)))
+    {
+      len += snprintf(line + len, sizeof(line) - len, " %d:%lu%% (%lu stolen, rq lock %lu/%lu contended)", i,
+                      busy_percent, stats.steals, stats.lock.contended, stats.lock.acquisitions);
+    }
+  }
+  Log(kInfo, "%s\n", line);
+
+  if (xhc == nullptr)
+  {
+    return;
+  }
+  len = snprintf(line, sizeof(line), "xHCI:");
+  for (size_t i = 0; i < xhc->NumInterrupters(); ++i)
+  {
+    const auto irq = xhc->Stats(i);
+    const uint64_t events_per_irq = irq.interrupts_per_sec ? irq.events_per_sec / irq.interrupts_per_sec : 0;
+    if (len < static_cast<int>(sizeof(line)))
+    {
+      len += snprintf(line + len, sizeof(line) - len, " ir%lu: %lu irq/s, %lu ev/irq, imod %u%s", i,
+                      irq.interrupts_per_sec, events_per_irq, irq.moderation_interval, irq.adaptive ? " (adaptive)" : "");
+    }
+  }
+  uint64_t other_events = 0;
+  for (unsigned int type = 0; type < 64; ++type)
+  {
+    other_events += xhc->EventCount(type);
+  }
+  const uint64_t transfer_events = xhc->EventCount(usb::xhci::TransferEventTRB::Type);
+  const uint64_t command_events = xhc->EventCount(usb::xhci::CommandCompletionEventTRB::Type);
+  const uint64_t port_events = xhc->EventCount(usb::xhci::PortStatusChangeEventTRB::Type);
+  other_events -= transfer_events + command_events + port_events;
+  if (len < static_cast<int>(sizeof(line)))
+  {
+    snprintf(line + len, sizeof(line) - len, "; events: %lu transfer, %lu command, %lu port, %lu other", transfer_events,
+             command_events, port_events, other_events);
+  }
+  Log(kInfo, "%s\n", line);
+}
+
+/**
+ * The APs enter here from the trampoline (cpu.cpp), in long mode with
+ * interrupts off, each on its own stack; each becomes the idle thread of its CPU
+ */
+void KernelMainAP(int cpu_index)
+{
+  const uint16_t kernel_cs = 1 << 3;
+  const uint16_t kernel_ss = 2 << 3;
+  LoadSegments();
+  SetDSAll(0);
+  SetCSSS(kernel_cs, kernel_ss);
+  InitializeCPU(cpu_index);
+  LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+  InitializeLAPICTimer();
+  thread_manager->StartCPU();
 }
 
 /**
@@ -275,10 +438,52 @@ KernelMainNewStack(const FrameBufferConfig &__frameBufferConfig, const MemoryMap
   /**
    * Initialize the interrupt FIFO queue
    */
-  std::array<Message, 32> main_queue_data;
-  ArrayQueue<Message> main_queue{main_queue_data};
+  MainQueue main_queue;
   ::main_queue = &main_queue;
 
+  /**
+   * This is CPU 0: GS base -> cpus[0], CurrentCPU() from here on
+   */
+  InitializeCPU(0);
+
+  /**
+   * Kernel threads: this one becomes the main thread (level 1), the idle thread takes level 3
+   */
+  thread_manager = new (thread_manager_buf) ThreadManager;
+  if (auto err = thread_manager->Initialize(1))
+  {
+    Log(kError, "ThreadManager::Initialize: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+  }
+  main_thread = &thread_manager->CurrentThread();
+
+  /**
+   * Timekeeping: calibrate the TSC, the Local APIC timer raises 0x41 on the earliest deadline
+   */
+  SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kernel_cs);
+  SetIDTEntry(idt[InterruptVector::kReschedule], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+              reinterpret_cast<uint64_t>(IntHandlerReschedule), kernel_cs);
+  LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+  timer_manager = new (timer_manager_buf) TimerManager;
+  if (auto err = InitializeTimekeeping(InterruptVector::kLAPICTimer))
+  {
+    Log(kError, "InitializeTimekeeping: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+  }
+
+  /**
+   * SMP: wake the APs up (INIT-SIPI-SIPI); each runs its own idle loop and takes threads from the busy CPUs
+   */
+  if (auto err = StartAPs(KernelMainAP))
+  {
+    Log(kError, "StartAPs: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+  }
+  if (auto err = timer_manager->Add(NowNanoseconds() + kUtilizationReportNs, kUtilizationReportNs,
+                                    ReportCPUUtilization, nullptr)
+                     .error)
+  {
+    Log(kError, "Add ReportCPUUtilization: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+  }
+
   auto err = pci::ScanAllBus();
   Log(kDebug, "ScanAllBus: %s\n", err.Name());
 
@@ -325,6 +530,8 @@ KernelMainNewStack(const FrameBufferConfig &__frameBufferConfig, const MemoryMap
      */
     SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
                 reinterpret_cast<uint64_t>(IntHandlerXHCI), kernel_cs);
+    SetIDTEntry(idt[InterruptVector::kXHCIBulk], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+                reinterpret_cast<uint64_t>(IntHandlerXHCIBulk), kernel_cs);
     /**
      * @limit sizeof(idt) - 1
      * @offset &idt[0]
@@ -332,16 +539,40 @@ KernelMainNewStack(const FrameBufferConfig &__frameBufferConfig, const MemoryMap
     LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 
     /**
-     * Read the Local APIC ID from the "0xFEE0 0020H (Local APIC ID Register)"
+     * The BSP's Local APIC ID, read by InitializeCPU(0) from the "0xFEE0 0020H (Local APIC ID Register)"
+     *   - The interrupts go to the BSP, where the main thread (pinned) consumes `main_queue`
      *
      * Intel 64 Software Developer's Manual Vol.3A
      *   - Table 11-1. Local APIC Register Address Map (1-4, p3389)
      *   - 9.4.3 MP Initialization Protocol Algorithm for MP Systems (1-4, p3296)
      */
-    const uint8_t bsp_local_apic_id = *reinterpret_cast<const uint32_t *>(0xfee00020) >> 24;
+    const uint8_t bsp_local_apic_id = cpus[0].apic_id;
     Log(kDebug, "bsp_local_apic_id: %x\n", bsp_local_apic_id); // 0
-    pci::ConfigureMSIFixedDestination(*xhc_dev, bsp_local_apic_id, pci::MSITriggerMode::kLevel,
-                                      pci::MSIDeliveryMode::kFixed, InterruptVector::kXHCI, 0);
+    /**
+     * With MSI-X, interrupter i raises table entry i: the HID and the bulk
+     * events get their own event ring and vector. Both go to the BSP for now,
+     * `main_queue` has a single producer
+     */
+    size_t xhc_interrupters = 1;
+    if (pci::MSIXVectorCount(*xhc_dev) >= 2)
+    {
+      const std::array<uint8_t, 2> vectors{InterruptVector::kXHCI, InterruptVector::kXHCIBulk};
+      xhc_interrupters = vectors.size();
+      for (size_t i = 0; i < vectors.size(); ++i)
+      {
+        if (auto err = pci::ConfigureMSIXFixedDestination(*xhc_dev, i, bsp_local_apic_id, pci::MSITriggerMode::kLevel,
+                                                          pci::MSIDeliveryMode::kFixed, vectors[i]))
+        {
+          Log(kError, "ConfigureMSIXFixedDestination: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+          xhc_interrupters = 1;
+        }
+      }
+    }
+    if (xhc_interrupters == 1)
+    {
+      pci::ConfigureMSIFixedDestination(*xhc_dev, bsp_local_apic_id, pci::MSITriggerMode::kLevel,
+                                        pci::MSIDeliveryMode::kFixed, InterruptVector::kXHCI, 0);
+    }
 
     /* Read BAR and find the Memory-mapped I/O (MMIO) address */
     const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
@@ -430,6 +661,7 @@ KernelMainNewStack(const FrameBufferConfig &__frameBufferConfig, const MemoryMap
      * endpoint.
      */
     xhc = new (__buf_xhc) usb::xhci::Controller(xhc_mmio_base);
+    xhc->SetNumInterrupters(xhc_interrupters);
 
     if (0x8086 == pci::ReadVendorId(*xhc_dev))
     {
@@ -454,6 +686,7 @@ KernelMainNewStack(const FrameBufferConfig &__frameBufferConfig, const MemoryMap
     __asm__("sti");
 
     usb::HIDMouseDriver::default_observer = MouseObserver;
+    usb::MassStorageDriver::default_observer = StorageObserver;
 
     /**
      * 4.3 USB Device Initialization
@@ -494,33 +727,58 @@ KernelMainNewStack(const FrameBufferConfig &__frameBufferConfig, const MemoryMap
     }
   } // if (xhc_dev)
 
+  std::array<Message, 16> messages;
+  uint64_t reported_overruns = 0;
   while (true)
   {
-    __asm__("cli");
-    if (main_queue.IsEmpty())
+    const size_t count = main_queue.PopN(messages.data(), messages.size());
+    if (count == 0)
     {
-      __asm__("sti\n\thlt");
+      /* Interrupts stay off from the check to the sleep, or a Wakeup() in between is lost */
+      __asm__("cli");
+      if (main_queue.IsEmpty())
+      {
+        /* Woken by the interrupt handlers; the other threads (or the idle one) run meanwhile */
+        thread_manager->Sleep(main_thread);
+      }
+      __asm__("sti");
       continue;
     }
+    if (main_queue.Overruns() != reported_overruns)
+    {
+      Log(kWarn, "main_queue: %lu messages dropped\n", main_queue.Overruns() - reported_overruns);
+      reported_overruns = main_queue.Overruns();
+    }
 
-    Message msg = main_queue.Front();
-    /* The pop need to be done while "cli" to prevent data corruption due to concurrency */
-    main_queue.Pop();
-    __asm__("sti");
-
-    switch (msg.type)
+    /* The messages of a kind are coalesced: one pass serves them all */
+    /* bit i: interrupter i */
+    uint32_t xhci_pending = 0;
+    bool timers_pending = false;
+    for (size_t i = 0; i < count; ++i)
     {
-    case Message::kInterruptXHCI:
-      while (xhc->PrimaryEventRing()->HasFront())
+      switch (messages[i].type)
       {
-        if (auto err = ProcessEvent(*xhc))
-        {
-          Log(kError, "Error while ProcessEvent: %s at %s:%d\n", err.Name(), err.File(), err.Line());
-        }
+      case Message::kInterruptXHCI:
+        xhci_pending |= 1u << messages[i].arg;
+        break;
+      case Message::kInterruptLAPICTimer:
+        timers_pending = true;
+        break;
+      default:
+        Log(kError, "Unknown message type: %d\n", messages[i].type);
       }
-      break;
-    default:
-      Log(kError, "Unknown message type: %d\n", msg.type);
+    }
+    /* The primary interrupter (HID, commands, port changes) first */
+    for (size_t i = 0; xhci_pending; ++i, xhci_pending >>= 1)
+    {
+      if (xhci_pending & 1u)
+      {
+        usb::xhci::ProcessEvents(*xhc, i);
+      }
+    }
+    if (timers_pending)
+    {
+      timer_manager->ProcessExpired();
     }
   }
   return;
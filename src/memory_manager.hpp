@@ -102,3 +102,5 @@ private:
   bool GetBit(FrameID frame) const;
   void SetBit(FrameID frame, bool allocated);
 };
+
+extern BitmapMemoryManager *memory_manager;
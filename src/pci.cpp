@@ -181,10 +181,17 @@ void WriteMSICapability(const Device &dev, uint8_t cap_addr, const MSICapability
   }
 }
 
-/** @brief 指定された MSI レジスタを設定する */
+void DisableMSIX(const Device &dev);
+
+/**
+ * @brief 指定された MSI レジスタを設定する
+ *
+ * MSI-X is disabled first (e.g. left enabled by a failed MSI-X setup): MSI and MSI-X must not be enabled at the same time
+ */
 Error ConfigureMSIRegister(const Device &dev, uint8_t cap_addr, uint32_t msg_addr, uint32_t msg_data,
                            unsigned int num_vector_exponent)
 {
+  DisableMSIX(dev);
   auto msi_cap = ReadMSICapability(dev, cap_addr);
 
   if (msi_cap.header.bits.multi_msg_capable <= num_vector_exponent)
@@ -204,11 +211,140 @@ Error ConfigureMSIRegister(const Device &dev, uint8_t cap_addr, uint32_t msg_add
   return MAKE_ERROR(Error::kSuccess);
 }
 
-/** @brief 指定された MSI レジスタを設定する */
+/** @brief The configuration space address of capability `cap_id`; 0 if none */
+uint8_t FindCapability(const Device &dev, uint8_t cap_id)
+{
+  uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+  while (cap_addr != 0)
+  {
+    auto header = ReadCapabilityHeader(dev, cap_addr);
+    if (header.bits.cap_id == cap_id)
+    {
+      return cap_addr;
+    }
+    cap_addr = header.bits.next_ptr;
+  }
+  return 0;
+}
+
+MSIXCapability ReadMSIXCapability(const Device &dev, uint8_t cap_addr)
+{
+  MSIXCapability msix_cap{};
+  msix_cap.header.data = ReadConfReg(dev, cap_addr);
+  msix_cap.table.data = ReadConfReg(dev, cap_addr + 4);
+  msix_cap.pba.data = ReadConfReg(dev, cap_addr + 8);
+  return msix_cap;
+}
+
+void DisableMSIX(const Device &dev)
+{
+  const uint8_t cap_addr = FindCapability(dev, kCapabilityMSIX);
+  if (cap_addr == 0)
+  {
+    return;
+  }
+  auto msix_cap = ReadMSIXCapability(dev, cap_addr);
+  if (msix_cap.header.bits.msix_enable)
+  {
+    msix_cap.header.bits.msix_enable = 0;
+    WriteConfReg(dev, cap_addr, msix_cap.header.data);
+  }
+}
+
+/**
+ * The MSI-X table, in the memory space of the BAR its Table BIR names
+ *   - PCI Local Bus Specification 3.0, 6.8.2 MSI-X Capability and Table Structure
+ */
+WithError<volatile MSIXTableEntry *> MSIXTable(const Device &dev, const MSIXCapability &msix_cap)
+{
+  Device bar_dev = dev;
+  const auto bar = ReadBar(bar_dev, msix_cap.table.bits.bir);
+  if (bar.error)
+  {
+    return {nullptr, bar.error};
+  }
+  const uint64_t base = (bar.value & ~static_cast<uint64_t>(0xf)) + (msix_cap.table.data & ~0x7u);
+  return {reinterpret_cast<volatile MSIXTableEntry *>(base), MAKE_ERROR(Error::kSuccess)};
+}
+
+/**
+ * Program table entry `index` and unmask it, then enable MSI-X
+ *   - The entry is masked while it is written: a half-written entry must not fire
+ *   - MSI and MSI-X must not be enabled at the same time
+ */
+Error WriteMSIXEntry(const Device &dev, uint8_t cap_addr, unsigned int index, uint32_t msg_addr, uint32_t msg_data)
+{
+  auto msix_cap = ReadMSIXCapability(dev, cap_addr);
+  if (index > msix_cap.header.bits.table_size)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  const auto table = MSIXTable(dev, msix_cap);
+  if (table.error)
+  {
+    return table.error;
+  }
+
+  volatile MSIXTableEntry &entry = table.value[index];
+  entry.vector_control = entry.vector_control | kMSIXVectorMasked;
+  entry.msg_addr = msg_addr;
+  entry.msg_upper_addr = 0;
+  entry.msg_data = msg_data;
+  entry.vector_control = entry.vector_control & ~kMSIXVectorMasked;
+
+  if (const uint8_t msi_cap_addr = FindCapability(dev, kCapabilityMSI))
+  {
+    auto msi_cap = ReadMSICapability(dev, msi_cap_addr);
+    if (msi_cap.header.bits.msi_enable)
+    {
+      msi_cap.header.bits.msi_enable = 0;
+      WriteConfReg(dev, msi_cap_addr, msi_cap.header.data);
+    }
+  }
+  msix_cap.header.bits.function_mask = 0;
+  msix_cap.header.bits.msix_enable = 1;
+  WriteConfReg(dev, cap_addr, msix_cap.header.data);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/**
+ * @brief 指定された MSI-X レジスタを設定する
+ *
+ * Like multiple message MSI: entry i raises `msg_data + i` (the vector is its low 8 bits)
+ */
 Error ConfigureMSIXRegister(const Device &dev, uint8_t cap_addr, uint32_t msg_addr, uint32_t msg_data,
                             unsigned int num_vector_exponent)
 {
-  return MAKE_ERROR(Error::kNotImplemented);
+  const unsigned int table_size = ReadMSIXCapability(dev, cap_addr).header.bits.table_size + 1;
+  unsigned int num_vectors = 1u << num_vector_exponent;
+  if (num_vectors > table_size)
+  {
+    num_vectors = table_size;
+  }
+  for (unsigned int i = 0; i < num_vectors; ++i)
+  {
+    if (auto err = WriteMSIXEntry(dev, cap_addr, i, msg_addr, msg_data + i))
+    {
+      return err;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/* Intel SDM Vol.3A 11.11.1 Message Address Register Format, 11.11.2 Message Data Register Format */
+uint32_t MakeMSIAddress(uint8_t apic_id)
+{
+  return 0xfee00000u | (apic_id << 12);
+}
+
+uint32_t MakeMSIData(MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode, uint8_t vector)
+{
+  uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+  if (trigger_mode == MSITriggerMode::kLevel)
+  {
+    msg_data |= 0xc000;
+  }
+  return msg_data;
 }
 } // namespace
 
@@ -425,13 +561,29 @@ Error ConfigureMSI(const Device &dev, uint32_t msg_addr, uint32_t msg_data, unsi
 Error ConfigureMSIFixedDestination(const Device &dev, uint8_t apic_id, MSITriggerMode trigger_mode,
                                    MSIDeliveryMode delivery_mode, uint8_t vector, unsigned int num_vector_exponent)
 {
-  uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-  uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
-  if (trigger_mode == MSITriggerMode::kLevel)
+  return ConfigureMSI(dev, MakeMSIAddress(apic_id), MakeMSIData(trigger_mode, delivery_mode, vector),
+                      num_vector_exponent);
+}
+
+unsigned int MSIXVectorCount(const Device &dev)
+{
+  const uint8_t cap_addr = FindCapability(dev, kCapabilityMSIX);
+  if (cap_addr == 0)
   {
-    msg_data |= 0xc000;
+    return 0;
+  }
+  return ReadMSIXCapability(dev, cap_addr).header.bits.table_size + 1;
+}
+
+Error ConfigureMSIXFixedDestination(const Device &dev, unsigned int index, uint8_t apic_id,
+                                    MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode, uint8_t vector)
+{
+  const uint8_t cap_addr = FindCapability(dev, kCapabilityMSIX);
+  if (cap_addr == 0)
+  {
+    return MAKE_ERROR(Error::kNoPCIMSI);
   }
-  return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
+  return WriteMSIXEntry(dev, cap_addr, index, MakeMSIAddress(apic_id), MakeMSIData(trigger_mode, delivery_mode, vector));
 }
 } // namespace pci
 
@@ -180,6 +180,55 @@ WithError<uint64_t> ReadBar(Device &device, unsigned int bar_index);
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
       uint8_t vector, unsigned int num_vector_exponent);
 
+  /** @brief MSI-X ケーパビリティ構造（テーブル本体は BAR が指すメモリ空間にある） */
+  struct MSIXCapability {
+    union {
+      uint32_t data;
+      struct {
+        uint32_t cap_id : 8;
+        uint32_t next_ptr : 8;
+        /* The number of table entries - 1 */
+        uint32_t table_size : 11;
+        uint32_t : 3;
+        uint32_t function_mask : 1;
+        uint32_t msix_enable : 1;
+      } __attribute__((packed)) bits;
+    } __attribute__((packed)) header;
+
+    /* The table (or the PBA) is at offset (data & ~7) in the memory space of BAR `bir` */
+    union {
+      uint32_t data;
+      struct {
+        uint32_t bir : 3;
+        uint32_t offset : 29;
+      } __attribute__((packed)) bits;
+    } __attribute__((packed)) table, pba;
+  } __attribute__((packed));
+
+  /** @brief MSI-X テーブルの 1 エントリ */
+  struct MSIXTableEntry {
+    uint32_t msg_addr;
+    uint32_t msg_upper_addr;
+    uint32_t msg_data;
+    uint32_t vector_control;
+  } __attribute__((packed));
+
+  /** @brief vector_control bit 0: no message is sent while set */
+  const uint32_t kMSIXVectorMasked = 1;
+
+  /** @brief The number of MSI-X table entries of `dev`; 0 if it has no MSI-X */
+  unsigned int MSIXVectorCount(const Device& dev);
+
+  /** @brief MSI-X テーブルのエントリ `index` を設定して MSI-X を有効にする
+   *
+   * Each entry has its own destination and vector, so the interrupts of one
+   * device can go to several CPUs. MSI is disabled.
+   */
+  Error ConfigureMSIXFixedDestination(
+      const Device& dev, unsigned int index, uint8_t apic_id,
+      MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+      uint8_t vector);
+
 } // namespace pci
   //
 void InitializePCI();
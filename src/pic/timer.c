@@ -9,24 +9,41 @@
 /**
  * Want a structure of timer that can easily be searched based on something (Easy Reset: pointer is known; Insert: need to search based on time; Most performance required at each INT handler, which implies that if a timer is frequently triggered, the time should be quite close to the head)
  *
- * TODO use a double linked list etc. so that on setting timer or on triggering etc.
- * Keep a list in order so that no need to loop through all elements.
- *
- * The major Performance difference on the user side is when an interruption happens.
- * So by using a sorted linked list, theoretically next->next->next until all is triggered, no need to traverse all structures
- * But what if by using the simple list, cpu auto fetch and cached the whole list, so that IO cost is drastically reduced? (limit/architecture/implementation of caching)
+ * A sorted DLIST makes the trigger cheap but the insert O(n) (with interrupts disabled).
+ * The timing wheel (see TIMER in timer.h) makes both O(1):
+ *   - arm: pick the level by the distance to the target tick, the slot by the target tick
+ *   - cancel: remove from the slot
+ *   - trigger: take the whole level 0 slot of the tick
+ * `next_alarm_on_tick` is computed from the per level bitmaps, so the INT handler still exits
+ * immediately on the ticks where nothing happens.
  */
 
 #define PIT_CNT0 0x0040
 #define PIT_CTRL 0x0043
+/* PIT input clock cycles per tick (10ms) */
+#define PIT_COUNTS_PER_TICK 11932
+/* The counter is 16 bits, so one one-shot lasts at most ~54.9ms (5 ticks) */
+#define PIT_COUNTS_MAX 0xffff
+/* Expired timers delivered per unlock of timerctl.lock, see timer_int_handler() */
+#define TIMER_EXPIRED_BATCH 16
 
 TIMERCTL timerctl;
 TIMER *tssTimer;
+/* Tickless: counts of the running one-shot, and those already added to the tick by __pit_sync() */
+static uint32_t pitProgrammed;
+static uint32_t pitConsumed;
+/* Tickless: the running one-shot has reached its terminal count (as of the last __pit_sync()) */
+static bool pitExpired;
+/* Tickless: counts elapsed since the last whole tick */
+static uint32_t pitRemainder;
 
 /**
  * Get a 100Hz clock (10ms per tick)
  * Setup the Programmable Interval Timer (PIT) chip (Intel 8353/8254)
  * Set counter to 0x2e9c (11932) => (1.1931816666 MHz / 11932 = 99.99846 Hz)
+ *
+ * OS_TIMER_TICKLESS: the tick is kept the same, but the PIT only
+ * interrupts on the tick of the next timer (see __pit_sync(), __pit_program_next())
  */
 void PIT_init(void)
 {
@@ -34,10 +51,16 @@ void PIT_init(void)
 	if (!isCli)
 		_io_cli();
 
-	_io_out8(PIT_CTRL, 0x34); // channel 0, lobyte/hibyte, rate generator
-	_io_out8(PIT_CNT0, 0x9c); // Set low byte of PIT reload value
-	_io_out8(PIT_CNT0, 0x2e); // Set high byte of PIT reload value
 	timerctl_init();
+	if (OS_TIMER_TICKLESS)
+	{
+		pitRemainder = 0;
+		__pit_oneshot(PIT_COUNTS_PER_TICK);
+	} else {
+		_io_out8(PIT_CTRL, 0x34); // channel 0, lobyte/hibyte, rate generator
+		_io_out8(PIT_CNT0, 0x9c); // Set low byte of PIT reload value
+		_io_out8(PIT_CNT0, 0x2e); // Set high byte of PIT reload value
+	}
 	tssTimer = timer_alloc_customfifo(NULL);
 	if (!isCli)
 		_io_sti();
@@ -45,11 +68,95 @@ void PIT_init(void)
 	return;
 }
 
+/**
+ * Start a one-shot of `counts` PIT clock cycles, IRQ0 on the terminal count
+ * Mode 0 (interrupt on terminal count): the output goes low on the write of
+ * the control word, the counting starts on the write of the count
+ */
+static void __pit_oneshot(uint32_t counts)
+{
+	if (counts == 0)
+		counts = 1;
+	if (counts > PIT_COUNTS_MAX)
+		counts = PIT_COUNTS_MAX;
+	_io_out8(PIT_CTRL, 0x30); // channel 0, lobyte/hibyte, interrupt on terminal count
+	_io_out8(PIT_CNT0, counts & 0xff);
+	_io_out8(PIT_CNT0, (counts >> 8) & 0xff);
+	pitProgrammed = counts;
+	pitConsumed = 0;
+	pitExpired = false;
+}
+
+/**
+ * Catch up `timerctl.tick` with the counts elapsed in the running one-shot
+ *   - Read-back command (8254), latch the status and the count of channel 0
+ *   - Status bit 7 is the output: high once the terminal count is reached;
+ *   after that the counter keeps decrementing from 0 (wraps to 0xffff)
+ *   - Status bit 6 is the null count: the count written is not loaded in the
+ *   counter yet, what is latched is stale (nothing has elapsed)
+ * Only the counts since the previous call are added, so the one-shot keeps
+ * running: no partial count is lost. Requires timerctl.lock
+ */
+static void __pit_sync(void)
+{
+	_io_out8(PIT_CTRL, 0xc2);
+	const uint8_t status = _io_in8(PIT_CNT0);
+	uint32_t current = _io_in8(PIT_CNT0);
+	current |= (uint32_t) _io_in8(PIT_CNT0) << 8;
+	if (status & 0x40)
+		return;
+
+	uint32_t elapsed;
+	if (status & 0x80)
+		elapsed = pitProgrammed + ((0x10000 - current) & 0xffff);
+	else
+		elapsed = current <= pitProgrammed ? pitProgrammed - current : 0;
+	pitExpired = (status & 0x80) != 0;
+	if (elapsed <= pitConsumed)
+		return;
+
+	pitRemainder += elapsed - pitConsumed;
+	pitConsumed = elapsed;
+	timerctl.tick += pitRemainder / PIT_COUNTS_PER_TICK;
+	pitRemainder %= PIT_COUNTS_PER_TICK;
+}
+
+/**
+ * Program the one-shot to end on the boundary of `next_alarm_on_tick`
+ * Nothing pending: the longest one-shot, to keep the tick counting
+ * A running one-shot ending no later is kept: re-programming loses the
+ * counts between the latch of __pit_sync() and the write of the new count.
+ * Requires a __pit_sync() just before
+ */
+static void __pit_program_next(void)
+{
+	uint32_t counts = PIT_COUNTS_MAX;
+	const uint32_t next = timerctl.next_alarm_on_tick;
+	if (next != UINT32_MAX)
+	{
+		if ((int32_t) (next - timerctl.tick) <= 0)
+			counts = 1;
+		else if (next - timerctl.tick <= PIT_COUNTS_MAX / PIT_COUNTS_PER_TICK + 1)
+			counts = (next - timerctl.tick) * PIT_COUNTS_PER_TICK - pitRemainder;
+	}
+	if (!pitExpired && pitProgrammed - pitConsumed <= counts)
+		return;
+	__pit_oneshot(counts);
+}
+
 TIMER* timer_get_tssTimer(void)
 {
 	return tssTimer;
 }
 
+/*
+ * Return the statistics of the timerctl lock, NULL unless OS_LOCKSTAT
+ */
+const LOCKSTAT* timer_get_lockstat(void)
+{
+	return timerctl.lock.stat;
+}
+
 /**
  * WARN: free the FIFO before resetting the parameters
  */
@@ -60,287 +167,378 @@ static void __timer_set_default_params(TIMER *t)
 	t->flags = TIMER_FLAGS_FREE;
 	t->data = 0;
 	t->fifo = NULL;
+	t->fifoOwned = false;
 	t->target_tick = UINT32_MAX;
 	dlist_init(&t->timerDL);
 	return;
 }
 
 
-static void timerctl_init(void)
+static void __timer_wheel_init(TIMERWHEEL *w, uint32_t tick)
 {
-	timerctl.tick = 0;
-	timerctl.next_alarm_on_tick = UINT32_MAX;
+	w->tick = tick;
+	for (int32_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		w->bitmap[level] = 0;
+		for (int32_t i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			dlist_init(&w->slot[level][i]);
+	}
+}
 
-	TIMER *timerTail = &timerctl.timer[OS_MAX_TIMER - 1];
-	timerctl.listtail = timerTail;
+/**
+ * Put a timer into the wheel, by its `target_tick`
+ *   - already late (target_tick < w->tick), trigger on the next processed tick
+ *   - within 32^(L+1) ticks, level L
+ * Return the tick on which the wheel must look at the timer (trigger, or cascade)
+ */
+static uint32_t __timer_wheel_add(TIMERWHEEL *w, TIMER *t)
+{
+	uint32_t expires = t->target_tick;
+	uint32_t delta = expires - w->tick;
+	int32_t level = 0;
+
+	if ((int32_t) delta < 0)
+	{
+		expires = w->tick;
+		delta = 0;
+	}
+	if (delta > TIMER_WHEEL_MAX_DELTA)
+	{
+		delta = TIMER_WHEEL_MAX_DELTA;
+		expires = w->tick + delta;
+	}
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	const uint32_t shift = TIMER_WHEEL_BITS * level;
+	const uint32_t slot = (expires >> shift) & TIMER_WHEEL_MASK;
+	t->wheelSlot = level * TIMER_WHEEL_SLOTS + slot;
+	dlist_insert_before(&w->slot[level][slot], &t->timerDL);
+	w->bitmap[level] |= 1u << slot;
+	/* Level L is cascaded when the lower bits of the tick wrap to 0 */
+	return (expires >> shift) << shift;
+}
+
+static void __timer_wheel_del(TIMERWHEEL *w, TIMER *t)
+{
+	const uint32_t level = t->wheelSlot / TIMER_WHEEL_SLOTS;
+	const uint32_t slot = t->wheelSlot % TIMER_WHEEL_SLOTS;
+	dlist_remove(&t->timerDL);
+	if (w->slot[level][slot].next == &w->slot[level][slot])
+		w->bitmap[level] &= ~(1u << slot);
+}
 
-	__timer_set_default_params(timerTail);
-	/* The guard node hould never be modified */
-	timerTail->flags = TIMER_FLAGS_GUARDNODE;
+/**
+ * Move all nodes in `from` (a list head) to the tail of `to` (a list head)
+ */
+static void __timer_wheel_splice(DLIST *from, DLIST *to)
+{
+	if (from->next == from)
+		return;
+	DLIST *first = from->next;
+	/* Detach the head, the rest is still circular */
+	dlist_remove(from);
+	dlist_insert_before(to, first);
+}
 
-	DLIST *prev = &timerTail->timerDL;
-	for (int32_t i = 0; i < OS_MAX_TIMER - 1; i++)
+/**
+ * Re-insert the timers in slot[level][slot] to the lower levels
+ * Return the slot
+ */
+static uint32_t __timer_wheel_cascade(TIMERWHEEL *w, int32_t level, uint32_t slot)
+{
+	DLIST tmp;
+	dlist_init(&tmp);
+	__timer_wheel_splice(&w->slot[level][slot], &tmp);
+	w->bitmap[level] &= ~(1u << slot);
+	while (tmp.next != &tmp)
 	{
-		TIMER *t = &timerctl.timer[i];
-		__timer_set_default_params(t);
-		/* Connect all into a loop */
-		dlist_insert_after(prev, &t->timerDL);
-		prev = &t->timerDL;
+		TIMER *t = container_of(tmp.next, TIMER, timerDL);
+		dlist_remove(&t->timerDL);
+		__timer_wheel_add(w, t);
 	}
+	return slot;
 }
 
 /**
- * Find a free timer and "allocate"
- *   - Auto allocate an FIFO
- * Return NULL when all timers are occupied
+ * The first set bit of `bitmap`, starting from `from` and wrapping around
+ * Return the distance from `from`; `bitmap` must not be 0
  */
-TIMER* timer_alloc(void)
+static uint32_t __timer_wheel_find_slot(uint32_t bitmap, uint32_t from)
 {
-	int32_t *fifo32buf = (int32_t *)kzalloc(512);
-	MPFIFO32 *timer_fifo = kzalloc(sizeof(FIFO32));
-	mpfifo32_init(timer_fifo, fifo32buf, 512 / sizeof(fifo32buf[0]), NULL);
-	return timer_alloc_customfifo(timer_fifo);
+	if (from)
+		bitmap = (bitmap >> from) | (bitmap << (TIMER_WHEEL_SLOTS - from));
+	return __builtin_ctz(bitmap);
 }
 
+/**
+ * The number of ticks from w->tick to the next tick on which the wheel has
+ * work to do (a level 0 slot to trigger, or a non empty slot to cascade)
+ * Return UINT32_MAX if the wheel is empty
+ */
+static uint32_t __timer_wheel_next_event(const TIMERWHEEL *w)
+{
+	uint32_t best = UINT32_MAX;
+	if (w->bitmap[0])
+		best = __timer_wheel_find_slot(w->bitmap[0], w->tick & TIMER_WHEEL_MASK);
+
+	for (int32_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+	{
+		if (!w->bitmap[level])
+			continue;
+		const uint32_t shift = TIMER_WHEEL_BITS * level;
+		/* The first cascade of this level that is not processed yet */
+		const uint32_t k0 = (w->tick >> shift) + ((w->tick & ((1u << shift) - 1)) != 0);
+		const uint32_t k = k0 + __timer_wheel_find_slot(w->bitmap[level], k0 & TIMER_WHEEL_MASK);
+		const uint32_t delta = (k << shift) - w->tick;
+		if (delta < best)
+			best = delta;
+	}
+	return best;
+}
 
 /**
- * WARN: Timer must exist
+ * Process the ticks up to `now` (inclusive), jumping over the ticks with nothing to do
+ *   - on a tick with (tick & 31) == 0, cascade level 1, if its index is also 0, cascade level 2...
+ *   - move the timers in the level 0 slot of the tick to `expired`
  */
-static TIMER* __get_timer_prev(TIMER *timer)
+static void __timer_wheel_run(TIMERWHEEL *w, uint32_t now, DLIST *expired)
 {
-	if (!timer)
-		return NULL;
-	return container_of(timer->timerDL.prev, TIMER, timerDL);
+	while ((int32_t) (now - w->tick) >= 0)
+	{
+		const uint32_t delta = __timer_wheel_next_event(w);
+		if (delta == UINT32_MAX || delta > now - w->tick)
+		{
+			w->tick = now + 1;
+			break;
+		}
+		w->tick += delta;
+
+		const uint32_t idx = w->tick & TIMER_WHEEL_MASK;
+		if (idx == 0)
+		{
+			for (int32_t level = 1; level < TIMER_WHEEL_LEVELS; level++)
+			{
+				const uint32_t slot = (w->tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+				if (__timer_wheel_cascade(w, level, slot) != 0)
+					break;
+			}
+		}
+		__timer_wheel_splice(&w->slot[0][idx], expired);
+		w->bitmap[0] &= ~(1u << idx);
+		w->tick++;
+	}
+}
+
+/* Return the absolute tick of the next wheel event, UINT32_MAX if none */
+static uint32_t __timer_wheel_next_tick(const TIMERWHEEL *w)
+{
+	const uint32_t delta = __timer_wheel_next_event(w);
+	if (delta == UINT32_MAX)
+		return UINT32_MAX;
+	return w->tick + delta;
+}
+
+static void timerctl_init(void)
+{
+	lockstat_reset(&timerctl.lockstat);
+	spinlock_init(&timerctl.lock, OS_LOCKSTAT ? &timerctl.lockstat : NULL);
+	timerctl.tick = 0;
+	timerctl.next_alarm_on_tick = UINT32_MAX;
+	__timer_wheel_init(&timerctl.wheel, 1);
+	dlist_init(&timerctl.freelist);
+
+	for (int32_t i = 0; i < OS_MAX_TIMER; i++)
+	{
+		TIMER *t = &timerctl.timer[i];
+		__timer_set_default_params(t);
+		dlist_insert_before(&timerctl.freelist, &t->timerDL);
+	}
 }
 
 /**
- * WARN: Timer must exist
+ * Find a free timer and "allocate"
+ *   - Auto allocate an FIFO
+ * Return NULL when all timers are occupied
  */
-static TIMER* __get_timer_next(TIMER *timer)
+TIMER* timer_alloc(void)
 {
-	if (!timer)
+	int32_t *fifo32buf = (int32_t *)kzalloc(512);
+	MPFIFO32 *timer_fifo = kzalloc(sizeof(MPFIFO32));
+	mpfifo32_init(timer_fifo, fifo32buf, 512 / sizeof(fifo32buf[0]));
+	TIMER *t = timer_alloc_customfifo(timer_fifo);
+	if (!t)
+	{
+		kfree(fifo32buf);
+		kfree(timer_fifo);
 		return NULL;
-	return container_of(timer->timerDL.next, TIMER, timerDL);
+	}
+	t->fifoOwned = true;
+	return t;
 }
 
 /**
- * Find a free timer and "allocate"
+ * Take a timer from the free list and "allocate"
  *   - Attach FIFO (May be NULL)
  *   - Change its flag to TIMER_FLAGS_ALLOCATED
- *   - Remove the timer from the DL list
  * Return NULL when all timers are occupied
  */
 TIMER* timer_alloc_customfifo(MPFIFO32 *fifo32)
 {
-	for (int32_t i = 0; i< OS_MAX_TIMER; i++)
+	const bool isCli = spinlock_lock_irqsave(&timerctl.lock);
+
+	TIMER *t = NULL;
+	if (timerctl.freelist.next != &timerctl.freelist)
 	{
-		TIMER *t = &timerctl.timer[i];
-		if (t->flags == TIMER_FLAGS_FREE)
-		{
-			t->flags = TIMER_FLAGS_ALLOCATED;
-			t->fifo = fifo32;
-			/**
-			 * The DL is for timers that are running or free
-			 * Because the DL is in tick order, while the position is yet to be known
-			 */
-			dlist_remove(&t->timerDL);
-			return t;
-		}
+		t = container_of(timerctl.freelist.next, TIMER, timerDL);
+		dlist_remove(&t->timerDL);
+		t->flags = TIMER_FLAGS_ALLOCATED;
+		t->fifo = fifo32;
 	}
-	return NULL;
+
+	spinlock_unlock_irqrestore(&timerctl.lock, isCli);
+	return t;
 }
 
 /**
  * Set a timeout and start an ALLOCATED or RUNNING timer
  *   - data == 0 is reserved, means no change to prev data
- *   - when a timer is still running?
+ *   - when a timer is still running, it is re-armed
  * @timeout: in ticks. 1 tick == 10ms
  */
 void timer_settimer(TIMER *timer, uint32_t timeout, uint8_t data)
 {
 	if (!timer)
 		return;
-//	bool isCli = io_get_is_cli();
-//	if (!isCli)
-//		_io_cli();
+	const bool isCli = spinlock_lock_irqsave(&timerctl.lock);
+	if (timer->flags != TIMER_FLAGS_ALLOCATED && timer->flags != TIMER_FLAGS_ONCOUNTDOWN)
+	{
+		spinlock_unlock_irqrestore(&timerctl.lock, isCli);
+		return;
+	}
 
 	if (data == 0)
 		data = timer->data;
+	/* Tickless: `timerctl.tick` may be stale in the middle of a one-shot */
+	if (OS_TIMER_TICKLESS)
+		__pit_sync();
 
-	/**
-	 * If the timer is still running:
-	 *   - Check if timerctl.next_alarm_on_tick == timer.target_tick; update if necessary
-	 *   - Remove the timer from the timerDL
-	 *   - Set parameters
-	 *   - Update `timerctl.next_alarm_on_tick`
-	 *   - Insert the timer to the timerDL (with optimisation)
-	 */
 	if (timer->flags == TIMER_FLAGS_ONCOUNTDOWN)
-	{
-
-		if (timerctl.next_alarm_on_tick == timer->target_tick)
-		{
-			TIMER *nextTimer = __get_timer_next(timer);
-			timerctl.next_alarm_on_tick = nextTimer->target_tick;
-		}
-
-		TIMER *prevTimer = __get_timer_prev(timer);
-		DLIST *prevDL = &prevTimer->timerDL;
-		/* Remove from the timerDL */
-		dlist_remove(&timer->timerDL);
-
-		/* Set parameters */
-		timer->target_tick = timerctl.tick + timeout;
-		timer->flags = TIMER_FLAGS_ONCOUNTDOWN;
-		timer->data = data;
-		/* Update `timerctl.next_alarm_on_tick` */
-		if (timerctl.next_alarm_on_tick > timer->target_tick)
-		{
-			timerctl.next_alarm_on_tick = timer->target_tick;
-		}
+		__timer_wheel_del(&timerctl.wheel, timer);
 
-		/**
-	 	 * Insert the new timer back to the correct position in timeDL
-		 *   - By default, listhead = timerctl.listtail
-		 *   - To optimise, compare the `target_tick` with the previous timer,
-		 *   if is postponing, listhead = prevDL
-		 */
-		TIMER *pos;
-		DLIST *head = &timerctl.listtail->timerDL;
-		if (prevTimer->target_tick < timer->target_tick)
-			head = prevDL;
-		list_for_each_entry(pos, head, timerDL)
-		{
-			if (pos->target_tick >= timer->target_tick)
-			{
-				dlist_insert_before(&pos->timerDL, &timer->timerDL);
-				break;
-			}
-		}
-	}
+	/* Set parameters */
+	timer->target_tick = timerctl.tick + timeout;
+	timer->flags = TIMER_FLAGS_ONCOUNTDOWN;
+	timer->data = data;
 
 	/**
-	 * Normally
-	 *   - Set parameters
-	 *   - Update `timerctl.next_alarm_on_tick`
-	 *   - Insert the timer to the timerDL
+	 * Update `timerctl.next_alarm_on_tick`
+	 * A cancelled timer may leave it too early; that only costs a look into the wheel
 	 */
-	if (timer->flags == TIMER_FLAGS_ALLOCATED)
-	{
-		/* Set parameters */
-		timer->target_tick = timerctl.tick + timeout;
-		timer->flags = TIMER_FLAGS_ONCOUNTDOWN;
-		timer->data = data;
-		/* Update `timerctl.next_alarm_on_tick` */
-		if (timerctl.next_alarm_on_tick > timer->target_tick)
-		{
-			timerctl.next_alarm_on_tick = timer->target_tick;
-		}
-
-		/* Insert the timer based on the tick order */
-		TIMER *pos;
-		DLIST *head = &timerctl.listtail->timerDL;
-		list_for_each_entry(pos, head, timerDL)
-		{
-			if (pos->target_tick >= timer->target_tick)
-			{
-				dlist_insert_before(&pos->timerDL, &timer->timerDL);
-				break;
-			}
-		}
-	}
-
-//	if (!isCli)
-//		_io_sti();
+	const uint32_t eventTick = __timer_wheel_add(&timerctl.wheel, timer);
+	if (timerctl.next_alarm_on_tick > eventTick)
+		timerctl.next_alarm_on_tick = eventTick;
+	if (OS_TIMER_TICKLESS)
+		__pit_program_next();
 
+	spinlock_unlock_irqrestore(&timerctl.lock, isCli);
 	return;
 }
 
 /**
  * Free a TIMER
- *   - if not exist, or guardnode(listtail), return
- *   - if was still RUNNING, cleanup timerctl.next_alarm_on_tick
- *
- *   - Remove the TIMER from the list
- *   - Reset its parameters, free the FIFO32
- *   - Insert the TIMER back to the listtail
+ *   - if was still RUNNING, remove it from the wheel
+ *   - Reset its parameters, free the FIFO32 if allocated by timer_alloc()
+ *   - Insert the TIMER back to the free list
  */
 void timer_free(TIMER *timer)
 {
 	if (!timer)
 		return;
-	if (timer->flags == TIMER_FLAGS_GUARDNODE)
-		return;
-	if (timer->flags == TIMER_FLAGS_ONCOUNTDOWN)
+	const bool isCli = spinlock_lock_irqsave(&timerctl.lock);
+	if (timer->flags == TIMER_FLAGS_FREE)
 	{
-		if (timerctl.next_alarm_on_tick == timer->target_tick)
-		{
-			TIMER *nextTimer = __get_timer_next(timer);
-			timerctl.next_alarm_on_tick = nextTimer->target_tick;
-		}
-	}
-	/**
-	 * This do no harm (changes nothing), when the node is not in the main timerDL circle
-	 */
-	dlist_remove(&timer->timerDL);
-	if (timer->fifo)
-	{
-		kfree(timer->fifo->fifo32.buf);
-		kfree(timer->fifo);
+		spinlock_unlock_irqrestore(&timerctl.lock, isCli);
+		return;
 	}
+
+	if (timer->flags == TIMER_FLAGS_ONCOUNTDOWN)
+		__timer_wheel_del(&timerctl.wheel, timer);
+	/* Freed after the unlock, the INT handler no longer sees it */
+	MPFIFO32 *fifo = timer->fifoOwned ? timer->fifo : NULL;
 	__timer_set_default_params(timer);
+	dlist_insert_before(&timerctl.freelist, &timer->timerDL);
 
-	dlist_insert_before(&timerctl.listtail->timerDL, &timer->timerDL);
+	spinlock_unlock_irqrestore(&timerctl.lock, isCli);
+	if (fifo)
+	{
+		kfree(fifo->fifo32.buf);
+		kfree(fifo);
+	}
 	return;
 }
 
 void timer_int_handler()
 {
-	bool isCli = io_get_is_cli();
-	if (!isCli)
-		_io_cli();
+	const bool isCli = spinlock_lock_irqsave(&timerctl.lock);
 
-	timerctl.tick++;
+	/* Tickless: one interrupt may stand for several ticks */
+	if (OS_TIMER_TICKLESS)
+		__pit_sync();
+	else
+		timerctl.tick++;
 	if (timerctl.next_alarm_on_tick > timerctl.tick)
+	{
+		if (OS_TIMER_TICKLESS)
+			__pit_program_next();
+		spinlock_unlock_irqrestore(&timerctl.lock, isCli);
 		return;
+	}
 
 	/* mProcess, tss */
 	bool isTssTriggerred = false;
 
-	TIMER *pos;
-	DLIST *head = &timerctl.listtail->timerDL;
-	list_for_each_entry(pos, head, timerDL)
+	DLIST expired;
+	dlist_init(&expired);
+	__timer_wheel_run(&timerctl.wheel, timerctl.tick, &expired);
+
+	/**
+	 * On trigger,
+	 *   - revert a timer back to ALLOCATED
+	 *   - push data to FIFO (does nothing if FIFO == NULL), in batches without
+	 *   the lock: waking a task arms the task timer (timer_settimer()); a timer
+	 *   re-armed or freed meanwhile is just removed from `expired`
+	 */
+	while (expired.next != &expired)
 	{
-		if (pos->target_tick > timerctl.tick)
-			break;
-		/**
-		 * On trigger,
-		 *   - push data to FIFO (does nothing if FIFO == NULL)
-		 *   - revert a timer back to ALLOCATED (alter the flag, remove from timerDL)
-		 */
-
-		/* mProcess, tss */
-		if (isTssTriggerred == false && tssTimer && pos == tssTimer)
-			isTssTriggerred = true;
-
-		mpfifo32_enqueue(pos->fifo, pos->data);
-
-		/**
-		 * WARN: Mutating the DList itself
-		 *   - set the pos to the original DList after detaching
-		 */
-		TIMER *prevTimer = __get_timer_prev(pos);
-		pos->flags = TIMER_FLAGS_ALLOCATED;
-		dlist_remove(&pos->timerDL);
-		pos = prevTimer;
+		MPFIFO32 *fifos[TIMER_EXPIRED_BATCH];
+		uint8_t data[TIMER_EXPIRED_BATCH];
+		int32_t n = 0;
+		while (n < TIMER_EXPIRED_BATCH && expired.next != &expired)
+		{
+			TIMER *t = container_of(expired.next, TIMER, timerDL);
+			dlist_remove(&t->timerDL);
+			t->flags = TIMER_FLAGS_ALLOCATED;
+
+			/* mProcess, tss */
+			if (isTssTriggerred == false && tssTimer && t == tssTimer)
+				isTssTriggerred = true;
 
+			fifos[n] = t->fifo;
+			data[n] = t->data;
+			n++;
+		}
+		spinlock_unlock(&timerctl.lock);
+		for (int32_t i = 0; i < n; i++)
+			mpfifo32_enqueue(fifos[i], data[i]);
+		spinlock_lock(&timerctl.lock);
 	}
 	/* Update `timerctl.next_alarm_on_tick` */
-	TIMER *firstTimer = __get_timer_next(timerctl.listtail);
-	timerctl.next_alarm_on_tick = firstTimer->target_tick;
+	timerctl.next_alarm_on_tick = __timer_wheel_next_tick(&timerctl.wheel);
+	if (OS_TIMER_TICKLESS)
+		__pit_program_next();
 
-	if (!isCli)
-		_io_sti();
+	spinlock_unlock_irqrestore(&timerctl.lock, isCli);
 
 	/* mProcess, tss */
 	if (isTssTriggerred == true)
@@ -353,6 +551,99 @@ void timer_int_handler()
 
 int32_t timer_gettick()
 {
+	if (OS_TIMER_TICKLESS)
+	{
+		const bool isCli = spinlock_lock_irqsave(&timerctl.lock);
+		__pit_sync();
+		spinlock_unlock_irqrestore(&timerctl.lock, isCli);
+	}
 	return timerctl.tick;
 }
 
+
+/**
+ * Drive a standalone wheel, check every timer triggers exactly on its `target_tick`
+ *   - tick by tick (as the periodic PIT), and jumping (as when ticks are skipped)
+ *   - across the level boundaries, the clamp of TIMER_WHEEL_MAX_DELTA, and cancel
+ */
+static TIMERWHEEL __test_wheel;
+static TIMER __test_timers[24];
+
+static bool __test_timer_run(TIMERWHEEL *w, uint32_t now, int32_t *fired)
+{
+	DLIST expired;
+	dlist_init(&expired);
+	__timer_wheel_run(w, now, &expired);
+	while (expired.next != &expired)
+	{
+		TIMER *t = container_of(expired.next, TIMER, timerDL);
+		dlist_remove(&t->timerDL);
+		if (t->target_tick != now)
+			return false;
+		if (t->flags != TIMER_FLAGS_ONCOUNTDOWN)
+			return false;
+		t->flags = TIMER_FLAGS_ALLOCATED;
+		(*fired)++;
+	}
+	return true;
+}
+
+bool test_timer(void)
+{
+	const uint32_t timeouts[] = {
+		1, 2, 31, 32, 33, 63, 64, 1000, 1023, 1024, 1025, 32767, 32768, 40000,
+		1048575, 1048576, 1048577, 33554430, 33554431, 33554432, 40000000, 7, 7, 500,
+	};
+	const int32_t n = sizeof(timeouts) / sizeof(timeouts[0]);
+	TIMERWHEEL *w = &__test_wheel;
+
+	for (int32_t pass = 0; pass < 2; pass++)
+	{
+		/* Start right before a level 0 boundary */
+		const uint32_t start = 0x12345 - 3;
+		__timer_wheel_init(w, start + 1);
+		for (int32_t i = 0; i < n; i++)
+		{
+			TIMER *t = &__test_timers[i];
+			__timer_set_default_params(t);
+			t->flags = TIMER_FLAGS_ONCOUNTDOWN;
+			t->target_tick = start + timeouts[i];
+			__timer_wheel_add(w, t);
+		}
+		/* Cancel one; it must never trigger */
+		__timer_wheel_del(w, &__test_timers[n - 1]);
+		__test_timers[n - 1].flags = TIMER_FLAGS_ALLOCATED;
+
+		int32_t fired = 0;
+		uint32_t now = start;
+		if (pass == 0)
+		{
+			/* Tick by tick, for the first 2^15 ticks */
+			for (; now < start + 32768 + 2; now++)
+			{
+				if (!__test_timer_run(w, now, &fired))
+					return false;
+			}
+		}
+		/* Jump to each next event */
+		for (;;)
+		{
+			const uint32_t next = __timer_wheel_next_tick(w);
+			if (next == UINT32_MAX)
+				break;
+			if ((int32_t) (next - now) < 0)
+				return false;
+			now = next;
+			if (!__test_timer_run(w, now, &fired))
+				return false;
+		}
+		if (fired != n - 1)
+			return false;
+		for (int32_t i = 0; i < TIMER_WHEEL_LEVELS; i++)
+		{
+			if (w->bitmap[i])
+				return false;
+		}
+	}
+	return true;
+}
@@ -5,23 +5,38 @@
 #include "kernel/mprocessfifo.h"
 #include "config.h"
 #include "util/dlist.h"
+#include "util/spinlock.h"
 
 #define TIMER_FLAGS_FREE 0
 /* Timer is allocated */
 #define TIMER_FLAGS_ALLOCATED 1
 /* Timer is counting down */
 #define TIMER_FLAGS_ONCOUNTDOWN 2
-#define TIMER_FLAGS_GUARDNODE 0xffff
+
+/* 32 slots per level, so that a level is tracked by a uint32_t bitmap */
+#define TIMER_WHEEL_BITS 5
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+/* 5 levels: 2^25 ticks, approx. 93 hours at 100Hz */
+#define TIMER_WHEEL_LEVELS 5
+/* A timer further than this is parked at the last level, and cascaded again */
+#define TIMER_WHEEL_MAX_DELTA ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
 
 /**
- * A basic solution:
- *   - all timers are allocated on boot
- *   - all timers are connected, in the order of `target_tick`
- *   - on trigger/on flag == 1, remove timer from the list
- *   - on free, insert timer before the listtail
+ * A hierarchical timing wheel:
+ *   - all timers are allocated on boot, the free ones are kept in a free list
+ *   - a running timer sits in one slot of the wheel (a DLIST), by `target_tick`
+ *   - level 0 slot n holds the timers to trigger on the tick (tick & 31) == n,
+ *   within the next 32 ticks
+ *   - level L slot n holds the timers of the next 32^(L+1) ticks, and is
+ *   "cascaded" (re-inserted into the lower levels) when the lower
+ *   levels wrap around
+ *
+ * Arm, cancel, and trigger are O(1); a cascade moves each timer at most
+ * TIMER_WHEEL_LEVELS - 1 times in its life
  */
 typedef struct TIMER {
-	/* Either running or free, does not include "allocated" timer */
+	/* In a wheel slot when running, in the free list when free; detached when "allocated" */
 	DLIST timerDL;
 	/* Trigger when system ticks == "alarm" */
 	uint32_t target_tick;
@@ -29,20 +44,34 @@ typedef struct TIMER {
 	/* This uses heap, only allocated on use */
 	MPFIFO32 *fifo;
 	uint8_t data;
+	/* `fifo` was allocated by timer_alloc(), and is freed with the timer */
+	bool fifoOwned;
+	/* level * TIMER_WHEEL_SLOTS + slot, valid when running */
+	uint16_t wheelSlot;
 } TIMER;
 
+typedef struct TIMERWHEEL {
+	/* All ticks before `tick` have been processed */
+	uint32_t tick;
+	/* bit n set: slot[level][n] is not empty */
+	uint32_t bitmap[TIMER_WHEEL_LEVELS];
+	DLIST slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TIMERWHEEL;
+
 typedef struct TIMERCTL {
+	/* Everything below, and the PIT; also taken by the INT handler (use the _irqsave variants) */
+	SPINLOCK lock;
+	/* Attached to `lock` if OS_LOCKSTAT */
+	LOCKSTAT lockstat;
 	uint32_t tick;
-	/* listtail->target_tick == UINT32_MAX, tail of the DLIST, connected to the head */
-	TIMER *listtail;
 	/*
-	 * The next `count` on which an alarm should be triggerred
-	 * No need to look into the timer array before that.
+	 * The next `count` on which an alarm should be triggerred (or the wheel
+	 * needs a cascade). No need to look into the wheel before that.
 	 */
 	uint32_t next_alarm_on_tick;
-	// /* The number of timers that are curruntly counting down */
-	//uint32_t total_running;
-	//TIMER *timers[OS_MAX_TIMER];
+	TIMERWHEEL wheel;
+	/* The free timers */
+	DLIST freelist;
 	/* 32 * 512 approx. 16KB. Want easy initialization */
 	TIMER timer[OS_MAX_TIMER];
 } TIMERCTL;
@@ -52,6 +81,9 @@ static void timerctl_init(void);
 void timer_int_handler(void);
 int32_t timer_gettick(void);
 static void __timer_set_default_params(TIMER *t);
+static void __pit_oneshot(uint32_t counts);
+static void __pit_sync(void);
+static void __pit_program_next(void);
 
 void PIT_init(void);
 TIMER* timer_alloc_customfifo(MPFIFO32 *fifo32);
@@ -59,5 +91,7 @@ TIMER* timer_alloc(void);
 void timer_settimer(TIMER *timer, uint32_t timeout, uint8_t data);
 void timer_free(TIMER *timer);
 TIMER* timer_get_tssTimer(void);
+const LOCKSTAT* timer_get_lockstat(void);
+bool test_timer(void);
 
 #endif
@@ -2,6 +2,7 @@
 
 #include <array>
 #include <cstddef>
+#include <cstdint>
 
 #include "error.hpp"
 
@@ -113,3 +114,126 @@ template <typename T> const T &ArrayQueue<T>::Front() const
 {
   return data_[read_pos_];
 }
+
+/**
+ * Lock-free FIFO for exactly one producer and one consumer (e.g. an interrupt
+ * handler and a thread), without disabling interrupts
+ *   - `head_` (read) is written by the consumer only, `tail_` (write) by the
+ *   producer only; both count up forever, the slot is the index modulo N
+ *   - Each index is on its own cache line, next to the other side's index as
+ *   last seen (a cache), so that the line of the other side is only read when
+ *   the cached index says full (or empty)
+ *   - Release on the index store publishes the slots before it; acquire on
+ *   the load of the other side's index
+ *   - A push to a full ring is dropped and counted in Overruns()
+ */
+template <typename T, size_t N> class SPSCRing
+{
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+  /* Producer */
+  Error Push(const T &value);
+  /* Producer; returns the number pushed, the rest is dropped (overruns) */
+  size_t PushN(const T *values, size_t n);
+  /* Consumer */
+  Error Pop(T &value);
+  /* Consumer; returns the number popped, at most `max` */
+  size_t PopN(T *values, size_t max);
+
+  /* Either side; a snapshot */
+  size_t Count() const;
+  bool IsEmpty() const;
+  size_t Capacity() const
+  {
+    return N;
+  }
+  uint64_t Overruns() const
+  {
+    return __atomic_load_n(&overruns_, __ATOMIC_RELAXED);
+  }
+
+private:
+  static const size_t kCacheLineSize = 64;
+  /* Producer side: how many slots are free, re-reading `head_` only when needed */
+  size_t FreeSlots(size_t want);
+
+  alignas(kCacheLineSize) size_t head_ = 0;
+  size_t cached_tail_ = 0;
+  alignas(kCacheLineSize) size_t tail_ = 0;
+  size_t cached_head_ = 0;
+  uint64_t overruns_ = 0;
+  alignas(kCacheLineSize) std::array<T, N> data_;
+};
+
+template <typename T, size_t N> size_t SPSCRing<T, N>::FreeSlots(size_t want)
+{
+  size_t free = N - (tail_ - cached_head_);
+  if (free < want)
+  {
+    cached_head_ = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+    free = N - (tail_ - cached_head_);
+  }
+  return free;
+}
+
+template <typename T, size_t N> Error SPSCRing<T, N>::Push(const T &value)
+{
+  if (FreeSlots(1) == 0)
+  {
+    __atomic_store_n(&overruns_, overruns_ + 1, __ATOMIC_RELAXED);
+    return MAKE_ERROR(Error::kFull);
+  }
+  data_[tail_ & (N - 1)] = value;
+  __atomic_store_n(&tail_, tail_ + 1, __ATOMIC_RELEASE);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+template <typename T, size_t N> size_t SPSCRing<T, N>::PushN(const T *values, size_t n)
+{
+  const size_t free = FreeSlots(n);
+  const size_t pushed = n < free ? n : free;
+  for (size_t i = 0; i < pushed; ++i)
+  {
+    data_[(tail_ + i) & (N - 1)] = values[i];
+  }
+  if (pushed < n)
+  {
+    __atomic_store_n(&overruns_, overruns_ + (n - pushed), __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&tail_, tail_ + pushed, __ATOMIC_RELEASE);
+  return pushed;
+}
+
+template <typename T, size_t N> Error SPSCRing<T, N>::Pop(T &value)
+{
+  return PopN(&value, 1) ? MAKE_ERROR(Error::kSuccess) : MAKE_ERROR(Error::kEmpty);
+}
+
+template <typename T, size_t N> size_t SPSCRing<T, N>::PopN(T *values, size_t max)
+{
+  size_t available = cached_tail_ - head_;
+  if (available < max)
+  {
+    cached_tail_ = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE);
+    available = cached_tail_ - head_;
+  }
+  const size_t popped = max < available ? max : available;
+  for (size_t i = 0; i < popped; ++i)
+  {
+    values[i] = data_[(head_ + i) & (N - 1)];
+  }
+  __atomic_store_n(&head_, head_ + popped, __ATOMIC_RELEASE);
+  return popped;
+}
+
+template <typename T, size_t N> size_t SPSCRing<T, N>::Count() const
+{
+  const size_t head = __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) - head;
+}
+
+template <typename T, size_t N> bool SPSCRing<T, N>::IsEmpty() const
+{
+  return Count() == 0;
+}
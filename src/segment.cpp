@@ -46,5 +46,13 @@ void SetupSegments()
   gdt[0].data = 0;
   SetCodeSegment(gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
   SetDataSegment(gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+  LoadSegments();
+}
+
+/**
+ * Load the gdt built by SetupSegments(); the APs share it
+ */
+void LoadSegments()
+{
   LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
 }
@@ -36,3 +36,4 @@ void SetDataSegment(SegmentDescriptor &desc, DescriptorType type, unsigned int d
                     uint32_t base, uint32_t limit);
 
 void SetupSegments();
+void LoadSegments();
@@ -0,0 +1,288 @@
+/**
+ * @file spinlock.hpp
+ *
+ * Spin locks for the state shared between CPUs
+ *
+ *   - SpinLock: test-and-test-and-set, the cheapest; no fairness
+ *   - TicketLock: FIFO order; every waiter spins on the same line
+ *   - MCSLock: FIFO order; every waiter spins on its own Node, so a release
+ *   touches only the next waiter's line
+ *   - None of them disables interrupts: a lock also taken by an interrupt
+ *   handler must be held with interrupts off (IRQLockGuard, or an
+ *   InterruptGuard), or the handler deadlocks on its own CPU
+ *   - Optional LockStats (SetStats()); nothing is measured without them
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+
+/** @brief Contention of one lock; written by the holder only, in TSC ticks */
+struct LockStats
+{
+  uint64_t acquisitions;
+  /* Acquisitions that had to wait */
+  uint64_t contended;
+  uint64_t spin_tsc;
+  uint64_t max_hold_tsc;
+};
+
+namespace lock_detail
+{
+/* The LockStats bookkeeping shared by the locks */
+class Recorder
+{
+public:
+  void SetStats(LockStats *stats)
+  {
+    stats_ = stats;
+  }
+  /* When the first try failed; 0 if the stats are off */
+  uint64_t SpinStart() const
+  {
+    return stats_ ? ReadTSC() : 0;
+  }
+  /* Right after the lock is taken; `spin_start` 0 if not contended */
+  void Acquired(uint64_t spin_start)
+  {
+    if (!stats_)
+    {
+      return;
+    }
+    acquired_at_ = ReadTSC();
+    ++stats_->acquisitions;
+    if (spin_start)
+    {
+      ++stats_->contended;
+      stats_->spin_tsc += acquired_at_ - spin_start;
+    }
+  }
+  /* Right before the lock is released */
+  void Releasing()
+  {
+    if (!stats_)
+    {
+      return;
+    }
+    const uint64_t hold = ReadTSC() - acquired_at_;
+    if (hold > stats_->max_hold_tsc)
+    {
+      stats_->max_hold_tsc = hold;
+    }
+  }
+
+private:
+  LockStats *stats_ = nullptr;
+  uint64_t acquired_at_ = 0;
+};
+} // namespace lock_detail
+
+/**
+ * Test-and-test-and-set: waiters spin on a plain load (the cache line stays
+ * shared) and only retry the atomic exchange once it looks free
+ */
+class SpinLock
+{
+public:
+  void Lock()
+  {
+    uint64_t spin_start = 0;
+    while (__atomic_exchange_n(&locked_, true, __ATOMIC_ACQUIRE))
+    {
+      if (!spin_start)
+      {
+        spin_start = recorder_.SpinStart();
+      }
+      while (__atomic_load_n(&locked_, __ATOMIC_RELAXED))
+      {
+        __builtin_ia32_pause();
+      }
+    }
+    recorder_.Acquired(spin_start);
+  }
+  bool TryLock()
+  {
+    if (__atomic_load_n(&locked_, __ATOMIC_RELAXED) || __atomic_exchange_n(&locked_, true, __ATOMIC_ACQUIRE))
+    {
+      return false;
+    }
+    recorder_.Acquired(0);
+    return true;
+  }
+  void Unlock()
+  {
+    recorder_.Releasing();
+    __atomic_store_n(&locked_, false, __ATOMIC_RELEASE);
+  }
+  void SetStats(LockStats *stats)
+  {
+    recorder_.SetStats(stats);
+  }
+
+private:
+  bool locked_ = false;
+  lock_detail::Recorder recorder_;
+};
+
+/**
+ * A waiter takes the next ticket and waits for `owner_` to reach it
+ *   - May be released by another thread than the one that took it (the run
+ *   queues: ThreadManager::FinishSwitch())
+ */
+class TicketLock
+{
+public:
+  void Lock()
+  {
+    const uint32_t ticket = __atomic_fetch_add(&next_, 1, __ATOMIC_RELAXED);
+    uint64_t spin_start = 0;
+    if (__atomic_load_n(&owner_, __ATOMIC_ACQUIRE) != ticket)
+    {
+      spin_start = recorder_.SpinStart();
+      while (__atomic_load_n(&owner_, __ATOMIC_ACQUIRE) != ticket)
+      {
+        __builtin_ia32_pause();
+      }
+    }
+    recorder_.Acquired(spin_start);
+  }
+  void Unlock()
+  {
+    recorder_.Releasing();
+    /* Only the holder writes `owner_` */
+    __atomic_store_n(&owner_, owner_ + 1, __ATOMIC_RELEASE);
+  }
+  void SetStats(LockStats *stats)
+  {
+    recorder_.SetStats(stats);
+  }
+
+private:
+  uint32_t next_ = 0;
+  uint32_t owner_ = 0;
+  lock_detail::Recorder recorder_;
+};
+
+/**
+ * J. M. Mellor-Crummey and M. L. Scott, "Algorithms for Scalable
+ * Synchronization on Shared-Memory Multiprocessors", 1991
+ *   - The waiters form a queue of Nodes (on their stacks); each spins on its own
+ *   - The Node must live from Lock() to Unlock(), which are called with the same one
+ */
+class MCSLock
+{
+public:
+  struct Node
+  {
+    Node *next;
+    /* Cleared by the predecessor when it hands the lock over */
+    bool waiting;
+  };
+
+  void Lock(Node &node)
+  {
+    node.next = nullptr;
+    node.waiting = true;
+    Node *prev = __atomic_exchange_n(&tail_, &node, __ATOMIC_ACQ_REL);
+    uint64_t spin_start = 0;
+    if (prev)
+    {
+      spin_start = recorder_.SpinStart();
+      __atomic_store_n(&prev->next, &node, __ATOMIC_RELEASE);
+      while (__atomic_load_n(&node.waiting, __ATOMIC_ACQUIRE))
+      {
+        __builtin_ia32_pause();
+      }
+    }
+    recorder_.Acquired(spin_start);
+  }
+  void Unlock(Node &node)
+  {
+    recorder_.Releasing();
+    Node *next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE);
+    if (!next)
+    {
+      Node *expected = &node;
+      /* No waiter: free */
+      if (__atomic_compare_exchange_n(&tail_, &expected, nullptr, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      {
+        return;
+      }
+      /* A waiter took the tail, but has not linked itself yet */
+      while (!(next = __atomic_load_n(&node.next, __ATOMIC_ACQUIRE)))
+      {
+        __builtin_ia32_pause();
+      }
+    }
+    __atomic_store_n(&next->waiting, false, __ATOMIC_RELEASE);
+  }
+  void SetStats(LockStats *stats)
+  {
+    recorder_.SetStats(stats);
+  }
+
+private:
+  /* The last waiter (or the holder); nullptr when free */
+  Node *tail_ = nullptr;
+  lock_detail::Recorder recorder_;
+};
+
+/** @brief Hold `lock` in a scope */
+template <class Lock>
+class LockGuard
+{
+public:
+  explicit LockGuard(Lock &lock) : lock_{lock}
+  {
+    lock_.Lock();
+  }
+  ~LockGuard()
+  {
+    lock_.Unlock();
+  }
+  LockGuard(const LockGuard &) = delete;
+  LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+  Lock &lock_;
+};
+
+template <>
+class LockGuard<MCSLock>
+{
+public:
+  explicit LockGuard(MCSLock &lock) : lock_{lock}
+  {
+    lock_.Lock(node_);
+  }
+  ~LockGuard()
+  {
+    lock_.Unlock(node_);
+  }
+  LockGuard(const LockGuard &) = delete;
+  LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+  MCSLock &lock_;
+  MCSLock::Node node_;
+};
+
+/**
+ * Disable interrupts, then hold `lock`, in a scope; the lock is released
+ * before RFLAGS.IF is restored (the members are destroyed in reverse order)
+ */
+template <class Lock>
+class IRQLockGuard
+{
+public:
+  explicit IRQLockGuard(Lock &lock) : lock_{lock}
+  {
+  }
+
+private:
+  InterruptGuard interrupts_;
+  LockGuard<Lock> lock_;
+};
@@ -6,5 +6,6 @@
 #define EINVARG 2 // Invalid Arguments
 #define ENOMEM 3 // NO MEMORY
 #define EBADPATH 4 // BAD PATH FORMAT
+#define ETIMEDOUT 5 // TIMED OUT
 
 #endif
@@ -3,6 +3,11 @@
 #include "util/dlist.h"
 #include "util/kutil.h"
 #include "util/fifo.h"
+#include "util/spinlock.h"
+#include "pic/timer.h"
+#include "kernel/process.h"
+#include "kernel/mprocessfifo.h"
+#include "kernel/waitqueue.h"
 
 bool test_all()
 {
@@ -12,6 +17,16 @@ bool test_all()
 		return false;
 	if (!test_fifo32())
 		return false;
+	if (!test_spinlock())
+		return false;
+	if (!test_timer())
+		return false;
+	if (!test_mprocess())
+		return false;
+	if (!test_waitqueue())
+		return false;
+	if (!test_mpfifo32())
+		return false;
 	return true;
 }
 
@@ -54,3 +69,209 @@ bool heap_debug()
 }
 
 
+
+#include "io/io.h"
+
+typedef void *(*BENCH_MEMCPY_FN)(void *, const void *, size_t);
+typedef void *(*BENCH_MEMSET_FN)(void *, int, size_t);
+
+/*
+ * Copy/fill `size` bytes until ~64MB are moved, print bytes per 1000 cycles
+ * (The TSC frequency is unknown here, so no MB/s)
+ */
+static void bench_kutil_mem_one(const char *name, BENCH_MEMCPY_FN cpy, BENCH_MEMSET_FN set, uint8_t *dst, uint8_t *src, size_t size)
+{
+	const uint32_t loops = (64 * 1024 * 1024) / size;
+	uint64_t t0 = _io_rdtsc();
+	for (uint32_t i = 0; i < loops; i++)
+		cpy(dst, src, size);
+	uint64_t t1 = _io_rdtsc();
+	for (uint32_t i = 0; i < loops; i++)
+		set(dst, (int) i, size);
+	uint64_t t2 = _io_rdtsc();
+
+	const uint64_t bytes = (uint64_t) loops * size;
+	printf("%s %7u B: cpy %llu B/kc, set %llu B/kc\n", name, (uint32_t) size,
+			bytes * 1000 / (t1 - t0 + 1), bytes * 1000 / (t2 - t1 + 1));
+}
+
+static void bench_kutil_mem(void)
+{
+	const size_t sizes[] = {16, 4096, 1024 * 1024};
+	/* +1: also measure a misaligned src */
+	uint8_t *src = kmalloc(1024 * 1024 + 64);
+	uint8_t *dst = kmalloc(1024 * 1024 + 64);
+	if (!src || !dst)
+		goto out;
+	printf("kmem, erms: %d\n", kutil_cpu_has_erms());
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		bench_kutil_mem_one("byte", __kmemcpy_byte, __kmemset_byte, dst, src, sizes[i]);
+		bench_kutil_mem_one("word", __kmemcpy_word, __kmemset_word, dst, src, sizes[i]);
+		bench_kutil_mem_one("erms", __kmemcpy_erms, __kmemset_erms, dst, src, sizes[i]);
+		bench_kutil_mem_one("word+1", __kmemcpy_word, __kmemset_word, dst, src + 1, sizes[i]);
+	}
+out:
+	kfree(src);
+	kfree(dst);
+}
+
+/* kstrlen (word at a time) against the byte loop, print bytes per 1000 cycles */
+static void bench_kutil_str(void)
+{
+	const size_t sizes[] = {16, 256, 4096};
+	char *s = kmalloc(4096 + 1);
+	if (!s)
+		return;
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		kmemset(s, 'a', sizes[i]);
+		s[sizes[i]] = '\0';
+		const uint32_t loops = (16 * 1024 * 1024) / sizes[i];
+		volatile size_t sink = 0;
+		uint64_t t0 = _io_rdtsc();
+		for (uint32_t j = 0; j < loops; j++)
+			sink += __kstrlen_byte(s);
+		uint64_t t1 = _io_rdtsc();
+		for (uint32_t j = 0; j < loops; j++)
+			sink += kstrlen(s);
+		uint64_t t2 = _io_rdtsc();
+		for (uint32_t j = 0; j < loops; j++)
+			sink += kstrcmp((const unsigned char *) s, (const unsigned char *) s);
+		uint64_t t3 = _io_rdtsc();
+		(void) sink;
+
+		const uint64_t bytes = (uint64_t) loops * sizes[i];
+		printf("kstr %4u B: strlen byte %llu, word %llu; strcmp %llu B/kc\n", (uint32_t) sizes[i],
+				bytes * 1000 / (t1 - t0 + 1), bytes * 1000 / (t2 - t1 + 1), bytes * 1000 / (t3 - t2 + 1));
+	}
+	kfree(s);
+}
+
+/*
+ * Arm (and re-arm) 10k timers across the pool, then cancel them; print cycles per operation
+ * The timeouts are far enough to not trigger during the benchmark
+ */
+static void bench_timer(void)
+{
+	TIMER *timers[OS_MAX_TIMER];
+	int32_t n = 0;
+	uint32_t seed = 1;
+	while (n < OS_MAX_TIMER && (timers[n] = timer_alloc_customfifo(NULL)))
+		n++;
+	if (n == 0)
+		return;
+
+	uint64_t t0 = _io_rdtsc();
+	for (int32_t i = 0; i < 10000; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		timer_settimer(timers[i % n], 1000 + (seed >> 8) % 1000000, 1);
+	}
+	uint64_t t1 = _io_rdtsc();
+	for (int32_t i = 0; i < n; i++)
+		timer_free(timers[i]);
+	uint64_t t2 = _io_rdtsc();
+
+	printf("timer: %d timers, arm %llu c/op, cancel %llu c/op\n", n, (t1 - t0) / 10000, (t2 - t1) / n);
+	const LOCKSTAT *stat = timer_get_lockstat();
+	if (stat)
+		printf("timer lock: %u acq, %u contended, %llu spin c, %llu max hold c\n",
+				stat->acquisitions, stat->contended, stat->spin_cycles, stat->max_hold_cycles);
+}
+
+/*
+ * Uncontended lock + unlock of each lock; print cycles per pair
+ */
+static void bench_spinlock(void)
+{
+	const uint32_t rounds = 100000;
+	SPINLOCK s;
+	TICKETLOCK t;
+	MCSLOCK m;
+	MCSNODE n;
+	spinlock_init(&s, NULL);
+	ticketlock_init(&t, NULL);
+	mcslock_init(&m, NULL);
+
+	uint64_t t0 = _io_rdtsc();
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		spinlock_lock(&s);
+		spinlock_unlock(&s);
+	}
+	uint64_t t1 = _io_rdtsc();
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		ticketlock_lock(&t);
+		ticketlock_unlock(&t);
+	}
+	uint64_t t2 = _io_rdtsc();
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		mcslock_lock(&m, &n);
+		mcslock_unlock(&m, &n);
+	}
+	uint64_t t3 = _io_rdtsc();
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		const bool isCli = spinlock_lock_irqsave(&s);
+		spinlock_unlock_irqrestore(&s, isCli);
+	}
+	uint64_t t4 = _io_rdtsc();
+
+	printf("lock: spin %llu c/op, ticket %llu c/op, mcs %llu c/op, spin irqsave %llu c/op\n",
+			(t1 - t0) / rounds, (t2 - t1) / rounds, (t3 - t2) / rounds, (t4 - t3) / rounds);
+}
+
+static TASK __bench_ping, __bench_pong;
+
+static void __bench_mprocess_pong(void)
+{
+	for (;;)
+		_mprocess_switch(&__bench_pong.esp, __bench_ping.esp);
+}
+
+/*
+ * Ping-pong between two contexts with _mprocess_switch(), without the scheduler;
+ * print cycles per switch, and switches per second (over 100 ticks, 1s)
+ */
+static void bench_mprocess_switch(void)
+{
+	const uint32_t rounds = 100000;
+	uint8_t *stack = kmalloc(4096);
+	if (!stack)
+		return;
+	mprocess_task_set_entry(&__bench_pong, (uint32_t) &__bench_mprocess_pong, (uint32_t) (uintptr_t) stack + 4096 - 4);
+	/* Warm up, and start the pong */
+	_mprocess_switch(&__bench_ping.esp, __bench_pong.esp);
+
+	uint64_t t0 = _io_rdtsc();
+	for (uint32_t i = 0; i < rounds; i++)
+		_mprocess_switch(&__bench_ping.esp, __bench_pong.esp);
+	uint64_t t1 = _io_rdtsc();
+
+	uint32_t switches = 0;
+	int32_t tick = timer_gettick();
+	while (timer_gettick() == tick)
+		;
+	tick = timer_gettick();
+	while (timer_gettick() - tick < 100)
+	{
+		for (uint32_t i = 0; i < 1000; i++)
+			_mprocess_switch(&__bench_ping.esp, __bench_pong.esp);
+		switches += 2000;
+	}
+
+	printf("mprocess switch: %llu c/switch, %u switches/s\n", (t1 - t0) / (rounds * 2), switches);
+	kfree(stack);
+}
+
+void bench_all(void)
+{
+	bench_kutil_mem();
+	bench_kutil_str();
+	bench_spinlock();
+	bench_timer();
+	bench_mprocess_switch();
+}
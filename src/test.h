@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 bool test_all();
+void bench_all(void);
 
 #endif
 
@@ -0,0 +1,604 @@
+/**
+ * @file thread.cpp
+ *
+ * Preemptive kernel threads
+ */
+
+#include "thread.hpp"
+
+#include <cstddef>
+#include <limits>
+
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "timer.hpp"
+
+static_assert(offsetof(ThreadContext, fxsave_area) == 16, "SwitchContext() expects the FXSAVE area at +16");
+
+namespace
+{
+/* FXSAVE image of the x87/SSE state after reset: FCW = 0x037f, MXCSR = 0x1f80 (all exceptions masked) */
+const size_t kFXSaveFCW = 0;
+const size_t kFXSaveMXCSR = 24;
+/* IF = 0: Bootstrap() turns interrupts on once the run queue is unlocked */
+const uint64_t kInitialRFLAGS = 0x002;
+} // namespace
+
+Thread::Thread()
+    : context_{}, id_{0}, level_{0}, state_{State::kFree}, func_{nullptr}, data_{0}, stack_{kNullFrame},
+      prev_{nullptr}, next_{nullptr}, cpu_{0}, on_cpu_{false}, pinned_{false}
+{
+}
+
+Error Thread::InitContext(ThreadFunc *func, int64_t data)
+{
+  if (stack_.ID() == kNullFrame.ID())
+  {
+    const auto stack = memory_manager->Allocate(kStackFrames);
+    if (stack.error)
+    {
+      return stack.error;
+    }
+    stack_ = stack.value;
+  }
+  func_ = func;
+  data_ = data;
+
+  /**
+   * The frame SwitchContext() pops, from the top:
+   *   - 0: the return address of Bootstrap() (never used); keeps rsp % 16 == 8 on its entry
+   *   - Bootstrap, to `ret` to
+   *   - rbp, rbx, r12, r13, r14, r15
+   *   - RFLAGS
+   */
+  uint64_t *top = reinterpret_cast<uint64_t *>(reinterpret_cast<uintptr_t>(stack_.Frame()) +
+                                               kStackFrames * kBytesPerFrame);
+  top[-1] = 0;
+  top[-2] = reinterpret_cast<uint64_t>(&ThreadManager::Bootstrap);
+  for (int i = 3; i <= 8; ++i)
+  {
+    top[-i] = 0;
+  }
+  top[-9] = kInitialRFLAGS;
+  context_.rsp = reinterpret_cast<uint64_t>(&top[-9]);
+
+  context_.fxsave_area.fill(0);
+  context_.fxsave_area[kFXSaveFCW] = 0x7f;
+  context_.fxsave_area[kFXSaveFCW + 1] = 0x03;
+  context_.fxsave_area[kFXSaveMXCSR] = 0x80;
+  context_.fxsave_area[kFXSaveMXCSR + 1] = 0x1f;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+ThreadManager::ThreadManager() : threads_{}, threads_lock_{}, run_queues_{}, next_id_{0}
+{
+  for (int i = 0; i < kMaxCPUs; ++i)
+  {
+    run_queues_[i].cpu = i;
+    run_queues_[i].lock.SetStats(&run_queues_[i].lock_stats);
+  }
+}
+
+Error ThreadManager::Initialize(int level)
+{
+  {
+    InterruptGuard guard;
+    RunQueue &rq = ThisRunQueue();
+    rq.lock.Lock();
+    /* The caller's context is saved on its first switch */
+    Thread *main = &threads_[0];
+    main->id_ = next_id_++;
+    main->level_ = level;
+    main->state_ = Thread::State::kRunnable;
+    main->cpu_ = rq.cpu;
+    main->on_cpu_ = true;
+    main->pinned_ = true;
+    rq.current = main;
+    Enqueue(rq, main);
+    rq.lock.Unlock();
+  }
+
+  const auto idle = CreateThread(IdleThread, 0, kIdleLevel, CurrentCPU().index, true);
+  if (idle.error)
+  {
+    return idle.error;
+  }
+  {
+    InterruptGuard guard;
+    RunQueue &rq = ThisRunQueue();
+    rq.lock.Lock();
+    __atomic_store_n(&rq.idle, idle.value, __ATOMIC_RELEASE);
+    rq.lock.Unlock();
+  }
+  __atomic_store_n(&CurrentCPU().online, true, __ATOMIC_RELEASE);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void ThreadManager::StartCPU()
+{
+  /* Interrupts are still off since the trampoline */
+  Thread *idle = nullptr;
+  threads_lock_.Lock();
+  for (auto &t : threads_)
+  {
+    if (IsReusable(t))
+    {
+      idle = &t;
+      break;
+    }
+  }
+  if (idle)
+  {
+    idle->state_ = Thread::State::kRunnable;
+    idle->id_ = next_id_++;
+  }
+  threads_lock_.Unlock();
+  if (!idle)
+  {
+    /* Stays offline */
+    while (true)
+    {
+      __asm__ volatile("hlt");
+    }
+  }
+
+  /* Its stack is the AP's boot stack, `stack_` is not used */
+  RunQueue &rq = ThisRunQueue();
+  idle->level_ = kIdleLevel;
+  idle->cpu_ = rq.cpu;
+  idle->on_cpu_ = true;
+  idle->pinned_ = true;
+  rq.lock.Lock();
+  rq.current = idle;
+  Enqueue(rq, idle);
+  rq.idle_since_tsc = ReadTSC();
+  __atomic_store_n(&rq.idle, idle, __ATOMIC_RELEASE);
+  rq.lock.Unlock();
+
+  __atomic_store_n(&CurrentCPU().online, true, __ATOMIC_RELEASE);
+  __asm__ volatile("sti");
+  IdleThread(idle->id_, 0);
+  while (true)
+  {
+    __asm__ volatile("hlt");
+  }
+}
+
+WithError<Thread *> ThreadManager::NewThread(ThreadFunc *func, int64_t data, int level)
+{
+  int cpu;
+  {
+    InterruptGuard guard;
+    cpu = CurrentCPU().index;
+  }
+  return CreateThread(func, data, level, cpu, false);
+}
+
+WithError<Thread *> ThreadManager::CreateThread(ThreadFunc *func, int64_t data, int level, int cpu, bool pinned)
+{
+  if (level < 0 || level >= kLevels)
+  {
+    return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+  }
+
+  Thread *thread = nullptr;
+  {
+    InterruptGuard guard;
+    /* Also serializes the stack allocation; the frame allocator has no lock of its own */
+    threads_lock_.Lock();
+    for (auto &t : threads_)
+    {
+      if (IsReusable(t))
+      {
+        thread = &t;
+        break;
+      }
+    }
+    if (!thread)
+    {
+      threads_lock_.Unlock();
+      return {nullptr, MAKE_ERROR(Error::kFull)};
+    }
+    /* Reserve the slot; not runnable until the context is ready */
+    thread->state_ = Thread::State::kSleeping;
+    thread->id_ = next_id_++;
+    thread->cpu_ = cpu;
+    thread->pinned_ = pinned;
+    const Error err = thread->InitContext(func, data);
+    if (err)
+    {
+      thread->state_ = Thread::State::kFree;
+    }
+    threads_lock_.Unlock();
+    if (err)
+    {
+      return {nullptr, err};
+    }
+  }
+  Wakeup(thread, level);
+  return {thread, MAKE_ERROR(Error::kSuccess)};
+}
+
+Thread &ThreadManager::CurrentThread()
+{
+  InterruptGuard guard;
+  return *ThisRunQueue().current;
+}
+
+void ThreadManager::Sleep(Thread *thread)
+{
+  InterruptGuard guard;
+  RunQueue &rq = LockRunQueueOf(thread);
+  if (thread->state_ != Thread::State::kRunnable)
+  {
+    rq.lock.Unlock();
+    return;
+  }
+  Dequeue(rq, thread);
+  thread->state_ = Thread::State::kSleeping;
+  const bool local = &rq == &ThisRunQueue();
+  if (thread == rq.current)
+  {
+    if (local)
+    {
+      SwitchTo(rq, PickNext(rq));
+      return;
+    }
+    rq.lock.Unlock();
+    /* Running on another CPU: it switches away in Preempt() */
+    SendIPI(rq.cpu, InterruptVector::kReschedule);
+    return;
+  }
+  if (local)
+  {
+    UpdateTimeSlice(rq, false);
+  }
+  rq.lock.Unlock();
+}
+
+void ThreadManager::Wakeup(Thread *thread, int level)
+{
+  InterruptGuard guard;
+  RunQueue &rq = LockRunQueueOf(thread);
+  if (thread->state_ == Thread::State::kFree || thread->state_ == Thread::State::kExited)
+  {
+    rq.lock.Unlock();
+    return;
+  }
+  if (level < 0 || level >= kLevels)
+  {
+    level = thread->level_;
+  }
+
+  if (thread->state_ == Thread::State::kRunnable)
+  {
+    if (thread->level_ == level)
+    {
+      rq.lock.Unlock();
+      return;
+    }
+    Dequeue(rq, thread);
+  }
+  thread->level_ = level;
+  thread->state_ = Thread::State::kRunnable;
+  Enqueue(rq, thread);
+
+  const bool local = &rq == &ThisRunQueue();
+  if (local)
+  {
+    UpdateTimeSlice(rq, false);
+  }
+  /* Preempts the current thread of its CPU (the caller's Preempt() if local), or waits for it */
+  const bool preempts = thread != rq.current && thread->level_ < rq.current->level_;
+  const bool waits = thread != rq.current && !preempts && rq.current != rq.idle && !thread->pinned_;
+  rq.lock.Unlock();
+
+  if (preempts && !local)
+  {
+    SendIPI(rq.cpu, InterruptVector::kReschedule);
+  }
+  else if (waits)
+  {
+    KickIdleCPU(rq.cpu);
+  }
+}
+
+void ThreadManager::Preempt()
+{
+  InterruptGuard guard;
+  RunQueue &rq = ThisRunQueue();
+  rq.lock.Lock();
+  Thread *next = PickNext(rq);
+  if (rq.current->state_ != Thread::State::kRunnable || next->level_ < rq.current->level_)
+  {
+    SwitchTo(rq, next);
+    return;
+  }
+  rq.lock.Unlock();
+}
+
+void ThreadManager::Yield()
+{
+  InterruptGuard guard;
+  RunQueue &rq = ThisRunQueue();
+  rq.lock.Lock();
+  if (rq.current->state_ == Thread::State::kRunnable)
+  {
+    Dequeue(rq, rq.current);
+    Enqueue(rq, rq.current);
+  }
+  SwitchTo(rq, PickNext(rq));
+}
+
+void ThreadManager::Exit()
+{
+  __asm__ volatile("cli" : : : "memory");
+  RunQueue &rq = ThisRunQueue();
+  rq.lock.Lock();
+  Dequeue(rq, rq.current);
+  rq.current->state_ = Thread::State::kExited;
+  /* The stack is still in use until the switch; it is only reused by a later NewThread() */
+  SwitchTo(rq, PickNext(rq));
+  while (true)
+  {
+    __asm__ volatile("hlt");
+  }
+}
+
+ThreadManager::CPUStats ThreadManager::Stats(int cpu)
+{
+  InterruptGuard guard;
+  RunQueue &rq = run_queues_[cpu];
+  rq.lock.Lock();
+  CPUStats stats = rq.stats;
+  stats.lock = rq.lock_stats;
+  if (rq.idle && rq.current == rq.idle)
+  {
+    stats.idle_tsc += ReadTSC() - rq.idle_since_tsc;
+  }
+  rq.lock.Unlock();
+  return stats;
+}
+
+/**
+ * The first `ret` of a new thread lands here, with interrupts off and its
+ * run queue still locked by the switch
+ */
+void ThreadManager::Bootstrap()
+{
+  thread_manager->FinishSwitch();
+  __asm__ volatile("sti" : : : "memory");
+  Thread &thread = thread_manager->CurrentThread();
+  thread.func_(thread.id_, thread.data_);
+  thread_manager->Exit();
+}
+
+/**
+ * Runs when nothing else on this CPU is runnable; a thread made runnable here
+ * from another CPU comes with an IPI, which ends the `hlt`
+ */
+void ThreadManager::IdleThread(uint64_t thread_id, int64_t data)
+{
+  while (true)
+  {
+    __asm__ volatile("cli" : : : "memory");
+    if (thread_manager->Steal())
+    {
+      thread_manager->Preempt();
+      __asm__ volatile("sti" : : : "memory");
+      continue;
+    }
+    /* `sti` takes effect after `hlt` starts: an interrupt in between still wakes it */
+    __asm__ volatile("sti\n\thlt" : : : "memory");
+  }
+}
+
+bool ThreadManager::IsReusable(const Thread &thread)
+{
+  return (thread.state_ == Thread::State::kFree || thread.state_ == Thread::State::kExited) &&
+         !__atomic_load_n(&thread.on_cpu_, __ATOMIC_ACQUIRE);
+}
+
+/* Interrupts must be off: the thread could move to another CPU */
+ThreadManager::RunQueue &ThreadManager::ThisRunQueue()
+{
+  return run_queues_[CurrentCPU().index];
+}
+
+ThreadManager::RunQueue &ThreadManager::LockRunQueueOf(Thread *thread)
+{
+  while (true)
+  {
+    const int cpu = __atomic_load_n(&thread->cpu_, __ATOMIC_RELAXED);
+    RunQueue &rq = run_queues_[cpu];
+    rq.lock.Lock();
+    if (thread->cpu_ == cpu)
+    {
+      return rq;
+    }
+    rq.lock.Unlock();
+  }
+}
+
+void ThreadManager::Enqueue(RunQueue &rq, Thread *thread)
+{
+  const int level = thread->level_;
+  thread->next_ = nullptr;
+  thread->prev_ = rq.tail[level];
+  if (rq.tail[level])
+  {
+    rq.tail[level]->next_ = thread;
+  }
+  else
+  {
+    rq.head[level] = thread;
+  }
+  rq.tail[level] = thread;
+  ++rq.count[level];
+  ++rq.runnable;
+  rq.level_bitmap |= 1u << level;
+}
+
+void ThreadManager::Dequeue(RunQueue &rq, Thread *thread)
+{
+  const int level = thread->level_;
+  if (thread->prev_)
+  {
+    thread->prev_->next_ = thread->next_;
+  }
+  else
+  {
+    rq.head[level] = thread->next_;
+  }
+  if (thread->next_)
+  {
+    thread->next_->prev_ = thread->prev_;
+  }
+  else
+  {
+    rq.tail[level] = thread->prev_;
+  }
+  thread->prev_ = thread->next_ = nullptr;
+  --rq.runnable;
+  if (--rq.count[level] == 0)
+  {
+    rq.level_bitmap &= ~(1u << level);
+  }
+}
+
+/* The idle thread never sleeps, so there is always one */
+Thread *ThreadManager::PickNext(const RunQueue &rq) const
+{
+  return rq.head[__builtin_ctz(rq.level_bitmap)];
+}
+
+void ThreadManager::SwitchTo(RunQueue &rq, Thread *next)
+{
+  Thread *prev = rq.current;
+  __atomic_store_n(&rq.current, next, __ATOMIC_RELAXED);
+  UpdateTimeSlice(rq, true);
+  if (next == prev)
+  {
+    rq.lock.Unlock();
+    return;
+  }
+
+  const uint64_t now = ReadTSC();
+  if (prev == rq.idle)
+  {
+    rq.stats.idle_tsc += now - rq.idle_since_tsc;
+  }
+  if (next == rq.idle)
+  {
+    rq.idle_since_tsc = now;
+  }
+  ++rq.stats.switches;
+
+  next->on_cpu_ = true;
+  rq.switched_from = prev;
+  SwitchContext(&next->context_, &prev->context_);
+  /* Resumed, maybe on another CPU (stolen meanwhile): `rq` is stale */
+  FinishSwitch();
+}
+
+void ThreadManager::FinishSwitch()
+{
+  RunQueue &rq = ThisRunQueue();
+  __atomic_store_n(&rq.switched_from->on_cpu_, false, __ATOMIC_RELEASE);
+  rq.switched_from = nullptr;
+  rq.lock.Unlock();
+}
+
+void ThreadManager::UpdateTimeSlice(RunQueue &rq, bool restart)
+{
+  const bool needed = rq.current->state_ == Thread::State::kRunnable && rq.count[rq.current->level_] > 1;
+  if (needed && (restart || !rq.time_slice_armed))
+  {
+    SetTimeSliceDeadline(NowNanoseconds() + kTimeSliceNs);
+    rq.time_slice_armed = true;
+  }
+  else if (!needed && rq.time_slice_armed)
+  {
+    SetTimeSliceDeadline(std::numeric_limits<uint64_t>::max());
+    rq.time_slice_armed = false;
+  }
+}
+
+void ThreadManager::KickIdleCPU(int except)
+{
+  RunQueue &mine = ThisRunQueue();
+  if (mine.current == mine.idle)
+  {
+    /* This CPU steals on its way back to the idle loop */
+    return;
+  }
+  for (auto &rq : run_queues_)
+  {
+    Thread *idle = __atomic_load_n(&rq.idle, __ATOMIC_ACQUIRE);
+    if (rq.cpu == except || &rq == &mine || !idle)
+    {
+      continue;
+    }
+    if (__atomic_load_n(&rq.current, __ATOMIC_RELAXED) == idle)
+    {
+      SendIPI(rq.cpu, InterruptVector::kReschedule);
+      return;
+    }
+  }
+}
+
+/* From the idle loop, with interrupts off */
+bool ThreadManager::Steal()
+{
+  RunQueue &mine = ThisRunQueue();
+  RunQueue *victim = nullptr;
+  int most_waiting = 0;
+  /* A racy look for the busiest CPU; re-checked under the locks */
+  for (auto &rq : run_queues_)
+  {
+    Thread *idle = __atomic_load_n(&rq.idle, __ATOMIC_ACQUIRE);
+    if (&rq == &mine || !idle)
+    {
+      continue;
+    }
+    const bool busy = __atomic_load_n(&rq.current, __ATOMIC_RELAXED) != idle;
+    const int waiting = __atomic_load_n(&rq.runnable, __ATOMIC_RELAXED) - 1 - (busy ? 1 : 0);
+    if (waiting > most_waiting)
+    {
+      most_waiting = waiting;
+      victim = &rq;
+    }
+  }
+  if (!victim)
+  {
+    return false;
+  }
+
+  RunQueue &first = mine.cpu < victim->cpu ? mine : *victim;
+  RunQueue &second = mine.cpu < victim->cpu ? *victim : mine;
+  first.lock.Lock();
+  second.lock.Lock();
+  /* The highest level first; the running (or being switched) one cannot move */
+  Thread *thread = nullptr;
+  for (uint32_t bitmap = victim->level_bitmap; bitmap && !thread; bitmap &= bitmap - 1)
+  {
+    for (Thread *t = victim->head[__builtin_ctz(bitmap)]; t; t = t->next_)
+    {
+      if (!t->pinned_ && !t->on_cpu_)
+      {
+        thread = t;
+        break;
+      }
+    }
+  }
+  if (thread)
+  {
+    Dequeue(*victim, thread);
+    __atomic_store_n(&thread->cpu_, mine.cpu, __ATOMIC_RELAXED);
+    Enqueue(mine, thread);
+    ++mine.stats.steals;
+  }
+  second.lock.Unlock();
+  first.lock.Unlock();
+  return thread != nullptr;
+}
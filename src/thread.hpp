@@ -0,0 +1,206 @@
+/**
+ * @file thread.hpp
+ *
+ * Preemptive kernel threads
+ *
+ *   - Each thread has its own stack (from the frame allocator) and is switched
+ *   in software by SwitchContext() (asmfunc.asm)
+ *   - Priority-aware round robin: a ready queue per level (0 is the highest),
+ *   and a bitmap of the non-empty levels; the highest level always runs
+ *   - Threads of the same level share the CPU in time slices, ended by the
+ *   Local APIC timer; a lone thread has no time slice (no periodic tick)
+ *   - SMP: every CPU has its own run queue and idle thread; a thread stays on
+ *   the CPU it was created (or last stolen) on, and an idle CPU steals a
+ *   waiting thread from the busiest one
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "error.hpp"
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+/** @brief What SwitchContext() saves; the layout is shared with asmfunc.asm */
+struct ThreadContext
+{
+  /* The callee-saved registers and RFLAGS are on the stack */
+  uint64_t rsp;
+  /* x87/SSE state, FXSAVE format */
+  alignas(16) std::array<uint8_t, 512> fxsave_area;
+};
+
+using ThreadFunc = void(uint64_t thread_id, int64_t data);
+
+class Thread
+{
+public:
+  /* 64 KiB */
+  static const size_t kStackFrames = 16;
+
+  enum class State
+  {
+    kFree,
+    /* Allocated, not runnable */
+    kSleeping,
+    /* In the ready queue of its level (the running one included) */
+    kRunnable,
+    /* Returned from its ThreadFunc; the slot and the stack are reused */
+    kExited,
+  };
+
+  Thread();
+  uint64_t ID() const
+  {
+    return id_;
+  }
+  int Level() const
+  {
+    return level_;
+  }
+  State GetState() const
+  {
+    return state_;
+  }
+  /** @brief The CPU whose run queue the thread belongs to */
+  int CPUIndex() const
+  {
+    return cpu_;
+  }
+
+private:
+  friend class ThreadManager;
+
+  /* Allocate the stack (if not yet), and make the thread start in ThreadManager::Bootstrap() */
+  Error InitContext(ThreadFunc *func, int64_t data);
+
+  ThreadContext context_;
+  uint64_t id_;
+  int level_;
+  State state_;
+  ThreadFunc *func_;
+  int64_t data_;
+  FrameID stack_;
+  /* The ready queue of `level_` */
+  Thread *prev_, *next_;
+  /* Changed with both run queues locked (stealing) */
+  int cpu_;
+  /* The registers live on a CPU: from being switched to, until its context is saved */
+  bool on_cpu_;
+  /* Never stolen: the main and the idle threads */
+  bool pinned_;
+};
+
+/**
+ * Per-CPU run queues; the state is shared with the interrupt handlers and the
+ * other CPUs, so every method runs with interrupts off (InterruptGuard) and
+ * the run queue locked
+ *   - A run queue's lock is held across a switch, and released by the thread
+ *   switched to (FinishSwitch()), so that no other CPU runs a thread whose
+ *   context is not saved yet
+ *   - Two run queues are locked in the order of their CPU index
+ *   - The run queue lock is a TicketLock: a CPU busy switching on its own run
+ *   queue cannot starve the others stealing from it
+ */
+class ThreadManager
+{
+public:
+  static const int kLevels = 4;
+  static const int kIdleLevel = kLevels - 1;
+  static const size_t kMaxThreads = 64;
+  /* 10ms */
+  static const uint64_t kTimeSliceNs = 10000000;
+
+  struct CPUStats
+  {
+    /* TSC ticks spent in the idle thread, the current idle period included */
+    uint64_t idle_tsc;
+    uint64_t switches;
+    /* Threads this CPU took from the others */
+    uint64_t steals;
+    /* The run queue's lock */
+    LockStats lock;
+  };
+
+  ThreadManager();
+
+  /** @brief On the BSP: adopt the caller as the first thread (id 0, pinned) at `level`, and start the idle thread */
+  Error Initialize(int level);
+  /** @brief On an AP: adopt the caller as this CPU's idle thread, and run the idle loop */
+  [[noreturn]] void StartCPU();
+  /** @brief Create a thread running `func(id, data)` at `level` on this CPU; runnable, but not switched to */
+  WithError<Thread *> NewThread(ThreadFunc *func, int64_t data, int level);
+  Thread &CurrentThread();
+
+  /** @brief Make `thread` not runnable; returns when woken, if it is the current thread */
+  void Sleep(Thread *thread);
+  /** @brief Make `thread` runnable (at `level`; -1 keeps its level); switches on the other CPUs only */
+  void Wakeup(Thread *thread, int level = -1);
+  /** @brief Switch if a higher level thread is runnable, e.g. after Wakeup() in an interrupt handler */
+  void Preempt();
+  /** @brief The current thread goes after its peers of the same level; e.g. the time slice is over */
+  void Yield();
+  /** @brief End the current thread */
+  [[noreturn]] void Exit();
+
+  CPUStats Stats(int cpu);
+
+private:
+  friend class Thread;
+
+  struct RunQueue
+  {
+    TicketLock lock;
+    LockStats lock_stats;
+    int cpu;
+    std::array<Thread *, kLevels> head, tail;
+    std::array<int, kLevels> count;
+    /* bit n set: level n has a runnable thread */
+    uint32_t level_bitmap;
+    /* The idle thread included */
+    int runnable;
+    Thread *current;
+    /* nullptr until the CPU is online */
+    Thread *idle;
+    /* Being switched away from; FinishSwitch() clears its on_cpu_ */
+    Thread *switched_from;
+    bool time_slice_armed;
+    uint64_t idle_since_tsc;
+    CPUStats stats;
+  };
+
+  static void Bootstrap();
+  static void IdleThread(uint64_t thread_id, int64_t data);
+  /* Free, or exited and its stack no longer in use */
+  static bool IsReusable(const Thread &thread);
+
+  WithError<Thread *> CreateThread(ThreadFunc *func, int64_t data, int level, int cpu, bool pinned);
+  RunQueue &ThisRunQueue();
+  /* Lock the run queue `thread` belongs to; retries if it is stolen meanwhile */
+  RunQueue &LockRunQueueOf(Thread *thread);
+  void Enqueue(RunQueue &rq, Thread *thread);
+  void Dequeue(RunQueue &rq, Thread *thread);
+  Thread *PickNext(const RunQueue &rq) const;
+  /* `rq` (this CPU's) must be locked; it is unlocked on return */
+  void SwitchTo(RunQueue &rq, Thread *next);
+  /* Right after a switch, in the thread switched to */
+  void FinishSwitch();
+  /* Give the current thread of this CPU a time slice if it has a peer; `restart` for a new slice */
+  void UpdateTimeSlice(RunQueue &rq, bool restart);
+  /* Ask an idle CPU other than `except` to steal a thread */
+  void KickIdleCPU(int except);
+  /* Move a waiting thread of the busiest CPU to this one; false if there is none */
+  bool Steal();
+
+  std::array<Thread, kMaxThreads> threads_;
+  /* Slot allocation in threads_, next_id_ */
+  SpinLock threads_lock_;
+  std::array<RunQueue, kMaxCPUs> run_queues_;
+  uint64_t next_id_;
+};
+
+extern ThreadManager *thread_manager;
@@ -0,0 +1,438 @@
+/**
+ * @file timer.cpp
+ *
+ * Timekeeping: TSC clocksource + Local APIC timer (tickless)
+ */
+
+#include "timer.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "asmfunc.h"
+#include "cpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+
+namespace
+{
+/* ISO C++ has no 128-bit integer; used for the 64x64->128 multiplications only (no libcall) */
+__extension__ typedef unsigned __int128 uint128_t;
+
+/**
+ * Local APIC timer registers
+ * Intel SDM Vol.3A Table 11-1. Local APIC Register Address Map
+ */
+const uint64_t kLAPICLVTTimer = 0xfee00320;
+const uint64_t kLAPICInitialCount = 0xfee00380;
+const uint64_t kLAPICCurrentCount = 0xfee00390;
+const uint64_t kLAPICDivideConfig = 0xfee003e0;
+/* LVT Timer: bit 16 mask, bit 18:17 mode (00 one-shot, 01 periodic, 10 TSC-deadline) */
+const uint32_t kLVTMasked = 1u << 16;
+const uint32_t kLVTModeOneShot = 0u << 17;
+const uint32_t kLVTModeTSCDeadline = 2u << 17;
+/* Divide Configuration: 0b1011 == divide by 1 */
+const uint32_t kDivideBy1 = 0b1011;
+/* IA32_TSC_DEADLINE; writing 0 disarms */
+const uint32_t kMSRTSCDeadline = 0x6e0;
+
+/**
+ * The WRMSR of IA32_TSC_DEADLINE is not serializing: without a fence it may
+ * pass earlier stores (e.g. the LVT Timer, the EOI) and loads (SDM 11.5.4.1)
+ */
+void WriteTSCDeadline(uint64_t deadline_tsc)
+{
+  __asm__ volatile("mfence; lfence" ::: "memory");
+  WriteMSR(kMSRTSCDeadline, deadline_tsc);
+}
+
+/**
+ * PIT channel 2 is used for calibration only; its gate is controlled by port 0x61
+ * (bit 0 gate, bit 1 speaker, bit 5 OUT2), so it can be polled without an interrupt
+ */
+const uint16_t kPortPITChannel2 = 0x42;
+const uint16_t kPortPITCommand = 0x43;
+const uint16_t kPortPITGate = 0x61;
+const uint64_t kPITFrequency = 1193182;
+/* 10ms */
+const uint16_t kPITCalibrateCounts = 11932;
+/* The shortest of the rounds is the least disturbed (SMI, emulator scheduling) */
+const int kCalibrateRounds = 3;
+/* A PIT window takes approx. 10k port reads; give up after 100x that (no PIT) */
+const int kCalibrateMaxPoll = 1000000;
+
+const uint64_t kNanosecondsPerSecond = 1000000000;
+
+uint64_t tsc_frequency = 0;
+uint64_t tsc_base = 0;
+/* ns = (tsc - tsc_base) * ns_mult >> 32 */
+uint64_t ns_mult = 0;
+/* tsc - tsc_base = ns * tsc_mult >> 32 */
+uint64_t tsc_mult = 0;
+/* LAPIC timer counts = tsc * lapic_mult >> 32; one-shot mode only */
+uint64_t lapic_mult = 0;
+bool tsc_deadline_mode = false;
+uint8_t lapic_timer_vector = 0;
+
+/**
+ * The Local APIC timer is shared by TimerManager and the time slice; it is
+ * armed for the earlier one. Written by both the threads and the interrupt
+ * handler, so always with interrupts off.
+ *   - timers_deadline_ns is for the BSP's timer only
+ *   - the rest is per CPU, each CPU only touches its own
+ */
+uint64_t timers_deadline_ns = std::numeric_limits<uint64_t>::max();
+struct LAPICTimerState
+{
+  uint64_t slice_deadline_ns = std::numeric_limits<uint64_t>::max();
+  /* What the hardware is armed for; UINT64_MAX if stopped (or fired) */
+  uint64_t armed_deadline_ns = std::numeric_limits<uint64_t>::max();
+};
+std::array<LAPICTimerState, kMaxCPUs> lapic_timer_states;
+
+volatile uint32_t &LAPICRegister(uint64_t addr)
+{
+  return *reinterpret_cast<volatile uint32_t *>(addr);
+}
+
+/** @brief (a << 32) / b, without a 128-bit division */
+uint64_t DivShift32(uint64_t a, uint64_t b)
+{
+  return ((a / b) << 32) + (((a % b) << 32) / b);
+}
+
+uint64_t MulShift32(uint64_t a, uint64_t mult)
+{
+  return static_cast<uint64_t>((static_cast<uint128_t>(a) * mult) >> 32);
+}
+
+/** @brief Run PIT channel 2 for kPITCalibrateCounts, count the TSC and LAPIC ticks meanwhile
+ *
+ * @return false if OUT2 never goes high (no PIT)
+ */
+bool MeasurePITWindow(uint64_t &tsc_ticks, uint32_t &lapic_ticks)
+{
+  /* Gate on, speaker off */
+  IoOut8(kPortPITGate, (IoIn8(kPortPITGate) & ~0x02) | 0x01);
+  /* Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary; OUT2 goes low */
+  IoOut8(kPortPITCommand, 0xb0);
+  IoOut8(kPortPITChannel2, kPITCalibrateCounts & 0xff);
+  IoOut8(kPortPITChannel2, kPITCalibrateCounts >> 8);
+
+  LAPICRegister(kLAPICInitialCount) = std::numeric_limits<uint32_t>::max();
+  const uint64_t tsc_start = ReadTSC();
+  int poll = 0;
+  while (!(IoIn8(kPortPITGate) & 0x20))
+  {
+    if (++poll == kCalibrateMaxPoll)
+    {
+      return false;
+    }
+  }
+  tsc_ticks = ReadTSC() - tsc_start;
+  lapic_ticks = std::numeric_limits<uint32_t>::max() - LAPICRegister(kLAPICCurrentCount);
+  LAPICRegister(kLAPICInitialCount) = 0;
+  return true;
+}
+
+/* Interrupts must be off */
+void ProgramLAPICTimer()
+{
+  const int cpu = CurrentCPU().index;
+  LAPICTimerState &state = lapic_timer_states[cpu];
+  const uint64_t deadline =
+      cpu == 0 ? std::min(timers_deadline_ns, state.slice_deadline_ns) : state.slice_deadline_ns;
+  if (deadline == state.armed_deadline_ns)
+  {
+    return;
+  }
+  state.armed_deadline_ns = deadline;
+  if (deadline == std::numeric_limits<uint64_t>::max())
+  {
+    StopLAPICTimer();
+  }
+  else
+  {
+    ArmLAPICTimer(deadline);
+  }
+}
+
+/* On the BSP only */
+void SetTimersDeadline(uint64_t deadline_ns)
+{
+  InterruptGuard guard;
+  timers_deadline_ns = deadline_ns;
+  ProgramLAPICTimer();
+}
+} // namespace
+
+Error InitializeTimekeeping(uint8_t vector)
+{
+  uint32_t a, b, c, d;
+  /* CPUID.01H:ECX[24] TSC-deadline */
+  ReadCPUID(0x01, 0, &a, &b, &c, &d);
+  tsc_deadline_mode = c & (1u << 24);
+  /* CPUID.80000007H:EDX[8] invariant TSC; otherwise the rate may change with P/C-states */
+  ReadCPUID(0x80000000, 0, &a, &b, &c, &d);
+  bool invariant_tsc = false;
+  if (a >= 0x80000007)
+  {
+    ReadCPUID(0x80000007, 0, &a, &b, &c, &d);
+    invariant_tsc = d & (1u << 8);
+  }
+  if (!invariant_tsc)
+  {
+    Log(kWarn, "Timekeeping: TSC is not invariant, the clock may drift\n");
+  }
+
+  lapic_timer_vector = vector;
+  /* Masked one-shot while calibrating */
+  LAPICRegister(kLAPICDivideConfig) = kDivideBy1;
+  LAPICRegister(kLAPICLVTTimer) = kLVTMasked | kLVTModeOneShot | vector;
+
+  uint64_t best_tsc = std::numeric_limits<uint64_t>::max();
+  uint32_t best_lapic = 0;
+  for (int i = 0; i < kCalibrateRounds; ++i)
+  {
+    uint64_t tsc_ticks;
+    uint32_t lapic_ticks;
+    if (!MeasurePITWindow(tsc_ticks, lapic_ticks))
+    {
+      return MAKE_ERROR(Error::kNoTimerSource);
+    }
+    if (tsc_ticks < best_tsc)
+    {
+      best_tsc = tsc_ticks;
+      best_lapic = lapic_ticks;
+    }
+  }
+  if (best_tsc == 0 || best_lapic == 0)
+  {
+    return MAKE_ERROR(Error::kNoTimerSource);
+  }
+
+  tsc_frequency = best_tsc * kPITFrequency / kPITCalibrateCounts;
+  ns_mult = DivShift32(kNanosecondsPerSecond, tsc_frequency);
+  tsc_mult = DivShift32(tsc_frequency, kNanosecondsPerSecond);
+  lapic_mult = DivShift32(best_lapic, best_tsc);
+
+  LAPICRegister(kLAPICLVTTimer) = (tsc_deadline_mode ? kLVTModeTSCDeadline : kLVTModeOneShot) | vector;
+  tsc_base = ReadTSC();
+
+  Log(kDebug, "Timekeeping: TSC %lu kHz, LAPIC timer %lu kHz, %s mode\n", tsc_frequency / 1000,
+      static_cast<uint64_t>(best_lapic) * kPITFrequency / kPITCalibrateCounts / 1000,
+      tsc_deadline_mode ? "TSC-deadline" : "one-shot");
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void InitializeLAPICTimer()
+{
+  LAPICRegister(kLAPICDivideConfig) = kDivideBy1;
+  LAPICRegister(kLAPICLVTTimer) = (tsc_deadline_mode ? kLVTModeTSCDeadline : kLVTModeOneShot) | lapic_timer_vector;
+}
+
+uint64_t NowNanoseconds()
+{
+  return MulShift32(ReadTSC() - tsc_base, ns_mult);
+}
+
+uint64_t TSCFrequency()
+{
+  return tsc_frequency;
+}
+
+bool IsTSCDeadlineMode()
+{
+  return tsc_deadline_mode;
+}
+
+void ArmLAPICTimer(uint64_t deadline_ns)
+{
+  /* Not calibrated: never fire */
+  if (tsc_frequency == 0)
+  {
+    return;
+  }
+  const uint64_t deadline_tsc = tsc_base + MulShift32(deadline_ns, tsc_mult);
+  if (tsc_deadline_mode)
+  {
+    /* A deadline in the past fires immediately */
+    WriteTSCDeadline(deadline_tsc);
+    return;
+  }
+
+  /* One-shot: a count of 0 stops the timer, and the count is 32 bits (fire early and re-arm) */
+  const uint64_t now_tsc = ReadTSC();
+  uint64_t counts = deadline_tsc > now_tsc ? MulShift32(deadline_tsc - now_tsc, lapic_mult) : 0;
+  if (counts == 0)
+  {
+    counts = 1;
+  }
+  if (counts > std::numeric_limits<uint32_t>::max())
+  {
+    counts = std::numeric_limits<uint32_t>::max();
+  }
+  LAPICRegister(kLAPICInitialCount) = counts;
+}
+
+void StopLAPICTimer()
+{
+  if (tsc_deadline_mode)
+  {
+    WriteTSCDeadline(0);
+  }
+  else
+  {
+    LAPICRegister(kLAPICInitialCount) = 0;
+  }
+}
+
+void SetTimeSliceDeadline(uint64_t deadline_ns)
+{
+  InterruptGuard guard;
+  lapic_timer_states[CurrentCPU().index].slice_deadline_ns = deadline_ns;
+  ProgramLAPICTimer();
+}
+
+LAPICTimerEvents LAPICTimerOnInterrupt()
+{
+  InterruptGuard guard;
+  const uint64_t now = NowNanoseconds();
+  const int cpu = CurrentCPU().index;
+  LAPICTimerState &state = lapic_timer_states[cpu];
+  /* One-shot mode fires early for a deadline beyond 32 bits of counts */
+  state.armed_deadline_ns = std::numeric_limits<uint64_t>::max();
+
+  LAPICTimerEvents events{false, false};
+  if (cpu == 0 && timers_deadline_ns <= now)
+  {
+    /* Re-armed by TimerManager::ProcessExpired() */
+    timers_deadline_ns = std::numeric_limits<uint64_t>::max();
+    events.timers = true;
+  }
+  if (state.slice_deadline_ns <= now)
+  {
+    state.slice_deadline_ns = std::numeric_limits<uint64_t>::max();
+    events.time_slice = true;
+  }
+  ProgramLAPICTimer();
+  return events;
+}
+
+TimerManager::TimerManager() : heap_{}, count_{0}, next_id_{1}
+{
+}
+
+WithError<uint64_t> TimerManager::Add(uint64_t deadline_ns, uint64_t period_ns, Callback callback, void *arg)
+{
+  if (count_ == kMaxTimers)
+  {
+    return {0, MAKE_ERROR(Error::kFull)};
+  }
+  const uint64_t id = next_id_++;
+  Push(Entry{deadline_ns, period_ns, id, callback, arg});
+  Rearm();
+  return {id, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error TimerManager::Cancel(uint64_t id)
+{
+  for (size_t i = 0; i < count_; ++i)
+  {
+    if (heap_[i].id == id)
+    {
+      RemoveAt(i);
+      Rearm();
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+  return MAKE_ERROR(Error::kNoSuchTimer);
+}
+
+void TimerManager::ProcessExpired()
+{
+  uint64_t now = NowNanoseconds();
+  while (count_ > 0 && heap_[0].deadline_ns <= now)
+  {
+    /* Detach first: the callback may Add() or Cancel() */
+    Entry entry = heap_[0];
+    RemoveAt(0);
+    if (entry.period_ns)
+    {
+      entry.deadline_ns += entry.period_ns;
+      /* Skip the missed periods rather than running them back to back */
+      if (entry.deadline_ns <= now)
+      {
+        entry.deadline_ns = now + entry.period_ns;
+      }
+      Push(entry);
+    }
+    entry.callback(now, entry.arg);
+    now = NowNanoseconds();
+  }
+  Rearm();
+}
+
+void TimerManager::Push(const Entry &entry)
+{
+  heap_[count_] = entry;
+  SiftUp(count_++);
+}
+
+void TimerManager::RemoveAt(size_t index)
+{
+  --count_;
+  if (index == count_)
+  {
+    return;
+  }
+  heap_[index] = heap_[count_];
+  /* The moved entry can be smaller than the parent (when not removing the root), or larger than a child */
+  SiftUp(index);
+  SiftDown(index);
+}
+
+void TimerManager::SiftUp(size_t index)
+{
+  const Entry entry = heap_[index];
+  while (index > 0)
+  {
+    const size_t parent = (index - 1) / 2;
+    if (heap_[parent].deadline_ns <= entry.deadline_ns)
+    {
+      break;
+    }
+    heap_[index] = heap_[parent];
+    index = parent;
+  }
+  heap_[index] = entry;
+}
+
+void TimerManager::SiftDown(size_t index)
+{
+  const Entry entry = heap_[index];
+  while (true)
+  {
+    size_t child = index * 2 + 1;
+    if (child >= count_)
+    {
+      break;
+    }
+    if (child + 1 < count_ && heap_[child + 1].deadline_ns < heap_[child].deadline_ns)
+    {
+      ++child;
+    }
+    if (entry.deadline_ns <= heap_[child].deadline_ns)
+    {
+      break;
+    }
+    heap_[index] = heap_[child];
+    index = child;
+  }
+  heap_[index] = entry;
+}
+
+void TimerManager::Rearm()
+{
+  SetTimersDeadline(count_ ? heap_[0].deadline_ns : std::numeric_limits<uint64_t>::max());
+}
@@ -0,0 +1,119 @@
+/**
+ * @file timer.hpp
+ *
+ * Timekeeping: TSC clocksource + Local APIC timer (tickless)
+ *
+ *   - The TSC is calibrated against the PIT channel 2 on boot, and is the only
+ *   clock: NowNanoseconds() = (TSC - TSC on boot) converted to ns
+ *   - The Local APIC timer is never periodic; it is armed for the earliest
+ *   deadline only (TSC-deadline mode if supported, one-shot mode otherwise)
+ *   - TimerManager keeps the callbacks ordered by deadline (a binary min-heap)
+ *   - The scheduler's time slice shares the Local APIC timer: it is armed for
+ *   the earlier of the two deadlines
+ *   - SMP: every CPU has its own Local APIC timer and time slice; the
+ *   TimerManager deadlines are on the BSP's only (TimerManager is used by the
+ *   main thread, which is pinned to the BSP)
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+/** @brief Calibrate the TSC (and the Local APIC timer), and set the clock to 0
+ *
+ * Must be called with interrupts disabled; it busy-waits on the PIT for a few 10ms.
+ * @vector the IDT vector the Local APIC timer is to raise
+ */
+Error InitializeTimekeeping(uint8_t vector);
+
+/** @brief Program this CPU's Local APIC timer like InitializeTimekeeping() did the BSP's; for the APs */
+void InitializeLAPICTimer();
+
+/** @brief Nanoseconds since InitializeTimekeeping(); monotonic */
+uint64_t NowNanoseconds();
+/** @brief The calibrated TSC frequency in Hz */
+uint64_t TSCFrequency();
+/** @brief Whether the Local APIC timer runs in TSC-deadline mode */
+bool IsTSCDeadlineMode();
+
+/** @brief Fire this CPU's Local APIC timer (once) at `deadline_ns` on the NowNanoseconds() clock
+ *
+ * A deadline in the past fires as soon as possible. Replaces the previous deadline.
+ */
+void ArmLAPICTimer(uint64_t deadline_ns);
+/** @brief Cancel the pending Local APIC timer interrupt, if any */
+void StopLAPICTimer();
+
+/** @brief The time slice of this CPU's current thread ends at `deadline_ns`; UINT64_MAX for none */
+void SetTimeSliceDeadline(uint64_t deadline_ns);
+
+struct LAPICTimerEvents
+{
+  /* TimerManager::ProcessExpired() has callbacks to run; on the BSP only */
+  bool timers;
+  /* The time slice is over; it is cleared until the next SetTimeSliceDeadline() */
+  bool time_slice;
+};
+/** @brief For the Local APIC timer interrupt handler: what has expired; re-arms for the rest */
+LAPICTimerEvents LAPICTimerOnInterrupt();
+
+/** @brief Deadline-ordered timer callbacks on top of the Local APIC timer
+ *
+ * - The interrupt handler only queues a message; ProcessExpired() is called
+ * from the main loop on that message, so callbacks never run in interrupt context
+ * - Not reentrant: Add(), Cancel() and ProcessExpired() are for the main loop
+ * (and the callbacks called by it) only; only the hardware deadline is shared
+ * with the interrupt handler
+ * - Add/Cancel/pop are O(log n) (Cancel searches the id in O(n))
+ */
+class TimerManager
+{
+public:
+  /** @now_ns NowNanoseconds() when the callback is run, >= its deadline */
+  using Callback = void (*)(uint64_t now_ns, void *arg);
+  static const size_t kMaxTimers = 64;
+
+  TimerManager();
+
+  /** @brief Call `callback(now, arg)` once NowNanoseconds() >= deadline_ns
+   *
+   * @period_ns 0 for a one-shot timer; otherwise re-added with deadline += period_ns after each run
+   * @return the id for Cancel() (never 0), or Error::kFull
+   */
+  WithError<uint64_t> Add(uint64_t deadline_ns, uint64_t period_ns, Callback callback, void *arg);
+  /** @brief Remove a pending timer; Error::kNoSuchTimer if it has fired (one-shot) or does not exist */
+  Error Cancel(uint64_t id);
+  /** @brief Run the callbacks of every expired timer, then re-arm the Local APIC timer */
+  void ProcessExpired();
+  size_t Count() const
+  {
+    return count_;
+  }
+
+private:
+  struct Entry
+  {
+    uint64_t deadline_ns;
+    uint64_t period_ns;
+    uint64_t id;
+    Callback callback;
+    void *arg;
+  };
+
+  void Push(const Entry &entry);
+  void RemoveAt(size_t index);
+  void SiftUp(size_t index);
+  void SiftDown(size_t index);
+  /* Hand the deadline of heap_[0] to the Local APIC timer */
+  void Rearm();
+
+  std::array<Entry, kMaxTimers> heap_;
+  size_t count_;
+  uint64_t next_id_;
+};
+
+extern TimerManager *timer_manager;
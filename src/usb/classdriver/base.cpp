@@ -9,4 +9,14 @@ ClassDriver::ClassDriver(Device *dev) : dev_{dev}
 ClassDriver::~ClassDriver()
 {
 }
+
+Error ClassDriver::OnBulkCompleted(EndpointID ep_id, const void *buf, int len)
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error ClassDriver::OnTransferFailed(EndpointID ep_id, int completion_code)
+{
+  return MAKE_ERROR(Error::kTransferFailed);
+}
 } // namespace usb
@@ -25,6 +25,10 @@ public:
   virtual Error OnEndpointsConfigured() = 0;
   virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len) = 0;
   virtual Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) = 0;
+  /** Bulk 転送の完了．Bulk エンドポイントを持たないドライバは実装不要． */
+  virtual Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len);
+  /** エンドポイント ep_id の転送が失敗した（completion_code は xHCI の Completion Code）． */
+  virtual Error OnTransferFailed(EndpointID ep_id, int completion_code);
 
   /** このクラスドライバを保持する USB デバイスを返す． */
   Device *ParentDevice() const
@@ -0,0 +1,324 @@
+#include "usb/classdriver/hub.hpp"
+
+#include <algorithm>
+
+#include "logger.hpp"
+#include "timer.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+#include "usb/xhci/speed.hpp"
+
+namespace
+{
+/* USB 2.0 11.24.2, USB 3.2 10.16.2 */
+const uint8_t kHubDescriptorType = 0x29;
+const uint8_t kSuperSpeedHubDescriptorType = 0x2a;
+const uint8_t kSetHubDepth = 12;
+
+/* Feature selectors */
+const uint16_t kPortReset = 4;
+const uint16_t kPortPower = 8;
+
+/* wPortStatus */
+const uint16_t kPortConnection = 1u << 0;
+const uint16_t kPortEnable = 1u << 1;
+const uint16_t kPortLowSpeed = 1u << 9;
+const uint16_t kPortHighSpeed = 1u << 10;
+/* wPortChange */
+const uint16_t kPortConnectionChange = 1u << 0;
+const uint16_t kPortResetChange = 1u << 4;
+
+/**
+ * The feature selector that clears each bit of wPortChange: C_PORT_CONNECTION,
+ * C_PORT_ENABLE, C_PORT_SUSPEND, C_PORT_OVER_CURRENT, C_PORT_RESET, and for
+ * SuperSpeed hubs C_BH_PORT_RESET, C_PORT_LINK_STATE, C_PORT_CONFIG_ERROR;
+ * the hub's own wHubChange bits are C_HUB_LOCAL_POWER (0), C_HUB_OVER_CURRENT (1)
+ */
+const std::array<int, 8> kPortChangeFeatures{16, 17, 18, 19, 20, 29, 25, 26};
+const std::array<int, 8> kHubChangeFeatures{0, 1, -1, -1, -1, -1, -1, -1};
+
+int PortSpeed(bool super_speed, uint16_t status)
+{
+  if (super_speed)
+  {
+    return usb::xhci::kSuperSpeed;
+  }
+  if (status & kPortLowSpeed)
+  {
+    return usb::xhci::kLowSpeed;
+  }
+  return status & kPortHighSpeed ? usb::xhci::kHighSpeed : usb::xhci::kFullSpeed;
+}
+} // namespace
+
+namespace usb
+{
+HubDriver::HubDriver(Device *dev, int interface_index) : ClassDriver{dev}, interface_index_{interface_index}
+{
+}
+
+void *HubDriver::operator new(size_t size)
+{
+  return AllocMem(sizeof(HubDriver), 0, 0);
+}
+
+void HubDriver::operator delete(void *ptr) noexcept
+{
+  FreeMem(ptr);
+}
+
+Error HubDriver::Initialize()
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error HubDriver::SetEndpoint(const EndpointConfig &config)
+{
+  if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn())
+  {
+    ep_interrupt_in_ = config.ep_id;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error HubDriver::OnEndpointsConfigured()
+{
+  if (phase_ != Phase::kNotConfigured)
+  {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  super_speed_ = ParentDevice()->Speed() >= xhci::kSuperSpeed;
+
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kIn;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = request_type::kDevice;
+  setup_data.request = request::kGetDescriptor;
+  setup_data.value = (super_speed_ ? kSuperSpeedHubDescriptorType : kHubDescriptorType) << 8;
+  setup_data.index = 0;
+  setup_data.length = desc_buf_.size();
+
+  phase_ = Phase::kHubDescriptor;
+  return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data, desc_buf_.data(), desc_buf_.size(), this);
+}
+
+Error HubDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len)
+{
+  switch (phase_)
+  {
+  case Phase::kHubDescriptor: {
+    if (len < 7)
+    {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    const uint16_t characteristics = desc_buf_[3] | desc_buf_[4] << 8;
+    num_ports_ = std::min<int>(desc_buf_[2], kMaxPorts);
+    power_on_delay_ = desc_buf_[5];
+    const int think_time = super_speed_ ? 0 : (characteristics >> 5) & 3;
+    Log(kInfo, "hub: %d ports%s, think time %d\n", desc_buf_[2], super_speed_ ? " (SuperSpeed)" : "", think_time);
+
+    /* The default alternate setting: a multi-TT hub runs with a single TT */
+    if (auto err = ParentDevice()->ConfigureHub(this, num_ports_, think_time, false))
+    {
+      return err;
+    }
+    if (super_speed_)
+    {
+      phase_ = Phase::kHubDepth;
+      return ControlOut(request_type::kDevice, kSetHubDepth, ParentDevice()->Tier(), 0);
+    }
+    return PowerPorts();
+  }
+  case Phase::kHubDepth:
+    return PowerPorts();
+  case Phase::kPoweringPorts:
+    if (--pending_ > 0)
+    {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    phase_ = Phase::kWaitingPowerGood;
+    if (timer_manager->Add(NowNanoseconds() + power_on_delay_ * 2000000ull, 0, OnPowerGood, this).error)
+    {
+      OnPowerGood(NowNanoseconds(), this);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  case Phase::kRunning:
+    break;
+  default:
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  const int port = setup_data.request_type.bits.recipient == request_type::kOther ? setup_data.index : 0;
+  if (port > num_ports_)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  auto &state = ports_[port];
+  if (setup_data.request == request::kGetStatus)
+  {
+    state.status = state.status_buf[0] | state.status_buf[1] << 8;
+    state.change = state.status_buf[2] | state.status_buf[3] << 8;
+    state.change_to_clear = state.change;
+    return ClearNextChange(port);
+  }
+  else if (setup_data.request == request::kClearFeature)
+  {
+    return ClearNextChange(port);
+  }
+  /* SET_FEATURE(PORT_RESET): the end of the reset is a change of its own */
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error HubDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len)
+{
+  const auto bitmap = reinterpret_cast<const uint8_t *>(buf);
+  polling_ = false;
+  for (int port = 0; port <= num_ports_ && port / 8 < len; ++port)
+  {
+    auto &state = ports_[port];
+    if (((bitmap[port / 8] >> (port % 8)) & 1) == 0 || state.busy)
+    {
+      continue;
+    }
+
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = port == 0 ? request_type::kDevice : request_type::kOther;
+    setup_data.request = request::kGetStatus;
+    setup_data.value = 0;
+    setup_data.index = port;
+    setup_data.length = state.status_buf.size();
+
+    state.busy = true;
+    if (auto err = ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data, state.status_buf.data(),
+                                             state.status_buf.size(), this))
+    {
+      state.busy = false;
+      return err;
+    }
+  }
+  return PollStatusChange();
+}
+
+Error HubDriver::ResetPort(int port)
+{
+  if (port < 1 || port > num_ports_)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  return ControlOut(request_type::kOther, request::kSetFeature, kPortReset, port);
+}
+
+Error HubDriver::ControlOut(uint8_t recipient, uint8_t request, uint16_t value, uint16_t index)
+{
+  SetupData setup_data{};
+  setup_data.request_type.bits.direction = request_type::kOut;
+  setup_data.request_type.bits.type = request_type::kClass;
+  setup_data.request_type.bits.recipient = recipient;
+  setup_data.request = request;
+  setup_data.value = value;
+  setup_data.index = index;
+  setup_data.length = 0;
+  return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+}
+
+Error HubDriver::PowerPorts()
+{
+  phase_ = Phase::kPoweringPorts;
+  pending_ = num_ports_;
+  if (num_ports_ == 0)
+  {
+    phase_ = Phase::kRunning;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  for (int port = 1; port <= num_ports_; ++port)
+  {
+    if (auto err = ControlOut(request_type::kOther, request::kSetFeature, kPortPower, port))
+    {
+      return err;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void HubDriver::OnPowerGood(uint64_t now_ns, void *arg)
+{
+  auto hub = reinterpret_cast<HubDriver *>(arg);
+  hub->phase_ = Phase::kRunning;
+  if (auto err = hub->PollStatusChange())
+  {
+    Log(kError, "hub: failed to poll the status change endpoint: %s\n", err.Name());
+  }
+}
+
+Error HubDriver::PollStatusChange()
+{
+  if (polling_ || phase_ != Phase::kRunning)
+  {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  for (const auto &state : ports_)
+  {
+    if (state.busy)
+    {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+  }
+  polling_ = true;
+  return ParentDevice()->InterruptIn(ep_interrupt_in_, change_buf_.data(), (num_ports_ + 8) / 8);
+}
+
+Error HubDriver::ClearNextChange(int port)
+{
+  auto &state = ports_[port];
+  const auto &features = port == 0 ? kHubChangeFeatures : kPortChangeFeatures;
+  while (state.change_to_clear != 0)
+  {
+    const int bit = __builtin_ctz(state.change_to_clear);
+    state.change_to_clear &= ~(1u << bit);
+    if (bit < static_cast<int>(features.size()) && features[bit] >= 0)
+    {
+      return ControlOut(port == 0 ? request_type::kDevice : request_type::kOther, request::kClearFeature,
+                        features[bit], port);
+    }
+  }
+  return OnPortChanged(port);
+}
+
+Error HubDriver::OnPortChanged(int port)
+{
+  auto &state = ports_[port];
+  state.busy = false;
+
+  Error err = MAKE_ERROR(Error::kSuccess);
+  if (port == 0)
+  {
+    Log(kWarn, "hub: hub status 0x%04x, change 0x%04x\n", state.status, state.change);
+  }
+  else if (state.change & kPortConnectionChange)
+  {
+    const bool connected = state.status & kPortConnection;
+    if (connected && !state.attached)
+    {
+      state.attached = true;
+      err = ParentDevice()->AttachHubPort(port);
+    }
+    else if (!connected && state.attached)
+    {
+      state.attached = false;
+      Log(kWarn, "hub: the device on port %d is disconnected\n", port);
+    }
+  }
+  if (port != 0 && !err && (state.change & kPortResetChange) && (state.status & kPortEnable) && state.attached)
+  {
+    err = ParentDevice()->OnHubPortReset(port, PortSpeed(super_speed_, state.status));
+  }
+
+  if (auto poll_err = PollStatusChange())
+  {
+    return poll_err;
+  }
+  return err;
+}
+} // namespace usb
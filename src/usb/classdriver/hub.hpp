@@ -0,0 +1,104 @@
+/**
+ * @file usb/classdriver/hub.hpp
+ *
+ * USB hub class driver (USB 2.0 chapter 11, USB 3.2 chapter 10).
+ *
+ *   - The hub descriptor gives the number of ports and the TT Think Time,
+ *   which the host controller puts in the hub's slot context
+ *   - Every port is powered, then the status change endpoint is polled: a
+ *   bitmap of the ports (bit 0: the hub) with a change to report
+ *   - Each port goes on on its own: GET_STATUS, then the change bits are
+ *   cleared one at a time; a connected device is handed to the host
+ *   controller, which calls ResetPort() once the port may be reset (USB2 hubs:
+ *   one device at address 0 at a time)
+ *   - The status change endpoint is polled again once every port reported is
+ *   cleared, or the same changes are reported again
+ *   - Disconnects are logged only, as on the root hub ports
+ */
+
+#pragma once
+
+#include <array>
+
+#include "usb/classdriver/base.hpp"
+
+namespace usb
+{
+class HubDriver : public ClassDriver
+{
+public:
+  /* A tier of a route string is 4 bits */
+  static const int kMaxPorts = 15;
+
+  HubDriver(Device *dev, int interface_index);
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Error Initialize() override;
+  Error SetEndpoint(const EndpointConfig &config) override;
+  Error OnEndpointsConfigured() override;
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len) override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
+
+  /** @brief Reset downstream `port`; the host controller calls it when the device on it may be addressed */
+  Error ResetPort(int port);
+
+  int NumPorts() const
+  {
+    return num_ports_;
+  }
+
+private:
+  enum class Phase
+  {
+    kNotConfigured,
+    kHubDescriptor,
+    kHubDepth,
+    kPoweringPorts,
+    kWaitingPowerGood,
+    kRunning,
+  };
+
+  /* A port, or the hub itself (ports_[0]) */
+  struct PortState
+  {
+    /* A GET_STATUS or CLEAR_FEATURE of the port is in flight */
+    bool busy;
+    /* Handed to the host controller */
+    bool attached;
+    uint16_t status;
+    /* The changes reported by GET_STATUS, and those not cleared yet */
+    uint16_t change;
+    uint16_t change_to_clear;
+    /* wPortStatus, wPortChange */
+    alignas(4) std::array<uint8_t, 4> status_buf;
+  };
+
+  const int interface_index_;
+  EndpointID ep_interrupt_in_;
+  Phase phase_ = Phase::kNotConfigured;
+  bool super_speed_ = false;
+
+  int num_ports_ = 0;
+  /* bPwrOn2PwrGood, in 2ms */
+  int power_on_delay_ = 0;
+  /* The SET_FEATURE(PORT_POWER) in flight */
+  int pending_ = 0;
+  /* The status change endpoint has a transfer queued */
+  bool polling_ = false;
+
+  alignas(64) std::array<uint8_t, 16> desc_buf_{};
+  alignas(64) std::array<uint8_t, 8> change_buf_{};
+  std::array<PortState, kMaxPorts + 1> ports_{};
+
+  Error ControlOut(uint8_t recipient, uint8_t request, uint16_t value, uint16_t index);
+  Error PowerPorts();
+  Error PollStatusChange();
+  /* Clear the next change bit of `port`, or act on its status once there is none left */
+  Error ClearNextChange(int port);
+  Error OnPortChanged(int port);
+
+  static void OnPowerGood(uint64_t now_ns, void *arg);
+};
+} // namespace usb
@@ -0,0 +1,415 @@
+#include "usb/classdriver/msc.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.hpp"
+#include "timer.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace
+{
+/* SCSI Primary/Block Commands; the multi-byte fields are big endian */
+const uint8_t kInquiry = 0x12;
+const uint8_t kReadCapacity10 = 0x25;
+const uint8_t kRead10 = 0x28;
+const uint8_t kWrite10 = 0x2a;
+
+uint32_t ReadBE32(const uint8_t *p)
+{
+  return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 | static_cast<uint32_t>(p[2]) << 8 |
+         p[3];
+}
+
+void WriteBE32(uint8_t *p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+} // namespace
+
+namespace usb
+{
+MassStorageDriver::MassStorageDriver(Device *dev, int interface_index)
+    : ClassDriver{dev}, interface_index_{interface_index}
+{
+}
+
+void *MassStorageDriver::operator new(size_t size)
+{
+  return AllocMem(sizeof(MassStorageDriver), 64, 0);
+}
+
+void MassStorageDriver::operator delete(void *ptr) noexcept
+{
+  FreeMem(ptr);
+}
+
+Error MassStorageDriver::Initialize()
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error MassStorageDriver::SetEndpoint(const EndpointConfig &config)
+{
+  if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn())
+  {
+    ep_bulk_in_ = config.ep_id;
+  }
+  else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn())
+  {
+    ep_bulk_out_ = config.ep_id;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::OnEndpointsConfigured()
+{
+  Request inquiry{};
+  inquiry.cdb[0] = kInquiry;
+  inquiry.cdb[4] = info_buf_.size();
+  inquiry.cdb_length = 6;
+  inquiry.dir_in = true;
+  inquiry.buf = info_buf_.data();
+  inquiry.len = info_buf_.size();
+  inquiry.callback = OnInfoCommandCompleted;
+
+  phase_ = Phase::kInquiry;
+  return Enqueue(inquiry);
+}
+
+Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len)
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len)
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error MassStorageDriver::OnBulkCompleted(EndpointID ep_id, const void *buf, int len)
+{
+  /* The CBW and the data stage need nothing: the CSW says how the command went */
+  if (buf == &csw_)
+  {
+    return OnCommandStatus(len);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::OnTransferFailed(EndpointID ep_id, int completion_code)
+{
+  /**
+   * A stalled bulk endpoint needs the Reset Recovery (BOT 5.3.4) and a Reset
+   * Endpoint command, which are not implemented: give up the device
+   */
+  Log(kWarn, "usb-storage: transfer failed on ep addr %d, completion code %d\n", ep_id.Address(), completion_code);
+  phase_ = Phase::kFailed;
+  while (num_requests_ > 0)
+  {
+    FinishCommand(MAKE_ERROR(Error::kTransferFailed));
+  }
+  return MAKE_ERROR(Error::kTransferFailed);
+}
+
+Error MassStorageDriver::Read(uint32_t lba, uint16_t num_blocks, void *buf, RequestCallback *callback, void *context)
+{
+  if (!IsReady())
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  Request read{};
+  read.cdb[0] = kRead10;
+  WriteBE32(&read.cdb[2], lba);
+  read.cdb[7] = num_blocks >> 8;
+  read.cdb[8] = num_blocks;
+  read.cdb_length = 10;
+  read.dir_in = true;
+  read.buf = buf;
+  read.len = num_blocks * block_size_;
+  read.callback = callback;
+  read.context = context;
+  return Enqueue(read);
+}
+
+Error MassStorageDriver::Read(uint32_t lba, uint16_t num_blocks, const BufferSegment *segments, int num_segments,
+                              RequestCallback *callback, void *context)
+{
+  uint32_t len = 0;
+  for (int i = 0; i < num_segments; ++i)
+  {
+    len += segments[i].len;
+  }
+  if (num_segments <= 0 || len != num_blocks * block_size_)
+  {
+    return MAKE_ERROR(Error::kBufferTooSmall);
+  }
+  if (!IsReady())
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  Request read{};
+  read.cdb[0] = kRead10;
+  WriteBE32(&read.cdb[2], lba);
+  read.cdb[7] = num_blocks >> 8;
+  read.cdb[8] = num_blocks;
+  read.cdb_length = 10;
+  read.dir_in = true;
+  read.buf = segments[0].buf;
+  read.len = len;
+  read.segments = segments;
+  read.num_segments = num_segments;
+  read.callback = callback;
+  read.context = context;
+  return Enqueue(read);
+}
+
+Error MassStorageDriver::Write(uint32_t lba, uint16_t num_blocks, const void *buf, RequestCallback *callback,
+                               void *context)
+{
+  if (!IsReady())
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  Request write{};
+  write.cdb[0] = kWrite10;
+  WriteBE32(&write.cdb[2], lba);
+  write.cdb[7] = num_blocks >> 8;
+  write.cdb[8] = num_blocks;
+  write.cdb_length = 10;
+  write.dir_in = false;
+  write.buf = const_cast<void *>(buf);
+  write.len = num_blocks * block_size_;
+  write.callback = callback;
+  write.context = context;
+  return Enqueue(write);
+}
+
+Error MassStorageDriver::Enqueue(const Request &request)
+{
+  if (num_requests_ == kMaxRequests)
+  {
+    return MAKE_ERROR(Error::kFull);
+  }
+  requests_[(head_ + num_requests_) % kMaxRequests] = request;
+  ++num_requests_;
+  if (!busy_)
+  {
+    /* Accepted either way: a command that cannot be queued is called back with the error */
+    StartCommand();
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::StartCommand()
+{
+  const Request &request = requests_[head_];
+  cbw_.signature = kCBWSignature;
+  cbw_.tag = next_tag_++;
+  cbw_.data_transfer_length = request.len;
+  cbw_.flags = request.dir_in ? 0x80 : 0;
+  cbw_.lun = 0;
+  cbw_.cb_length = request.cdb_length;
+  memcpy(cbw_.cb, request.cdb.data(), sizeof(cbw_.cb));
+  busy_ = true;
+
+  Device *dev = ParentDevice();
+  Error err = dev->BulkOut(ep_bulk_out_, &cbw_, sizeof(cbw_));
+  if (!err && request.len > 0 && request.segments)
+  {
+    err = request.dir_in ? dev->BulkIn(ep_bulk_in_, request.segments, request.num_segments)
+                         : dev->BulkOut(ep_bulk_out_, request.segments, request.num_segments);
+  }
+  else if (!err && request.len > 0)
+  {
+    err = request.dir_in ? dev->BulkIn(ep_bulk_in_, request.buf, request.len)
+                         : dev->BulkOut(ep_bulk_out_, request.buf, request.len);
+  }
+  if (!err)
+  {
+    err = dev->BulkIn(ep_bulk_in_, &csw_, sizeof(csw_));
+  }
+  if (err)
+  {
+    Log(kError, "usb-storage: cannot queue a command: %s\n", err.Name());
+    FinishCommand(err);
+  }
+  return err;
+}
+
+Error MassStorageDriver::OnCommandStatus(int len)
+{
+  if (!busy_)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  /* 6.3 Valid and Meaningful CSW */
+  if (len != sizeof(csw_) || csw_.signature != kCSWSignature || csw_.tag != cbw_.tag)
+  {
+    Log(kWarn, "usb-storage: invalid CSW (len %d, tag %u for %u)\n", len, csw_.tag, cbw_.tag);
+    FinishCommand(MAKE_ERROR(Error::kTransferFailed));
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+  if (csw_.status != 0)
+  {
+    /* 1: Command Failed (REQUEST SENSE would tell why), 2: Phase Error */
+    Log(kWarn, "usb-storage: command %02x failed, status %u\n", cbw_.cb[0], csw_.status);
+    FinishCommand(MAKE_ERROR(Error::kTransferFailed));
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  FinishCommand(MAKE_ERROR(Error::kSuccess));
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void MassStorageDriver::FinishCommand(Error err)
+{
+  const Request request = requests_[head_];
+  head_ = (head_ + 1) % kMaxRequests;
+  --num_requests_;
+  busy_ = false;
+
+  if (request.callback)
+  {
+    /* May queue more requests, and start the next command */
+    request.callback(this, request.context, err);
+  }
+  if (!busy_ && num_requests_ > 0 && phase_ != Phase::kFailed)
+  {
+    StartCommand();
+  }
+}
+
+void MassStorageDriver::OnInfoCommandCompleted(MassStorageDriver *driver, void *context, Error err)
+{
+  if (err)
+  {
+    Log(kWarn, "usb-storage: initialization failed: %s\n", err.Name());
+    driver->phase_ = Phase::kFailed;
+    return;
+  }
+
+  const uint8_t *info = driver->info_buf_.data();
+  if (driver->phase_ == Phase::kInquiry)
+  {
+    /* Vendor (8 - 15) and product (16 - 31) identification */
+    Log(kInfo, "usb-storage: %.8s %.16s\n", &info[8], &info[16]);
+
+    Request read_capacity{};
+    read_capacity.cdb[0] = kReadCapacity10;
+    read_capacity.cdb_length = 10;
+    read_capacity.dir_in = true;
+    read_capacity.buf = driver->info_buf_.data();
+    read_capacity.len = 8;
+    read_capacity.callback = OnInfoCommandCompleted;
+
+    driver->phase_ = Phase::kReadCapacity;
+    driver->Enqueue(read_capacity);
+  }
+  else if (driver->phase_ == Phase::kReadCapacity)
+  {
+    /* The last LBA and the block length */
+    driver->num_blocks_ = static_cast<uint64_t>(ReadBE32(&info[0])) + 1;
+    driver->block_size_ = ReadBE32(&info[4]);
+    driver->phase_ = Phase::kReady;
+    Log(kInfo, "usb-storage: %lu blocks of %u bytes\n", driver->num_blocks_, driver->block_size_);
+    for (int i = 0; i < driver->num_observers_; ++i)
+    {
+      driver->observers_[i](driver);
+    }
+  }
+}
+
+Error MassStorageDriver::StartReadBenchmark(uint64_t bytes)
+{
+  if (!IsReady() || bench_.buf != nullptr || block_size_ == 0)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  /* The reads overwrite one buffer: only the transfers are measured */
+  bench_.buf = reinterpret_cast<uint8_t *>(AllocMem(kBenchmarkChunkBytes, 64, kBenchmarkChunkBytes));
+  if (bench_.buf == nullptr)
+  {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  bench_.chunk_blocks = std::max<uint32_t>(kBenchmarkChunkBytes / block_size_, 1);
+  bench_.total_blocks = std::min<uint64_t>(bytes / block_size_, num_blocks_);
+  bench_.next_lba = 0;
+  bench_.done_blocks = 0;
+  bench_.in_flight = 0;
+  bench_.failed = false;
+  bench_.start_ns = NowNanoseconds();
+  if (auto err = QueueBenchmarkReads(); err && bench_.in_flight == 0)
+  {
+    FreeMem(bench_.buf);
+    bench_.buf = nullptr;
+    return err;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error MassStorageDriver::QueueBenchmarkReads()
+{
+  while (num_requests_ < kMaxRequests && bench_.next_lba < bench_.total_blocks)
+  {
+    const uint64_t blocks = std::min<uint64_t>(bench_.chunk_blocks, bench_.total_blocks - bench_.next_lba);
+    /* Counted first: the request may be called back (failed) at once */
+    ++bench_.in_flight;
+    if (auto err = Read(bench_.next_lba, blocks, bench_.buf, OnBenchmarkRead, reinterpret_cast<void *>(blocks)))
+    {
+      --bench_.in_flight;
+      return err;
+    }
+    bench_.next_lba += blocks;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void MassStorageDriver::OnBenchmarkRead(MassStorageDriver *driver, void *context, Error err)
+{
+  Benchmark &bench = driver->bench_;
+  --bench.in_flight;
+  if (err)
+  {
+    bench.failed = true;
+  }
+  else
+  {
+    bench.done_blocks += reinterpret_cast<uintptr_t>(context);
+    if (!bench.failed && bench.done_blocks < bench.total_blocks)
+    {
+      driver->QueueBenchmarkReads();
+    }
+  }
+  /* The buffer may be freed only once no read targets it */
+  if (bench.in_flight > 0)
+  {
+    return;
+  }
+  if (bench.failed)
+  {
+    Log(kWarn, "usb-storage: benchmark stopped after %lu blocks\n", bench.done_blocks);
+  }
+  else
+  {
+    const uint64_t bytes = bench.done_blocks * driver->block_size_;
+    const uint64_t elapsed_ns = std::max<uint64_t>(NowNanoseconds() - bench.start_ns, 1);
+    /* bytes/ns x 1000 = MB/s; in 1/100 */
+    const uint64_t rate = bytes * 100000 / elapsed_ns;
+    Log(kInfo, "usb-storage: read %lu KiB in %lu us: %lu.%02lu MB/s\n", bytes / 1024, elapsed_ns / 1000, rate / 100,
+        rate % 100);
+  }
+  FreeMem(bench.buf);
+  bench.buf = nullptr;
+}
+
+void MassStorageDriver::SubscribeReady(std::function<ObserverType> observer)
+{
+  observers_[num_observers_++] = observer;
+}
+
+std::function<MassStorageDriver::ObserverType> MassStorageDriver::default_observer;
+} // namespace usb
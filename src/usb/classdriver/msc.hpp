@@ -0,0 +1,178 @@
+/**
+ * @file usb/classdriver/msc.hpp
+ *
+ * USB Mass Storage class driver: Bulk-Only Transport (BOT), SCSI transparent
+ * command set.
+ *
+ *   - A command is a CBW on the bulk OUT endpoint, an optional data stage, and
+ *   a CSW on the bulk IN endpoint; BOT allows one command at a time
+ *   - The three stages of a command are queued on the rings at once, and the
+ *   next request is started from the CSW completion: the device is kept busy
+ *   without a round trip through the caller
+ *   - Requests (READ(10)/WRITE(10)) are queued, up to kMaxRequests
+ */
+
+#pragma once
+
+#include <array>
+#include <functional>
+
+#include "usb/classdriver/base.hpp"
+#include "usb/device.hpp"
+
+namespace usb
+{
+class MassStorageDriver : public ClassDriver
+{
+public:
+  static const size_t kMaxRequests = 8;
+
+  /** @brief A request is finished: `err` is kSuccess, or kTransferFailed (the transfer or the SCSI status) */
+  using RequestCallback = void(MassStorageDriver *driver, void *context, Error err);
+
+  MassStorageDriver(Device *dev, int interface_index);
+
+  void *operator new(size_t size);
+  void operator delete(void *ptr) noexcept;
+
+  Error Initialize() override;
+  Error SetEndpoint(const EndpointConfig &config) override;
+  Error OnEndpointsConfigured() override;
+  Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len) override;
+  Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len) override;
+  Error OnTransferFailed(EndpointID ep_id, int completion_code) override;
+
+  /** @brief Queue a read of `num_blocks` blocks from `lba` into `buf` */
+  Error Read(uint32_t lba, uint16_t num_blocks, void *buf, RequestCallback *callback, void *context);
+  /**
+   * @brief Queue a read of `num_blocks` blocks from `lba` straight into the
+   * `num_segments` buffers of `segments`, which must stay valid until the
+   * callback; their lengths must add up to the blocks
+   */
+  Error Read(uint32_t lba, uint16_t num_blocks, const BufferSegment *segments, int num_segments,
+             RequestCallback *callback, void *context);
+  /** @brief Queue a write of `num_blocks` blocks from `buf` to `lba` */
+  Error Write(uint32_t lba, uint16_t num_blocks, const void *buf, RequestCallback *callback, void *context);
+
+  bool IsReady() const
+  {
+    return phase_ == Phase::kReady;
+  }
+  uint64_t NumBlocks() const
+  {
+    return num_blocks_;
+  }
+  uint32_t BlockSize() const
+  {
+    return block_size_;
+  }
+
+  /**
+   * @brief Read `bytes` from the start of the medium, kMaxRequests chunks
+   * queued at a time, and log the throughput in MB/s
+   */
+  Error StartReadBenchmark(uint64_t bytes);
+
+  /** @brief Called once the device has answered READ CAPACITY */
+  using ObserverType = void(MassStorageDriver *driver);
+  void SubscribeReady(std::function<ObserverType> observer);
+  static std::function<ObserverType> default_observer;
+
+private:
+  /* USB Mass Storage Class, Bulk-Only Transport 5.1 */
+  struct CommandBlockWrapper
+  {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags;
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((packed));
+
+  /* 5.2 */
+  struct CommandStatusWrapper
+  {
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status;
+  } __attribute__((packed));
+
+  struct Request
+  {
+    std::array<uint8_t, 16> cdb;
+    uint8_t cdb_length;
+    bool dir_in;
+    void *buf;
+    uint32_t len;
+    /* A scatter-gather data stage instead of `buf`, if not nullptr */
+    const BufferSegment *segments;
+    int num_segments;
+    RequestCallback *callback;
+    void *context;
+  };
+
+  enum class Phase
+  {
+    kNotConfigured,
+    kInquiry,
+    kReadCapacity,
+    kReady,
+    kFailed,
+  };
+
+  struct Benchmark
+  {
+    uint8_t *buf;
+    uint32_t chunk_blocks;
+    uint64_t total_blocks;
+    uint64_t next_lba;
+    uint64_t done_blocks;
+    /* Reads queued and not called back yet */
+    size_t in_flight;
+    bool failed;
+    uint64_t start_ns;
+  };
+
+  static const uint32_t kCBWSignature = 0x43425355; // "USBC"
+  static const uint32_t kCSWSignature = 0x53425355; // "USBS"
+  static const uint32_t kBenchmarkChunkBytes = 64 * 1024;
+
+  const int interface_index_;
+  EndpointID ep_bulk_in_;
+  EndpointID ep_bulk_out_;
+  Phase phase_ = Phase::kNotConfigured;
+
+  /* The DMA buffers of the command in progress */
+  alignas(64) CommandBlockWrapper cbw_{};
+  alignas(64) CommandStatusWrapper csw_{};
+  alignas(64) std::array<uint8_t, 36> info_buf_{};
+  uint32_t next_tag_ = 1;
+
+  /* requests_[head_] is in progress while busy_ */
+  std::array<Request, kMaxRequests> requests_{};
+  size_t head_ = 0;
+  size_t num_requests_ = 0;
+  bool busy_ = false;
+
+  uint64_t num_blocks_ = 0;
+  uint32_t block_size_ = 0;
+  Benchmark bench_{};
+
+  std::array<std::function<ObserverType>, 4> observers_;
+  int num_observers_ = 0;
+
+  Error Enqueue(const Request &request);
+  /* Queue the CBW, the data stage and the CSW of the head request */
+  Error StartCommand();
+  Error OnCommandStatus(int len);
+  void FinishCommand(Error err);
+
+  static void OnInfoCommandCompleted(MassStorageDriver *driver, void *context, Error err);
+  static void OnBenchmarkRead(MassStorageDriver *driver, void *context, Error err);
+  Error QueueBenchmarkReads();
+};
+} // namespace usb
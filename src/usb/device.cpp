@@ -1,7 +1,9 @@
 #include "usb/device.hpp"
 
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/classdriver/keyboard.hpp"
+#include "usb/classdriver/msc.hpp"
 #include "usb/classdriver/mouse.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/setupdata.hpp"
@@ -79,6 +81,19 @@ usb::ClassDriver *NewClassDriver(usb::Device *dev, const usb::InterfaceDescripto
       return mouse_driver;
     }
   }
+  else if (if_desc.interface_class == 9)
+  { // Hub
+    return new usb::HubDriver{dev, if_desc.interface_number};
+  }
+  else if (if_desc.interface_class == 8 && if_desc.interface_sub_class == 6 && if_desc.interface_protocol == 0x50)
+  { // Mass Storage, SCSI transparent command set, Bulk-Only Transport
+    auto storage_driver = new usb::MassStorageDriver{dev, if_desc.interface_number};
+    if (usb::MassStorageDriver::default_observer)
+    {
+      storage_driver->SubscribeReady(usb::MassStorageDriver::default_observer);
+    }
+    return storage_driver;
+  }
   return nullptr;
 }
 
@@ -112,22 +127,39 @@ namespace usb
 {
 Device::~Device()
 {
+  /* A driver may serve several endpoints: delete each once */
+  for (size_t i = 0; i < class_drivers_.size(); ++i)
+  {
+    ClassDriver *driver = class_drivers_[i];
+    if (driver == nullptr)
+    {
+      continue;
+    }
+    for (size_t j = i; j < class_drivers_.size(); ++j)
+    {
+      if (class_drivers_[j] == driver)
+      {
+        class_drivers_[j] = nullptr;
+      }
+    }
+    delete driver;
+  }
 }
 
 Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len, ClassDriver *issuer)
 {
-  if (issuer)
+  if (issuer && !event_waiters_.Put(setup_data, issuer))
   {
-    event_waiters_.Put(setup_data, issuer);
+    return MAKE_ERROR(Error::kFull);
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf, int len, ClassDriver *issuer)
 {
-  if (issuer)
+  if (issuer && !event_waiters_.Put(setup_data, issuer))
   {
-    event_waiters_.Put(setup_data, issuer);
+    return MAKE_ERROR(Error::kFull);
   }
   return MAKE_ERROR(Error::kSuccess);
 }
@@ -142,6 +174,52 @@ Error Device::InterruptOut(EndpointID ep_id, void *buf, int len)
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error Device::BulkIn(EndpointID ep_id, void *buf, int len)
+{
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const void *buf, int len)
+{
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::BulkIn(EndpointID ep_id, const BufferSegment *segments, int num_segments)
+{
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const BufferSegment *segments, int num_segments)
+{
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+int Device::Speed() const
+{
+  return 0;
+}
+
+int Device::Tier() const
+{
+  return 0;
+}
+
+Error Device::ConfigureHub(HubDriver *hub, int num_ports, int think_time, bool multi_tt)
+{
+  hub_ = hub;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::AttachHubPort(int port)
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
+Error Device::OnHubPortReset(int port, int speed)
+{
+  return MAKE_ERROR(Error::kNotImplemented);
+}
+
 Error Device::StartInitialize()
 {
   is_initialized_ = false;
@@ -172,6 +250,8 @@ Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const v
   {
     if (auto w = event_waiters_.Get(setup_data))
     {
+      /* Several requests may be in flight (e.g. a hub's ports): one entry each */
+      event_waiters_.Delete(setup_data);
       return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
     }
     return MAKE_ERROR(Error::kNoWaiter);
@@ -216,6 +296,25 @@ Error Device::OnInterruptCompleted(EndpointID ep_id, const void *buf, int len)
   return MAKE_ERROR(Error::kNoWaiter);
 }
 
+Error Device::OnBulkCompleted(EndpointID ep_id, const void *buf, int len)
+{
+  Log(kDebug, "Device::OnBulkCompleted: ep addr %d, len %d\n", ep_id.Address(), len);
+  if (auto w = class_drivers_[ep_id.Number()])
+  {
+    return w->OnBulkCompleted(ep_id, buf, len);
+  }
+  return MAKE_ERROR(Error::kNoWaiter);
+}
+
+Error Device::OnTransferFailed(EndpointID ep_id, int completion_code)
+{
+  if (auto w = class_drivers_[ep_id.Number()])
+  {
+    return w->OnTransferFailed(ep_id, completion_code);
+  }
+  return MAKE_ERROR(Error::kTransferFailed);
+}
+
 Error Device::InitializePhase1(const uint8_t *buf, int len)
 {
   const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
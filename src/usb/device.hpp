@@ -9,13 +9,21 @@
 #include <array>
 
 #include "error.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/hashmap.hpp"
 #include "usb/endpoint.hpp"
 #include "usb/setupdata.hpp"
 
 namespace usb
 {
 class ClassDriver;
+class HubDriver;
+
+/** @brief A piece of a scatter-gather buffer (memory is identity mapped: `buf` is also its DMA address) */
+struct BufferSegment
+{
+  void *buf;
+  int len;
+};
 
 class Device
 {
@@ -25,6 +33,11 @@ public:
   virtual Error ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf, int len, ClassDriver *issuer);
   virtual Error InterruptIn(EndpointID ep_id, void *buf, int len);
   virtual Error InterruptOut(EndpointID ep_id, void *buf, int len);
+  virtual Error BulkIn(EndpointID ep_id, void *buf, int len);
+  virtual Error BulkOut(EndpointID ep_id, const void *buf, int len);
+  /** @brief One transfer over `num_segments` buffers, in order; completed once, with segments[0].buf */
+  virtual Error BulkIn(EndpointID ep_id, const BufferSegment *segments, int num_segments);
+  virtual Error BulkOut(EndpointID ep_id, const BufferSegment *segments, int num_segments);
 
   Error StartInitialize();
   bool IsInitialized()
@@ -41,6 +54,28 @@ public:
   }
   Error OnEndpointsConfigured();
 
+  /** @brief The speed of the device, a Protocol Speed ID (usb/xhci/speed.hpp); 0 if unknown */
+  virtual int Speed() const;
+  /** @brief The hubs between the device and the root hub */
+  virtual int Tier() const;
+
+  /**
+   * Hubs: the hub driver tells the host controller about the hub and its
+   * downstream ports through these; the host controller enumerates the
+   * devices behind them, and calls back Hub()->ResetPort()
+   */
+  /** @brief The device is a hub served by `hub`, with `num_ports` ports; `think_time`: TT Think Time (0-3) */
+  virtual Error ConfigureHub(HubDriver *hub, int num_ports, int think_time, bool multi_tt);
+  /** @brief A device is connected to downstream `port`: enumerate it */
+  virtual Error AttachHubPort(int port);
+  /** @brief Downstream `port` is reset and enabled; its device runs at `speed` */
+  virtual Error OnHubPortReset(int port, int speed);
+  /** @brief The driver of the hub, if the device is one */
+  HubDriver *Hub() const
+  {
+    return hub_;
+  }
+
   uint8_t *Buffer()
   {
     return buf_.data();
@@ -49,6 +84,8 @@ public:
 protected:
   Error OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void *buf, int len);
   Error OnInterruptCompleted(EndpointID ep_id, const void *buf, int len);
+  Error OnBulkCompleted(EndpointID ep_id, const void *buf, int len);
+  Error OnTransferFailed(EndpointID ep_id, int completion_code);
 
 private:
   /** @brief エンドポイントに割り当て済みのクラスドライバ．
@@ -57,6 +94,7 @@ private:
    * 添字 0 はどのクラスドライバからも使われないため，常に未使用．
    */
   std::array<ClassDriver *, 16> class_drivers_{};
+  HubDriver *hub_ = nullptr;
 
   std::array<uint8_t, 256> buf_{};
 
@@ -80,7 +118,7 @@ private:
   /** OnControlCompleted の中で要求の発行元を特定するためのマップ構造．
    * ControlOut または ControlIn を発行したときに発行元が登録される．
    */
-  ArrayMap<SetupData, ClassDriver *, 4> event_waiters_{};
+  HashMap<SetupData, ClassDriver *, 32> event_waiters_{};
 };
 
 Error GetDescriptor(Device &dev, EndpointID ep_id, uint8_t desc_type, uint8_t desc_index, void *buf, int len,
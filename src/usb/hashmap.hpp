@@ -0,0 +1,134 @@
+/**
+ * @file usb/hashmap.hpp
+ *
+ * A fixed-capacity map with open addressing (linear probing), for keys looked
+ * up on every event (e.g. the SetupData of a control completion).
+ *
+ *   - N slots, a power of 2: no allocation; keep it about twice the entries,
+ *   probes get long as the table fills
+ *   - Delete() shifts the following entries of the run back into the hole
+ *   (no tombstones): a lookup stops at the first empty slot, however many
+ *   Put() and Delete() have been done
+ *   - Keys are hashed by their bytes: equal keys must have equal bytes (no
+ *   padding), which holds for integers, pointers and SetupData
+ */
+
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <optional>
+#include <stdint.h>
+#include <type_traits>
+
+namespace usb
+{
+template <class K> struct Hash
+{
+  static_assert(std::is_trivially_copyable_v<K> && sizeof(K) <= sizeof(uint64_t), "hash the key yourself");
+
+  uint64_t operator()(const K &key) const
+  {
+    uint64_t bits = 0;
+    memcpy(&bits, &key, sizeof(K));
+    /* Fibonacci hashing: the high bits are mixed from every bit of the key */
+    return bits * 0x9e3779b97f4a7c15ull;
+  }
+};
+
+template <class K, class V, size_t N = 32, class HashFn = Hash<K>> class HashMap
+{
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+  std::optional<V> Get(const K &key) const
+  {
+    if (auto i = Find(key); i < N)
+    {
+      return table_[i].value;
+    }
+    return std::nullopt;
+  }
+
+  /** @brief Add `key`, or replace its value; false if the table is full */
+  bool Put(const K &key, const V &value)
+  {
+    size_t i = Home(key);
+    for (size_t probes = 0; probes < N; ++probes, i = (i + 1) & kMask)
+    {
+      if (!table_[i].used)
+      {
+        table_[i] = Entry{true, key, value};
+        ++size_;
+        return true;
+      }
+      if (table_[i].key == key)
+      {
+        table_[i].value = value;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Delete(const K &key)
+  {
+    size_t hole = Find(key);
+    if (hole == N)
+    {
+      return;
+    }
+    /* Move back each later entry of the run that may live at the hole: its home is not in (hole, i] */
+    size_t i = (hole + 1) & kMask;
+    for (size_t probes = 1; probes < N && table_[i].used; ++probes, i = (i + 1) & kMask)
+    {
+      const size_t home = Home(table_[i].key);
+      if (((i - home) & kMask) >= ((i - hole) & kMask))
+      {
+        table_[hole] = table_[i];
+        hole = i;
+      }
+    }
+    table_[hole].used = false;
+    --size_;
+  }
+
+  size_t Size() const
+  {
+    return size_;
+  }
+
+private:
+  static const size_t kMask = N - 1;
+
+  struct Entry
+  {
+    bool used;
+    K key;
+    V value;
+  };
+
+  std::array<Entry, N> table_{};
+  size_t size_ = 0;
+
+  size_t Home(const K &key) const
+  {
+    /* The high bits of the hash: log2(N) of them */
+    return HashFn{}(key) >> (64 - __builtin_ctzll(N));
+  }
+
+  /* The slot of `key`; N if absent */
+  size_t Find(const K &key) const
+  {
+    size_t i = Home(key);
+    for (size_t probes = 0; probes < N && table_[i].used; ++probes, i = (i + 1) & kMask)
+    {
+      if (table_[i].key == key)
+      {
+        return i;
+      }
+    }
+    return N;
+  }
+};
+} // namespace usb
@@ -0,0 +1,186 @@
+/**
+ * @file usb/hashmap_test.cpp
+ *
+ * Host test and benchmark of usb::HashMap: make hosttest64
+ *
+ *   - Random Put()/Delete()/Get() on a small key space, so that runs wrap
+ *   around the table and get shifted back by Delete(), checked against
+ *   std::map after every call
+ *   - Get + Delete + Put of a SetupData key per op (what a control completion
+ *   and the next request do), against the ArrayMap it replaced, at 16 and
+ *   256 entries; timings are printed, not checked
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "usb/hashmap.hpp"
+#include "usb/setupdata.hpp"
+
+namespace
+{
+const int kCheckIterations = 2000000;
+const int kBenchIterations = 2000000;
+
+/* The removed usb::ArrayMap, kept here as the baseline of the benchmark */
+template <class K, class V, size_t N> class ArrayMap
+{
+public:
+  std::optional<V> Get(const K &key) const
+  {
+    for (uint64_t i = 0; i < table_.size(); ++i)
+    {
+      if (auto opt_k = table_[i].first; opt_k && opt_k.value() == key)
+      {
+        return table_[i].second;
+      }
+    }
+    return std::nullopt;
+  }
+
+  bool Put(const K &key, const V &value)
+  {
+    for (uint64_t i = 0; i < table_.size(); ++i)
+    {
+      if (!table_[i].first)
+      {
+        table_[i].first = key;
+        table_[i].second = value;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Delete(const K &key)
+  {
+    for (uint64_t i = 0; i < table_.size(); ++i)
+    {
+      if (auto opt_k = table_[i].first; opt_k && opt_k.value() == key)
+      {
+        table_[i].first = std::nullopt;
+        break;
+      }
+    }
+  }
+
+private:
+  std::array<std::pair<std::optional<K>, V>, N> table_{};
+};
+
+int failures = 0;
+
+void Fail(const char *what, int iteration, uint32_t key)
+{
+  if (++failures <= 10)
+  {
+    fprintf(stderr, "FAIL: %s: call %d, key %u\n", what, iteration, key);
+  }
+}
+
+void CheckAgainstStdMap()
+{
+  std::mt19937 rng{1};
+  usb::HashMap<uint32_t, uint32_t, 64> map;
+  std::map<uint32_t, uint32_t> expected;
+  for (int i = 0; i < kCheckIterations; ++i)
+  {
+    /* 100 keys for 64 slots: the table fills up now and then */
+    const uint32_t key = rng() % 100;
+    const uint32_t value = rng();
+    switch (rng() % 3)
+    {
+    case 0:
+      if (map.Put(key, value))
+      {
+        expected[key] = value;
+      }
+      else if (expected.size() < 64 || expected.count(key) != 0)
+      {
+        Fail("Put() failed with room left", i, key);
+      }
+      break;
+    case 1:
+      map.Delete(key);
+      expected.erase(key);
+      break;
+    }
+
+    const auto value_got = map.Get(key);
+    const auto it = expected.find(key);
+    if (value_got.has_value() != (it != expected.end()) || (value_got && *value_got != it->second))
+    {
+      Fail("Get() differs from std::map", i, key);
+    }
+    if (map.Size() != expected.size())
+    {
+      Fail("Size() differs from std::map", i, key);
+    }
+  }
+  printf("usb/hashmap: %d random Put()/Delete()/Get() calls against std::map: %s\n", kCheckIterations,
+         failures == 0 ? "ok" : "FAILED");
+}
+
+usb::SetupData MakeSetupData(uint16_t index)
+{
+  usb::SetupData setup_data{};
+  setup_data.request_type.bits.direction = usb::request_type::kIn;
+  setup_data.request_type.bits.type = usb::request_type::kClass;
+  setup_data.request_type.bits.recipient = usb::request_type::kOther;
+  setup_data.request = usb::request::kGetStatus;
+  setup_data.index = index;
+  setup_data.length = 4;
+  return setup_data;
+}
+
+/* Nanoseconds per op, `entries` keys in `map` */
+template <class Map> double Bench(Map &map, int entries)
+{
+  std::vector<usb::SetupData> keys;
+  for (int i = 0; i < entries; ++i)
+  {
+    keys.push_back(MakeSetupData(i * 7 + 1));
+    map.Put(keys.back(), &keys.back());
+  }
+  std::mt19937 rng{2};
+  std::vector<int> order(kBenchIterations);
+  for (auto &i : order)
+  {
+    i = rng() % entries;
+  }
+
+  volatile uintptr_t sink = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i : order)
+  {
+    const auto waiter = map.Get(keys[i]);
+    sink = sink + reinterpret_cast<uintptr_t>(*waiter);
+    map.Delete(keys[i]);
+    map.Put(keys[i], *waiter);
+  }
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / kBenchIterations;
+}
+
+template <class Map> void PrintBench(const char *name, int entries)
+{
+  static Map map;
+  printf("usb/hashmap: %3d entries in %-24s %6.1f ns/op\n", entries, name, Bench(map, entries));
+}
+} // namespace
+
+int main()
+{
+  CheckAgainstStdMap();
+
+  using Waiter = const usb::SetupData *;
+  PrintBench<ArrayMap<usb::SetupData, Waiter, 16>>("ArrayMap<16>", 16);
+  PrintBench<usb::HashMap<usb::SetupData, Waiter, 32>>("HashMap<32>", 16);
+  PrintBench<usb::HashMap<usb::SetupData, Waiter, 16>>("HashMap<16> (full)", 16);
+  PrintBench<ArrayMap<usb::SetupData, Waiter, 256>>("ArrayMap<256>", 256);
+  PrintBench<usb::HashMap<usb::SetupData, Waiter, 512>>("HashMap<512>", 256);
+  return failures == 0 ? 0 : 1;
+}
@@ -1,6 +1,10 @@
 #include "usb/memory.hpp"
 
+#include <array>
 #include <cstdint>
+#include <cstring>
+
+#include "memory_manager.hpp"
 
 namespace
 {
@@ -9,46 +13,246 @@ template <class T> T Ceil(T value, unsigned int alignment)
   return (value + alignment - 1) & ~static_cast<T>(alignment - 1);
 }
 
-template <class T, class U> T MaskBits(T value, U mask)
+/* The smallest power of 2 >= value */
+size_t CeilPow2(size_t value)
+{
+  size_t pow2 = 1;
+  while (pow2 < value)
+  {
+    pow2 <<= 1;
+  }
+  return pow2;
+}
+
+/**
+ * Size classes: 64 B, 128 B, ... 2 KiB, carved from whole frames
+ *   - A block is aligned to its size, so it never crosses a power-of-2
+ *   boundary >= its size: the class of (size, alignment, boundary) is
+ *   max(CeilPow2(size), alignment, 64)
+ *   - Larger requests take contiguous frames of their own
+ */
+const size_t kMinBlockShift = 6;
+const size_t kNumSizeClasses = 6;
+const size_t kMaxBlockSize = size_t{1} << (kMinBlockShift + kNumSizeClasses - 1);
+
+struct FreeBlock
+{
+  FreeBlock *next;
+};
+
+std::array<FreeBlock *, kNumSizeClasses> free_lists{};
+
+/**
+ * Each frame range taken from the memory_manager, sorted by `base` for
+ * FreeMem(); a slab (carved into blocks of one class) is kept for reuse, a
+ * large allocation is returned on free
+ */
+struct Chunk
+{
+  uintptr_t base;
+  size_t frames;
+  /* kLargeChunk: one allocation of `frames` */
+  uint8_t size_class;
+};
+const uint8_t kLargeChunk = 0xff;
+const size_t kMaxChunks = 1024;
+
+std::array<Chunk, kMaxChunks> chunks;
+size_t num_chunks = 0;
+usb::MemoryStats stats{};
+
+/* The first chunk whose base is > addr */
+size_t UpperBound(uintptr_t addr)
+{
+  size_t lo = 0, hi = num_chunks;
+  while (lo < hi)
+  {
+    const size_t mid = (lo + hi) / 2;
+    if (chunks[mid].base <= addr)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* The chunk `p` is in; nullptr if not from the pool */
+Chunk *FindChunk(const void *p)
+{
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+  const size_t i = UpperBound(addr);
+  if (i == 0)
+  {
+    return nullptr;
+  }
+  Chunk &chunk = chunks[i - 1];
+  return addr < chunk.base + chunk.frames * kBytesPerFrame ? &chunk : nullptr;
+}
+
+bool AddChunk(uintptr_t base, size_t frames, uint8_t size_class)
+{
+  if (num_chunks == kMaxChunks)
+  {
+    return false;
+  }
+  const size_t i = UpperBound(base);
+  for (size_t j = num_chunks; j > i; --j)
+  {
+    chunks[j] = chunks[j - 1];
+  }
+  chunks[i] = Chunk{base, frames, size_class};
+  ++num_chunks;
+  return true;
+}
+
+void RemoveChunk(Chunk *chunk)
 {
-  return value & ~static_cast<T>(mask - 1);
+  for (size_t j = chunk - chunks.data(); j + 1 < num_chunks; ++j)
+  {
+    chunks[j] = chunks[j + 1];
+  }
+  --num_chunks;
+}
+
+/* Contiguous frames, the first one aligned to `alignment` (a power of 2) */
+void *AllocFrames(size_t frames, size_t alignment)
+{
+  const size_t align_frames = alignment > kBytesPerFrame ? alignment / kBytesPerFrame : 1;
+  /* Over-allocate by the alignment, then give the head and the tail back */
+  const auto range = memory_manager->Allocate(frames + align_frames - 1);
+  if (range.error)
+  {
+    return nullptr;
+  }
+  const size_t first = Ceil(range.value.ID(), align_frames);
+  if (first > range.value.ID())
+  {
+    memory_manager->Free(range.value, first - range.value.ID());
+  }
+  const size_t tail = range.value.ID() + frames + align_frames - 1 - (first + frames);
+  if (tail > 0)
+  {
+    memory_manager->Free(FrameID{first + frames}, tail);
+  }
+  stats.frames += frames;
+  return FrameID{first}.Frame();
+}
+
+void FreeFrames(void *p, size_t frames)
+{
+  memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(p) / kBytesPerFrame}, frames);
+  stats.frames -= frames;
+}
+
+/* Carve a new frame into blocks of `size_class` */
+bool RefillSizeClass(size_t size_class)
+{
+  auto frame = reinterpret_cast<uint8_t *>(AllocFrames(1, kBytesPerFrame));
+  if (frame == nullptr)
+  {
+    return false;
+  }
+  if (!AddChunk(reinterpret_cast<uintptr_t>(frame), 1, size_class))
+  {
+    FreeFrames(frame, 1);
+    return false;
+  }
+  const size_t block_size = size_t{1} << (kMinBlockShift + size_class);
+  for (size_t offset = kBytesPerFrame; offset > 0; offset -= block_size)
+  {
+    auto block = reinterpret_cast<FreeBlock *>(frame + offset - block_size);
+    block->next = free_lists[size_class];
+    free_lists[size_class] = block;
+  }
+  return true;
 }
 } // namespace
 
 namespace usb
 {
-alignas(64) uint8_t memory_pool[kMemoryPoolSize];
-uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
-
 void *AllocMem(size_t size, unsigned int alignment, unsigned int boundary)
 {
-  if (alignment > 0)
+  if (size == 0)
   {
-    alloc_ptr = Ceil(alloc_ptr, alignment);
+    size = 1;
   }
-  if (boundary > 0)
+  size_t block_size = CeilPow2(size);
+  if (block_size < alignment)
   {
-    auto next_boundary = Ceil(alloc_ptr, boundary);
-    if (next_boundary < alloc_ptr + size)
+    block_size = alignment;
+  }
+
+  void *p = nullptr;
+  if (block_size <= kMaxBlockSize)
+  {
+    size_t size_class = 0;
+    while ((size_t{1} << (kMinBlockShift + size_class)) < block_size)
+    {
+      ++size_class;
+    }
+    if (free_lists[size_class] == nullptr && !RefillSizeClass(size_class))
     {
-      alloc_ptr = next_boundary;
+      return nullptr;
     }
+    FreeBlock *block = free_lists[size_class];
+    free_lists[size_class] = block->next;
+    p = block;
+    stats.bytes_in_use += size_t{1} << (kMinBlockShift + size_class);
   }
-
-  if (reinterpret_cast<uintptr_t>(memory_pool) + kMemoryPoolSize < alloc_ptr + size)
+  else
   {
-    return nullptr;
+    const size_t frames = (size + kBytesPerFrame - 1) / kBytesPerFrame;
+    /* Aligned to its own (power of 2) size, it cannot cross `boundary` if size <= boundary */
+    const size_t frame_alignment = boundary > 0 && size <= boundary ? block_size : alignment;
+    p = AllocFrames(frames, frame_alignment);
+    if (p == nullptr)
+    {
+      return nullptr;
+    }
+    if (!AddChunk(reinterpret_cast<uintptr_t>(p), frames, kLargeChunk))
+    {
+      FreeFrames(p, frames);
+      return nullptr;
+    }
+    stats.bytes_in_use += frames * kBytesPerFrame;
   }
-
-  auto p = alloc_ptr;
-  alloc_ptr += size;
-  return reinterpret_cast<void *>(p);
+  ++stats.allocations;
+  /* The xHC reads contexts and rings as they are: no stale data from a previous user */
+  memset(p, 0, size);
+  return p;
 }
 
-/**
- * TODO implementation (May be hard to manage unless boundary == alignment in AllocMem)
- */
 void FreeMem(void *p)
 {
+  if (p == nullptr)
+  {
+    return;
+  }
+  Chunk *chunk = FindChunk(p);
+  if (chunk == nullptr)
+  {
+    return;
+  }
+  ++stats.frees;
+  if (chunk->size_class == kLargeChunk)
+  {
+    stats.bytes_in_use -= chunk->frames * kBytesPerFrame;
+    FreeFrames(reinterpret_cast<void *>(chunk->base), chunk->frames);
+    RemoveChunk(chunk);
+    return;
+  }
+  auto block = reinterpret_cast<FreeBlock *>(p);
+  block->next = free_lists[chunk->size_class];
+  free_lists[chunk->size_class] = block;
+  stats.bytes_in_use -= size_t{1} << (kMinBlockShift + chunk->size_class);
+}
+
+MemoryStats GetMemoryStats()
+{
+  return stats;
 }
 } // namespace usb
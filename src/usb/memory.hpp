@@ -10,19 +10,20 @@
 
 namespace usb
 {
-/** @brief 動的メモリ確保のためのメモリプールの最大容量（バイト） */
-// static const size_t kMemoryPoolSize = 4096 * 32;
-static const size_t kMemoryPoolSize = 4096 * 1024;
-
 /** @brief 指定されたバイト数のメモリ領域を確保して先頭ポインタを返す．
  *
  * 先頭アドレスが alignment に揃ったメモリ領域を確保する．
  * size <= boundary ならメモリ領域が boundary を跨がないことを保証する．
  * boundary は典型的にはページ境界を跨がないように 4096 を指定する．
  *
+ * DMA pool: blocks of 64 B to 2 KiB come from per-size-class free lists,
+ * grown a frame at a time from the memory_manager; larger requests take
+ * frames of their own. The memory is zeroed, and recycled by FreeMem().
+ * Main thread only (no lock).
+ *
  * @param size        確保するメモリ領域のサイズ（バイト単位）
- * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．
- * @param boundary    確保したメモリ領域が跨いではいけない境界．0 なら制約しない．
+ * @param alignment   メモリ領域のアライメント制約．0 なら制約しない．2 のべき乗．
+ * @param boundary    確保したメモリ領域が跨いではいけない境界．0 なら制約しない．2 のべき乗．
  * @return 確保できなかった場合は nullptr
  */
 void *AllocMem(size_t size, unsigned int alignment, unsigned int boundary);
@@ -32,9 +33,21 @@ template <class T> T *AllocArray(size_t num_obj, unsigned int alignment, unsigne
   return reinterpret_cast<T *>(AllocMem(sizeof(T) * num_obj, alignment, boundary));
 }
 
-/** @brief 指定されたメモリ領域を解放する．本当に解放することは保証されない． */
+/** @brief AllocMem() で確保したメモリ領域を解放する．nullptr や他の領域は無視する． */
 void FreeMem(void *p);
 
+struct MemoryStats
+{
+  /* Taken from the memory_manager, and held */
+  size_t frames;
+  /* In the blocks handed out (rounded up to the size class) */
+  size_t bytes_in_use;
+  size_t allocations;
+  size_t frees;
+};
+
+MemoryStats GetMemoryStats();
+
 /** @brief 標準コンテナ用のメモリアロケータ */
 template <class T, unsigned int Alignment = 64, unsigned int Boundary = 4096> class Allocator
 {
@@ -0,0 +1,138 @@
+/**
+ * @file usb/memory_test.cpp
+ *
+ * Host stress test of usb::AllocMem()/FreeMem(): make hosttest64
+ *
+ *   - The frames come from the BitmapMemoryManager, over a region mapped at
+ *   the same (identity) address as the frames it hands out
+ *   - Random sizes, alignments and boundaries are allocated and freed; each
+ *   block is checked for its alignment, its boundary, being zeroed, and not
+ *   overlapping any other live block, then filled to catch a later overlap
+ */
+
+#include <sys/mman.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+
+#include "memory_manager.hpp"
+#include "usb/memory.hpp"
+
+BitmapMemoryManager *memory_manager;
+
+namespace
+{
+/* 32 GiB: inside the range the bitmap covers, and normally free in a host process */
+const uintptr_t kRegionBase = 0x800000000;
+const size_t kRegionBytes = 64 * 1024 * 1024;
+const int kIterations = 100000;
+
+struct Block
+{
+  size_t size;
+  uint8_t fill;
+};
+
+int failures = 0;
+
+void Fail(const char *what, const void *p, size_t size)
+{
+  if (++failures <= 10)
+  {
+    fprintf(stderr, "FAIL: %s: %p, %zu bytes\n", what, p, size);
+  }
+}
+} // namespace
+
+int main()
+{
+  void *region = mmap(reinterpret_cast<void *>(kRegionBase), kRegionBytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (region != reinterpret_cast<void *>(kRegionBase))
+  {
+    perror("mmap");
+    return 1;
+  }
+  memory_manager = new BitmapMemoryManager;
+  memory_manager->SetMemoryRange(FrameID{kRegionBase / kBytesPerFrame},
+                                 FrameID{(kRegionBase + kRegionBytes) / kBytesPerFrame});
+
+  std::mt19937 rng{42};
+  std::map<uintptr_t, Block> live;
+  for (int i = 0; i < kIterations; ++i)
+  {
+    if (!live.empty() && (rng() % 2 == 0 || live.size() > 512))
+    {
+      auto it = live.begin();
+      std::advance(it, rng() % live.size());
+      const auto p = reinterpret_cast<uint8_t *>(it->first);
+      for (size_t j = 0; j < it->second.size; ++j)
+      {
+        if (p[j] != it->second.fill)
+        {
+          Fail("overwritten", p, it->second.size);
+          break;
+        }
+      }
+      usb::FreeMem(p);
+      live.erase(it);
+      continue;
+    }
+
+    /* Mostly small blocks (contexts, TRB segments), some of several frames */
+    const size_t size = rng() % 8 == 0 ? 1 + rng() % (64 * 1024) : 1 + rng() % 2048;
+    const unsigned int alignment = (rng() % 2 == 0) ? 0 : 1u << (rng() % 13);
+    const unsigned int boundary = (rng() % 2 == 0) ? 0 : 4096u << (rng() % 5);
+    auto p = reinterpret_cast<uint8_t *>(usb::AllocMem(size, alignment, boundary));
+    if (p == nullptr)
+    {
+      Fail("out of memory", p, size);
+      continue;
+    }
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    if (alignment != 0 && addr % alignment != 0)
+    {
+      Fail("misaligned", p, size);
+    }
+    if (boundary != 0 && size <= boundary && addr / boundary != (addr + size - 1) / boundary)
+    {
+      Fail("crosses the boundary", p, size);
+    }
+    for (size_t j = 0; j < size; ++j)
+    {
+      if (p[j] != 0)
+      {
+        Fail("not zeroed", p, size);
+        break;
+      }
+    }
+    auto next = live.lower_bound(addr);
+    if ((next != live.end() && next->first < addr + size) ||
+        (next != live.begin() && std::prev(next)->first + std::prev(next)->second.size > addr))
+    {
+      Fail("overlaps", p, size);
+    }
+    const uint8_t fill = 1 + rng() % 255;
+    memset(p, fill, size);
+    live[addr] = Block{size, fill};
+  }
+
+  for (const auto &[addr, block] : live)
+  {
+    usb::FreeMem(reinterpret_cast<void *>(addr));
+  }
+  const auto stats = usb::GetMemoryStats();
+  if (stats.bytes_in_use != 0 || stats.allocations != stats.frees)
+  {
+    fprintf(stderr, "FAIL: %zu bytes in use, %zu allocations, %zu frees after freeing everything\n",
+            stats.bytes_in_use, stats.allocations, stats.frees);
+    ++failures;
+  }
+
+  printf("usb/memory: %d random AllocMem()/FreeMem() calls, %zu frames held at the end: %s\n", kIterations,
+         stats.frames, failures == 0 ? "ok" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
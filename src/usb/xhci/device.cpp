@@ -1,8 +1,12 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
+#include <new>
+
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace
 {
@@ -71,10 +75,24 @@ void Log(LogLevel level, const TransferEventTRB &trb)
 
 namespace usb::xhci
 {
-Device::Device(uint8_t slot_id, DoorbellRegister *dbreg) : slot_id_{slot_id}, dbreg_{dbreg}
+Device::Device(uint8_t slot_id, DoorbellRegister *dbreg, Controller *xhc)
+    : slot_id_{slot_id}, dbreg_{dbreg}, xhc_{xhc}
 {
 }
 
+Device::~Device()
+{
+  for (auto &tr : transfer_rings_)
+  {
+    if (tr != nullptr)
+    {
+      tr->~Ring();
+      FreeMem(tr);
+      tr = nullptr;
+    }
+  }
+}
+
 Error Device::Initialize()
 {
   state_ = State::kBlank;
@@ -94,9 +112,16 @@ void Device::SelectForSlotAssignment()
 Ring *Device::AllocTransferRing(DeviceContextIndex index, size_t buf_size)
 {
   int i = index.value - 1;
+  if (transfer_rings_[i] != nullptr)
+  {
+    /* Reconfigured: the old ring goes back to the pool */
+    transfer_rings_[i]->~Ring();
+    FreeMem(transfer_rings_[i]);
+  }
   auto tr = AllocArray<Ring>(1, 64, 4096);
   if (tr)
   {
+    new (tr) Ring;
     tr->Initialize(buf_size);
   }
   transfer_rings_[i] = tr;
@@ -126,6 +151,12 @@ Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int l
     return MAKE_ERROR(Error::kTransferRingNotSet);
   }
 
+  /* Setup, (Data,) Status: the whole TD or nothing */
+  if (auto err = tr->Reserve(buf ? 3 : 2))
+  {
+    return err;
+  }
+
   auto status = StatusStageTRB{};
 
   if (buf)
@@ -134,6 +165,7 @@ Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int l
         TRBDynamicCast<SetupStageTRB>(tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage)));
     auto data = MakeDataStageTRB(buf, len, true);
     data.bits.interrupt_on_completion = true;
+    data.bits.interrupter_target = interrupter_targets_[dci.value - 1];
     auto data_trb_position = tr->Push(data);
     tr->Push(status);
 
@@ -145,6 +177,7 @@ Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int l
         TRBDynamicCast<SetupStageTRB>(tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
     status.bits.direction = true;
     status.bits.interrupt_on_completion = true;
+    status.bits.interrupter_target = interrupter_targets_[dci.value - 1];
     auto status_trb_position = tr->Push(status);
 
     setup_stage_map_.Put(status_trb_position, setup_trb_position);
@@ -178,6 +211,11 @@ Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf
     return MAKE_ERROR(Error::kTransferRingNotSet);
   }
 
+  if (auto err = tr->Reserve(buf ? 3 : 2))
+  {
+    return err;
+  }
+
   auto status = StatusStageTRB{};
   status.bits.direction = true;
 
@@ -187,6 +225,7 @@ Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf
         TRBDynamicCast<SetupStageTRB>(tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage)));
     auto data = MakeDataStageTRB(buf, len, false);
     data.bits.interrupt_on_completion = true;
+    data.bits.interrupter_target = interrupter_targets_[dci.value - 1];
     auto data_trb_position = tr->Push(data);
     tr->Push(status);
 
@@ -197,6 +236,7 @@ Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf
     auto setup_trb_position =
         TRBDynamicCast<SetupStageTRB>(tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
     status.bits.interrupt_on_completion = true;
+    status.bits.interrupter_target = interrupter_targets_[dci.value - 1];
     auto status_trb_position = tr->Push(status);
 
     setup_stage_map_.Put(status_trb_position, setup_trb_position);
@@ -223,11 +263,17 @@ Error Device::InterruptIn(EndpointID ep_id, void *buf, int len)
     return MAKE_ERROR(Error::kTransferRingNotSet);
   }
 
+  if (auto err = tr->Reserve(1))
+  {
+    return err;
+  }
+
   NormalTRB normal{};
   normal.SetPointer(buf);
   normal.bits.trb_transfer_length = len;
   normal.bits.interrupt_on_short_packet = true;
   normal.bits.interrupt_on_completion = true;
+  normal.bits.interrupter_target = interrupter_targets_[dci.value - 1];
 
   tr->Push(normal);
   dbreg_->Ring(dci.value);
@@ -245,10 +291,278 @@ Error Device::InterruptOut(EndpointID ep_id, void *buf, int len)
   return MAKE_ERROR(Error::kNotImplemented);
 }
 
+Error Device::BulkIn(EndpointID ep_id, void *buf, int len)
+{
+  const BufferSegment segment{buf, len};
+  return BulkIn(ep_id, &segment, 1);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const void *buf, int len)
+{
+  const BufferSegment segment{const_cast<void *>(buf), len};
+  return BulkOut(ep_id, &segment, 1);
+}
+
+Error Device::BulkIn(EndpointID ep_id, const BufferSegment *segments, int num_segments)
+{
+  if (auto err = usb::Device::BulkIn(ep_id, segments, num_segments))
+  {
+    return err;
+  }
+  if (auto err = PushBulkTD(ep_id, segments, num_segments))
+  {
+    return err;
+  }
+  dbreg_->Ring(DeviceContextIndex{ep_id}.value);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::BulkOut(EndpointID ep_id, const BufferSegment *segments, int num_segments)
+{
+  if (auto err = usb::Device::BulkOut(ep_id, segments, num_segments))
+  {
+    return err;
+  }
+  if (auto err = PushBulkTD(ep_id, segments, num_segments))
+  {
+    return err;
+  }
+  dbreg_->Ring(DeviceContextIndex{ep_id}.value);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error Device::PushBulkTD(EndpointID ep_id, const BufferSegment *segments, int num_segments)
+{
+  const DeviceContextIndex dci{ep_id};
+  Ring *tr = transfer_rings_[dci.value - 1];
+  if (tr == nullptr)
+  {
+    return MAKE_ERROR(Error::kTransferRingNotSet);
+  }
+  if (num_segments <= 0)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+
+  BulkTD *td = nullptr;
+  for (auto &t : bulk_tds_)
+  {
+    if (!t.in_use)
+    {
+      td = &t;
+      break;
+    }
+  }
+  if (td == nullptr)
+  {
+    return MAKE_ERROR(Error::kFull);
+  }
+
+  /* 6.4.1.1 Normal TRB: a data buffer may not span a 64 KiB boundary */
+  size_t num_trbs = 0;
+  size_t total_len = 0;
+  for (int i = 0; i < num_segments; ++i)
+  {
+    if (segments[i].len <= 0)
+    {
+      continue;
+    }
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(segments[i].buf);
+    const uintptr_t end = begin + segments[i].len;
+    num_trbs += ((end - 1) >> 16) - (begin >> 16) + 1;
+    total_len += segments[i].len;
+  }
+  /* A zero-length TD is one TRB without data */
+  if (num_trbs == 0)
+  {
+    num_trbs = 1;
+  }
+  if (auto err = tr->Reserve(num_trbs))
+  {
+    return err;
+  }
+
+  size_t max_packet_size = ctx_.ep_contexts[dci.value - 1].bits.max_packet_size;
+  if (max_packet_size == 0)
+  {
+    max_packet_size = 512;
+  }
+  /* 4.11.2.4 TD Size: TDPC - (the bytes up to this TRB / Max Packet Size), at most 31; 0 on the last TRB */
+  const size_t td_packet_count = (total_len + max_packet_size - 1) / max_packet_size;
+
+  const TRB *first_trb = nullptr;
+  const TRB *last_trb = nullptr;
+  size_t trb_count = 0;
+  size_t transferred = 0;
+  auto push_trb = [&](uintptr_t p, size_t len) {
+    const bool last = ++trb_count == num_trbs;
+    transferred += len;
+
+    NormalTRB normal{};
+    normal.SetPointer(reinterpret_cast<const void *>(p));
+    normal.bits.trb_transfer_length = len;
+    normal.bits.td_size = last ? 0 : std::min<size_t>(td_packet_count - transferred / max_packet_size, 31);
+    normal.bits.interrupt_on_short_packet = ep_id.IsIn();
+    normal.bits.chain_bit = !last;
+    normal.bits.interrupt_on_completion = last;
+    normal.bits.interrupter_target = interrupter_targets_[dci.value - 1];
+    last_trb = tr->Push(normal);
+    if (first_trb == nullptr)
+    {
+      first_trb = last_trb;
+    }
+  };
+
+  if (total_len == 0)
+  {
+    push_trb(reinterpret_cast<uintptr_t>(segments[0].buf), 0);
+  }
+  for (int i = 0; i < num_segments; ++i)
+  {
+    uintptr_t p = reinterpret_cast<uintptr_t>(segments[i].buf);
+    const uintptr_t end = p + std::max(segments[i].len, 0);
+    while (p < end)
+    {
+      const uintptr_t trb_end = std::min<uintptr_t>(end, (p | 0xffffu) + 1);
+      push_trb(p, trb_end - p);
+      p = trb_end;
+    }
+  }
+
+  *td = BulkTD{true, static_cast<uint8_t>(dci.value), next_bulk_seq_++, first_trb, last_trb, segments[0].buf,
+               static_cast<int>(total_len)};
+  bulk_endpoints_ |= 1u << dci.value;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Device::BulkTD *Device::FindBulkTD(uint8_t dci, const TRB *trb)
+{
+  BulkTD *oldest = nullptr;
+  for (auto &td : bulk_tds_)
+  {
+    if (!td.in_use || td.dci != dci)
+    {
+      continue;
+    }
+    if (td.last_trb == trb)
+    {
+      return &td;
+    }
+    if (oldest == nullptr || td.seq < oldest->seq)
+    {
+      oldest = &td;
+    }
+  }
+  if (oldest == nullptr)
+  {
+    return nullptr;
+  }
+  /* A short packet before the last TRB */
+  for (const TRB *p = oldest->first_trb; p != oldest->last_trb;)
+  {
+    if (p->bits.trb_type == LinkTRB::Type)
+    {
+      p = reinterpret_cast<const LinkTRB *>(p)->Pointer();
+      continue;
+    }
+    if (p == trb)
+    {
+      return oldest;
+    }
+    ++p;
+  }
+  return nullptr;
+}
+
+Error Device::OnBulkEventReceived(const TransferEventTRB &trb)
+{
+  const DeviceContextIndex dci{trb.EndpointID()};
+  const TRB *issuer_trb = trb.Pointer();
+  BulkTD *td = FindBulkTD(dci.value, issuer_trb);
+  if (td == nullptr)
+  {
+    /* e.g. a Success event for the last TRB after a short packet one */
+    Log(kDebug, "stray bulk event: ep addr %d\n", trb.EndpointID().Address());
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  if (trb.bits.completion_code != 1 /* Success */ && trb.bits.completion_code != 13 /* Short Packet */)
+  {
+    Log(kDebug, trb);
+    /* The endpoint halted: none of its TDs completes any more */
+    for (auto &t : bulk_tds_)
+    {
+      if (t.in_use && t.dci == dci.value)
+      {
+        t.in_use = false;
+      }
+    }
+    return OnTransferFailed(trb.EndpointID(), trb.bits.completion_code);
+  }
+
+  int transfer_length = 0;
+  for (const TRB *p = td->first_trb; p != issuer_trb;)
+  {
+    if (p->bits.trb_type == LinkTRB::Type)
+    {
+      p = reinterpret_cast<const LinkTRB *>(p)->Pointer();
+      continue;
+    }
+    transfer_length += reinterpret_cast<const NormalTRB *>(p)->bits.trb_transfer_length;
+    ++p;
+  }
+  transfer_length += reinterpret_cast<const NormalTRB *>(issuer_trb)->bits.trb_transfer_length;
+  transfer_length -= trb.bits.trb_transfer_length;
+
+  void *buf = td->buf;
+  td->in_use = false;
+  return OnBulkCompleted(trb.EndpointID(), buf, transfer_length);
+}
+
+int Device::Tier() const
+{
+  int tier = 0;
+  for (uint32_t route = ctx_.slot_context.bits.route_string; route != 0; route >>= 4)
+  {
+    ++tier;
+  }
+  return tier;
+}
+
+Error Device::ConfigureHub(HubDriver *hub, int num_ports, int think_time, bool multi_tt)
+{
+  if (auto err = usb::Device::ConfigureHub(hub, num_ports, think_time, multi_tt))
+  {
+    return err;
+  }
+  return usb::xhci::ConfigureHub(*xhc_, *this, num_ports, think_time, multi_tt);
+}
+
+Error Device::AttachHubPort(int port)
+{
+  return ConfigureHubPort(*xhc_, *this, port);
+}
+
+Error Device::OnHubPortReset(int port, int speed)
+{
+  return usb::xhci::OnHubPortReset(*xhc_, *this, port, speed);
+}
+
 Error Device::OnTransferEventReceived(const TransferEventTRB &trb)
 {
   const auto residual_length = trb.bits.trb_transfer_length;
 
+  /* Failed or not, the xHC is past the TRB (an Event Data TRB's pointer is not a TRB) */
+  const DeviceContextIndex dci{trb.EndpointID()};
+  if (!trb.bits.event_data && transfer_rings_[dci.value - 1] != nullptr)
+  {
+    transfer_rings_[dci.value - 1]->OnConsumed(trb.Pointer());
+  }
+  if (bulk_endpoints_ & (1u << dci.value))
+  {
+    return OnBulkEventReceived(trb);
+  }
+
   if (trb.bits.completion_code != 1 /* Success */ && trb.bits.completion_code != 13 /* Short Packet */)
   {
     Log(kDebug, trb);
@@ -10,7 +10,7 @@
 #include <cstdint>
 
 #include "error.hpp"
-#include "usb/arraymap.hpp"
+#include "usb/hashmap.hpp"
 #include "usb/device.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/registers.hpp"
@@ -18,6 +18,8 @@
 
 namespace usb::xhci
 {
+class Controller;
+
 class Device : public usb::Device
 {
 public:
@@ -32,7 +34,9 @@ public:
   using OnTransferredCallbackType = void(Device *dev, DeviceContextIndex dci, int completion_code,
                                          int trb_transfer_length, TRB *issue_trb);
 
-  Device(uint8_t slot_id, DoorbellRegister *dbreg);
+  Device(uint8_t slot_id, DoorbellRegister *dbreg, Controller *xhc);
+  /* Frees the transfer rings */
+  ~Device() override;
 
   Error Initialize();
 
@@ -58,11 +62,29 @@ public:
 
   void SelectForSlotAssignment();
   Ring *AllocTransferRing(DeviceContextIndex index, size_t buf_size);
+  /** @brief The interrupter (event ring) the transfer events of endpoint `index` go to */
+  void SetInterrupterTarget(DeviceContextIndex index, uint8_t interrupter)
+  {
+    interrupter_targets_[index.value - 1] = interrupter;
+  }
 
   Error ControlIn(EndpointID ep_id, SetupData setup_data, void *buf, int len, ClassDriver *issuer) override;
   Error ControlOut(EndpointID ep_id, SetupData setup_data, const void *buf, int len, ClassDriver *issuer) override;
   Error InterruptIn(EndpointID ep_id, void *buf, int len) override;
   Error InterruptOut(EndpointID ep_id, void *buf, int len) override;
+  Error BulkIn(EndpointID ep_id, void *buf, int len) override;
+  Error BulkOut(EndpointID ep_id, const void *buf, int len) override;
+  Error BulkIn(EndpointID ep_id, const BufferSegment *segments, int num_segments) override;
+  Error BulkOut(EndpointID ep_id, const BufferSegment *segments, int num_segments) override;
+
+  int Speed() const override
+  {
+    return ctx_.slot_context.bits.speed;
+  }
+  int Tier() const override;
+  Error ConfigureHub(HubDriver *hub, int num_ports, int think_time, bool multi_tt) override;
+  Error AttachHubPort(int port) override;
+  Error OnHubPortReset(int port, int speed) override;
 
   Error OnTransferEventReceived(const TransferEventTRB &trb);
 
@@ -72,14 +94,44 @@ private:
 
   const uint8_t slot_id_;
   DoorbellRegister *const dbreg_;
+  /* For the hub requests */
+  Controller *const xhc_;
 
   enum State state_;
-  std::array<Ring *, 31> transfer_rings_; // index = dci - 1
+  std::array<Ring *, 31> transfer_rings_{}; // index = dci - 1
+  std::array<uint8_t, 31> interrupter_targets_{}; // index = dci - 1
 
   /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
    * から対応する SetupStageTRB を検索するためのマップ．
    */
-  ArrayMap<const void *, const SetupStageTRB *, 16> setup_stage_map_{};
+  HashMap<const void *, const SetupStageTRB *, 32> setup_stage_map_{};
+
+  /**
+   * A bulk TD in flight: a chain of Normal TRBs over the segments of its
+   * buffer, IOC on the last one only.
+   * The TDs of an endpoint complete in order, so a short packet event on
+   * an earlier TRB belongs to its oldest TD.
+   */
+  struct BulkTD
+  {
+    bool in_use;
+    uint8_t dci;
+    uint64_t seq;
+    const TRB *first_trb;
+    const TRB *last_trb;
+    void *buf;
+    int len;
+  };
+  static const size_t kMaxBulkTDs = 32;
+  std::array<BulkTD, kMaxBulkTDs> bulk_tds_{};
+  uint64_t next_bulk_seq_ = 0;
+  /* bit n: DCI n is a bulk endpoint */
+  uint32_t bulk_endpoints_ = 0;
+
+  Error PushBulkTD(EndpointID ep_id, const BufferSegment *segments, int num_segments);
+  /* The TD an event on `trb` of `dci` completes; nullptr for a stray event */
+  BulkTD *FindBulkTD(uint8_t dci, const TRB *trb);
+  Error OnBulkEventReceived(const TransferEventTRB &trb);
 
   // usb::Device* usb_device_;
 };
@@ -24,10 +24,23 @@ Error DeviceManager::Initialize(size_t max_slots)
     return MAKE_ERROR(Error::kNoEnoughMemory);
   }
 
+  children_ = AllocArray<std::array<uint8_t, 16>>(max_slots_ + 1, 0, 0);
+  links_ = AllocArray<PortLink>(max_slots_ + 1, 0, 0);
+  if (children_ == nullptr || links_ == nullptr)
+  {
+    FreeMem(children_);
+    FreeMem(links_);
+    FreeMem(device_context_pointers_);
+    FreeMem(devices_);
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+
   for (size_t i = 0; i <= max_slots_; ++i)
   {
     devices_[i] = nullptr;
     device_context_pointers_[i] = nullptr;
+    children_[i] = {};
+    links_[i] = {};
   }
 
   return MAKE_ERROR(Error::kSuccess);
@@ -40,17 +53,12 @@ DeviceContext **DeviceManager::DeviceContexts() const
 
 Device *DeviceManager::FindByPort(uint8_t port_num, uint32_t route_string) const
 {
-  for (size_t i = 1; i <= max_slots_; ++i)
+  uint8_t slot_id = root_port_slots_[port_num];
+  for (; slot_id != 0 && route_string != 0; route_string >>= 4)
   {
-    auto dev = devices_[i];
-    if (dev == nullptr)
-      continue;
-    if (dev->DeviceContext()->slot_context.bits.root_hub_port_num == port_num)
-    {
-      return dev;
-    }
+    slot_id = children_[slot_id][route_string & 0xfu];
   }
-  return nullptr;
+  return slot_id != 0 ? devices_[slot_id] : nullptr;
 }
 
 Device *DeviceManager::FindByState(enum Device::State state) const
@@ -86,7 +94,7 @@ WithError<Device*> DeviceManager::Get(uint8_t device_id) const {
 }
 */
 
-Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg)
+Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg, Controller *xhc)
 {
   if (slot_id > max_slots_)
   {
@@ -99,7 +107,39 @@ Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg)
   }
 
   devices_[slot_id] = AllocArray<Device>(1, 64, 4096);
-  new (devices_[slot_id]) Device(slot_id, dbreg);
+  new (devices_[slot_id]) Device(slot_id, dbreg, xhc);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error DeviceManager::AssignPort(uint8_t slot_id, uint8_t port_num, uint32_t route_string)
+{
+  if (slot_id == 0 || slot_id > max_slots_)
+  {
+    return MAKE_ERROR(Error::kInvalidSlotID);
+  }
+
+  /* The last tier of the route string is the port on the parent hub */
+  uint32_t parent_route = 0;
+  uint8_t port = 0;
+  for (int shift = 0; (route_string >> shift) != 0; shift += 4)
+  {
+    port = (route_string >> shift) & 0xfu;
+    parent_route = route_string & ((1u << shift) - 1);
+  }
+
+  if (route_string == 0)
+  {
+    root_port_slots_[port_num] = slot_id;
+    links_[slot_id] = PortLink{0, port_num};
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  Device *hub = FindByPort(port_num, parent_route);
+  if (hub == nullptr)
+  {
+    return MAKE_ERROR(Error::kUnknownDevice);
+  }
+  children_[hub->SlotID()][port] = slot_id;
+  links_[slot_id] = PortLink{hub->SlotID(), port};
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -117,7 +157,20 @@ Error DeviceManager::LoadDCBAA(uint8_t slot_id)
 
 Error DeviceManager::Remove(uint8_t slot_id)
 {
+  const PortLink link = links_[slot_id];
+  uint8_t &indexed = link.parent_slot == 0 ? root_port_slots_[link.port] : children_[link.parent_slot][link.port];
+  if (indexed == slot_id)
+  {
+    indexed = 0;
+  }
+  links_[slot_id] = {};
+  children_[slot_id] = {};
+
   device_context_pointers_[slot_id] = nullptr;
+  if (devices_[slot_id] != nullptr)
+  {
+    devices_[slot_id]->~Device();
+  }
   FreeMem(devices_[slot_id]);
   devices_[slot_id] = nullptr;
   return MAKE_ERROR(Error::kSuccess);
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 
@@ -21,15 +22,29 @@ class DeviceManager
 public:
   Error Initialize(size_t max_slots);
   DeviceContext **DeviceContexts() const;
+  /**
+   * @brief The device on root hub port `port_num`, behind the hubs of
+   * `route_string` (0: on the port itself); follows the route string one
+   * tier at a time, from the device on the root hub port
+   */
   Device *FindByPort(uint8_t port_num, uint32_t route_string) const;
   Device *FindByState(enum Device::State state) const;
   Device *FindBySlot(uint8_t slot_id) const;
   // WithError<Device*> Get(uint8_t device_id) const;
-  Error AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg);
+  Error AllocDevice(uint8_t slot_id, DoorbellRegister *dbreg, Controller *xhc);
+  /** @brief Index the device of `slot_id` for FindByPort(); its hub (if any) must be indexed already */
+  Error AssignPort(uint8_t slot_id, uint8_t port_num, uint32_t route_string);
   Error LoadDCBAA(uint8_t slot_id);
   Error Remove(uint8_t slot_id);
 
 private:
+  /* Where a slot is indexed: its hub's slot (0: a root hub port) and port */
+  struct PortLink
+  {
+    uint8_t parent_slot;
+    uint8_t port;
+  };
+
   // device_context_pointers_ can be used as DCBAAP's value.
   // The number of elements is max_slots_ + 1.
   DeviceContext **device_context_pointers_;
@@ -37,5 +52,12 @@ private:
 
   // The number of elements is max_slots_ + 1.
   Device **devices_;
+
+  /* The slot of the device on each root hub port (index: port number) */
+  std::array<uint8_t, 256> root_port_slots_{};
+  /* children_[slot][port]: the slot of the device on downstream `port` of hub `slot`; max_slots_ + 1 elements */
+  std::array<uint8_t, 16> *children_;
+  /* links_[slot]; max_slots_ + 1 elements */
+  PortLink *links_;
 };
 } // namespace usb::xhci
@@ -7,44 +7,142 @@ namespace usb::xhci
 {
 Ring::~Ring()
 {
-  if (buf_ != nullptr)
+  FreeSegments();
+}
+
+void Ring::FreeSegments()
+{
+  for (size_t i = 0; i < num_segments_; ++i)
   {
-    FreeMem(buf_);
+    FreeMem(segments_[i]);
+    segments_[i] = nullptr;
   }
+  num_segments_ = 0;
 }
 
 Error Ring::Initialize(size_t buf_size)
 {
-  if (buf_ != nullptr)
-  {
-    FreeMem(buf_);
-  }
+  FreeSegments();
 
   /**
    * Sync with the xHC hardware
    * - the xHC maintains an Event Ring Producer Cycle State (PCS) bit; initialized to '1'
    */
   cycle_bit_ = true;
+  segment_ = 0;
   write_index_ = 0;
-  buf_size_ = buf_size;
+  dequeue_segment_ = 0;
+  dequeue_index_ = 0;
+  segment_size_ = buf_size;
+
+  segments_[0] = AllocArray<TRB>(segment_size_, 64, 64 * 1024);
+  if (segments_[0] == nullptr)
+  {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  memset(segments_[0], 0, segment_size_ * sizeof(TRB));
+  num_segments_ = 1;
+
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t Ring::Used() const
+{
+  /**
+   * Positions counted without the Link TRBs (a Link TRB is at the position of
+   * the next segment's first TRB); equal positions mean empty
+   */
+  const size_t slots = segment_size_ - 1;
+  const size_t capacity = num_segments_ * slots;
+  const size_t enqueue = segment_ * slots + write_index_;
+  const size_t dequeue = dequeue_segment_ * slots + dequeue_index_;
+  return (enqueue + capacity - dequeue) % capacity;
+}
+
+size_t Ring::FreeSlots() const
+{
+  /* One slot is kept empty, or a full ring would look empty */
+  return num_segments_ * (segment_size_ - 1) - 1 - Used();
+}
+
+bool Ring::CanGrow() const
+{
+  /**
+   * With the Dequeue Pointer ahead in the same segment, the TRBs pending up to
+   * the Link TRB come before the new segment would in the xHC's order, but
+   * after it in ours
+   */
+  const bool dequeue_ahead = dequeue_segment_ == segment_ && dequeue_index_ > write_index_;
+  return num_segments_ < kMaxSegments && !dequeue_ahead;
+}
 
-  buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-  if (buf_ == nullptr)
+Error Ring::InsertSegment()
+{
+  TRB *segment = AllocArray<TRB>(segment_size_, 64, 64 * 1024);
+  if (segment == nullptr)
   {
     return MAKE_ERROR(Error::kNoEnoughMemory);
   }
-  memset(buf_, 0, buf_size_ * sizeof(TRB));
+  /**
+   * The xHC follows segment_'s Link TRB (not written yet) into the new one with
+   * the current cycle: the stale TRBs must look not ready
+   */
+  memset(segment, 0, segment_size_ * sizeof(TRB));
+  for (size_t i = 0; i < segment_size_; ++i)
+  {
+    segment[i].bits.cycle_bit = !cycle_bit_;
+  }
+
+  for (size_t i = num_segments_; i > segment_ + 1; --i)
+  {
+    segments_[i] = segments_[i - 1];
+  }
+  segments_[segment_ + 1] = segment;
+  ++num_segments_;
+  if (dequeue_segment_ > segment_)
+  {
+    ++dequeue_segment_;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
 
+Error Ring::Reserve(size_t n)
+{
+  while (FreeSlots() < n)
+  {
+    if (!CanGrow())
+    {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (auto err = InsertSegment())
+    {
+      return err;
+    }
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
+void Ring::OnConsumed(const TRB *trb)
+{
+  for (size_t i = 0; i < num_segments_; ++i)
+  {
+    if (segments_[i] <= trb && trb < segments_[i] + segment_size_)
+    {
+      /* Right after the last TRB, it is at the Link TRB: not known to be past it until a later event */
+      dequeue_segment_ = i;
+      dequeue_index_ = trb - segments_[i] + 1;
+      return;
+    }
+  }
+}
+
 /**
  * Write data at enqueuePtr
  * cycle_bit not included
  */
 void Ring::CopyToLast(const std::array<uint32_t, 4> &data)
 {
-  TRB *enqueuePtr = &buf_[write_index_];
+  TRB *enqueuePtr = &segments_[segment_][write_index_];
   for (int i = 0; i < 3; ++i)
   {
     // data[0..2] must be written prior to data[3].
@@ -60,61 +158,119 @@ void Ring::CopyToLast(const std::array<uint32_t, 4> &data)
  */
 TRB *Ring::Push(const std::array<uint32_t, 4> &data)
 {
-  TRB *enqueuePtr = &buf_[write_index_];
+  if (Reserve(1))
+  {
+    return nullptr;
+  }
+
+  TRB *enqueuePtr = &segments_[segment_][write_index_];
   CopyToLast(data);
 
   ++write_index_;
-  /**
-   * Add another segment (actually, wrap to the head of the ring itself)
-   */
-  if (write_index_ == buf_size_ - 1)
+  if (write_index_ == segment_size_ - 1)
   {
-    LinkTRB link{buf_};            // next segment = (TRB *) buf_; trb_type = linkTRB;
-    link.bits.toggle_cycle = true; // TC = 1; because the ring is wrapped
+    /**
+     * Leaving the segment: rather than catching up with the xHC in the next
+     * one, put a new segment in between while we still can
+     */
+    const size_t next = (segment_ + 1) % num_segments_;
+    if (Used() > 0 && dequeue_segment_ == next && num_segments_ < kMaxSegments)
+    {
+      InsertSegment();
+    }
+
+    const bool wrap = segment_ + 1 == num_segments_;
+    LinkTRB link{segments_[wrap ? 0 : segment_ + 1]};
+    link.bits.toggle_cycle = wrap; // TC = 1 only if the ring is wrapped
+    /* 4.11.5.1: a Link TRB inside a TD (the TRB before it has CH, bit 4) is chained too */
+    link.bits.chain_bit = (enqueuePtr->data[3] >> 4) & 1;
     CopyToLast(link.data);         // Write
 
+    segment_ = wrap ? 0 : segment_ + 1;
     write_index_ = 0;
-    cycle_bit_ = !cycle_bit_;
+    if (wrap)
+    {
+      cycle_bit_ = !cycle_bit_;
+    }
   }
 
   return enqueuePtr;
 }
 
-Error EventRing::Initialize(size_t buf_size, InterrupterRegisterSet *interrupter)
+void EventRing::FreeSegments()
 {
-  if (buf_ != nullptr)
+  if (erst_ == nullptr)
+  {
+    return;
+  }
+  for (size_t i = 0; i < num_segments_; ++i)
   {
-    FreeMem(buf_);
+    if (erst_[i].bits.ring_segment_base_address != 0)
+    {
+      FreeMem(reinterpret_cast<TRB *>(erst_[i].bits.ring_segment_base_address));
+    }
   }
+  FreeMem(erst_);
+  erst_ = nullptr;
+  num_segments_ = 0;
+}
 
-  cycle_bit_ = true;
-  buf_size_ = buf_size;
-  interrupter_ = interrupter;
+Error EventRing::Initialize(size_t buf_size, InterrupterRegisterSet *interrupter, size_t num_segments)
+{
+  FreeSegments();
 
-  buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-  if (buf_ == nullptr)
+  if (num_segments == 0)
   {
-    return MAKE_ERROR(Error::kNoEnoughMemory);
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  size_t segment_size = (buf_size + num_segments - 1) / num_segments;
+  if (segment_size < kMinSegmentSize)
+  {
+    segment_size = kMinSegmentSize;
+  }
+  else if (segment_size > kMaxSegmentSize)
+  {
+    segment_size = kMaxSegmentSize;
   }
-  memset(buf_, 0, buf_size_ * sizeof(TRB));
 
-  erst_ = AllocArray<EventRingSegmentTableEntry>(1, 64, 64 * 1024);
+  cycle_bit_ = true;
+  interrupter_ = interrupter;
+
+  erst_ = AllocArray<EventRingSegmentTableEntry>(num_segments, 64, 64 * 1024);
   if (erst_ == nullptr)
   {
-    FreeMem(buf_);
     return MAKE_ERROR(Error::kNoEnoughMemory);
   }
-  memset(erst_, 0, 1 * sizeof(EventRingSegmentTableEntry));
+  memset(erst_, 0, num_segments * sizeof(EventRingSegmentTableEntry));
+  num_segments_ = num_segments;
 
-  erst_[0].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(buf_);
-  erst_[0].bits.ring_segment_size = buf_size_;
+  /* A segment must not cross a 64 KiB boundary; 4096 TRBs are exactly 64 KiB */
+  for (size_t i = 0; i < num_segments_; ++i)
+  {
+    TRB *segment = AllocArray<TRB>(segment_size, 64, 64 * 1024);
+    if (segment == nullptr)
+    {
+      FreeSegments();
+      return MAKE_ERROR(Error::kNoEnoughMemory);
+    }
+    memset(segment, 0, segment_size * sizeof(TRB));
+    erst_[i].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(segment);
+    erst_[i].bits.ring_segment_size = segment_size;
+  }
+  buf_size_ = segment_size * num_segments_;
 
   ERSTSZ_Bitmap erstsz = interrupter_->ERSTSZ.Read();
-  erstsz.SetSize(1);
+  erstsz.SetSize(num_segments_);
   interrupter_->ERSTSZ.Write(erstsz);
 
-  WriteDequeuePointer(&buf_[0]);
+  segment_ = 0;
+  dequeue_ = reinterpret_cast<TRB *>(erst_[0].bits.ring_segment_base_address);
+  segment_end_ = dequeue_ + segment_size;
+  batch_ = 0;
+  high_water_mark_ = 0;
+  WriteDequeuePointer(dequeue_);
 
+  /* Writing ERSTBA enables the event ring: ERSTSZ and ERDP first */
   ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
   erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
   interrupter_->ERSTBA.Write(erstba);
@@ -122,32 +278,58 @@ Error EventRing::Initialize(size_t buf_size, InterrupterRegisterSet *interrupter
   return MAKE_ERROR(Error::kSuccess);
 }
 
-void EventRing::WriteDequeuePointer(TRB *p)
+void EventRing::WriteDequeuePointer(TRB *p, bool clear_busy)
 {
   auto erdp = interrupter_->ERDP.Read();
   erdp.SetPointer(reinterpret_cast<uint64_t>(p));
+  /**
+   * Dequeue ERST Segment Index (DESI): the low 3 bits of the segment `p` is
+   * in; the xHC uses it to skip the ring-full check while it enqueues in
+   * another segment
+   */
+  erdp.bits.dequeue_erst_segment_index = segment_ & 0x7;
+  /* RW1C: writing back a 1 read while busy would clear it */
+  erdp.bits.event_handler_busy = clear_busy;
   interrupter_->ERDP.Write(erdp);
 }
 
+void EventRing::UpdateDequeuePointer()
+{
+  if (batch_ > high_water_mark_)
+  {
+    high_water_mark_ = batch_;
+  }
+  batch_ = 0;
+  WriteDequeuePointer(dequeue_);
+}
+
 /**
- * increment the dequeuePointer
- * if wrap, flip the Event Ring Consumer Cycle State (CCS) bit
- * When software finishes processing an Event TRB, it will write the address of that Event TRB to the ERDP.
+ * increment the dequeuePointer; at the end of a segment go to the next one,
+ * and flip the Event Ring Consumer Cycle State (CCS) bit after the last one
  */
-void EventRing::Pop()
+void EventRing::Advance()
 {
-  TRB *p = ReadDequeuePointer() + 1;
-
-  TRB *segment_begin = reinterpret_cast<TRB *>(erst_[0].bits.ring_segment_base_address);
-  TRB *segment_end = segment_begin + erst_[0].bits.ring_segment_size;
+  ++batch_;
+  if (++dequeue_ != segment_end_)
+  {
+    return;
+  }
 
-  if (p == segment_end)
+  if (++segment_ == num_segments_)
   {
-    p = segment_begin;
+    segment_ = 0;
     cycle_bit_ = !cycle_bit_;
   }
+  dequeue_ = reinterpret_cast<TRB *>(erst_[segment_].bits.ring_segment_base_address);
+  segment_end_ = dequeue_ + erst_[segment_].bits.ring_segment_size;
+}
 
-  /* ERSTSZ == 1, no need to update the ERST Segment Index (DESI) field */
-  WriteDequeuePointer(p);
+/**
+ * When software finishes processing an Event TRB, it will write the address of that Event TRB to the ERDP.
+ */
+void EventRing::Pop()
+{
+  Advance();
+  UpdateDequeuePointer();
 }
 } // namespace usb::xhci
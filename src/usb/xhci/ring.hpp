@@ -35,6 +35,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <vector>
 
@@ -45,35 +46,62 @@
 
 namespace usb::xhci
 {
-/** @brief Command/Transfer Ring を表すクラス． */
+/**
+ * @brief Command/Transfer Ring を表すクラス．
+ *
+ * 4.9.2.3 Dynamic Transfer Ring Segment Expansion
+ *   - A ring starts as one segment, and grows by one segment (inserted right
+ *   after the Enqueue Pointer's) when the xHC lags behind, up to kMaxSegments
+ *   - The last TRB of each segment is a Link TRB to the next one; the one back
+ *   to the first segment has TC set
+ *   - Software tracks the Dequeue Pointer from the completion events
+ *   (OnConsumed()); FreeSlots() is what may be pushed before it is caught up
+ */
 class Ring
 {
 public:
+  static const size_t kMaxSegments = 16;
+
   Ring() = default;
   Ring(const Ring &) = delete;
   ~Ring();
   Ring &operator=(const Ring &) = delete;
 
-  /** @brief リングのメモリ領域を割り当て，メンバを初期化する． */
+  /** @brief 1 セグメント（buf_size TRB，Link TRB を含む）を割り当て，メンバを初期化する． */
   Error Initialize(size_t buf_size);
 
   /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
    *
-   * @return 追加された（リング上の）TRB を指すポインタ．
+   * @return 追加された（リング上の）TRB を指すポインタ．リングが満杯で
+   * 伸ばせなければ nullptr．
    */
   template <typename TRBType> TRB *Push(const TRBType &trb)
   {
     return Push(trb.data);
   }
 
+  /** @brief Make room for `n` more TRBs (one TD), growing the ring if needed; kFull if it cannot */
+  Error Reserve(size_t n);
+  /** @brief The xHC has consumed the TRBs up to `trb`, the one a Transfer/Command Completion Event points to */
+  void OnConsumed(const TRB *trb);
+  /** @brief TRBs that can be pushed without growing the ring */
+  size_t FreeSlots() const;
+
+  /** @brief The first segment: the initial Dequeue Pointer for the xHC */
   TRB *Buffer() const
   {
-    return buf_;
+    return segments_[0];
+  }
+  size_t NumSegments() const
+  {
+    return num_segments_;
   }
 
 private:
-  TRB *buf_ = nullptr;
-  size_t buf_size_ = 0;
+  std::array<TRB *, kMaxSegments> segments_{};
+  size_t num_segments_ = 0;
+  /* TRBs per segment, the Link TRB included */
+  size_t segment_size_ = 0;
 
   /**
    * The Producer Cycle State (PCS) bit;
@@ -86,11 +114,23 @@ private:
    *
    * Figure 4-10: Final State of Transfer Ring
    */
-  bool cycle_bit_;
+  bool cycle_bit_ = true;
   /**
-   * TRB *enqueuePtr = &buf_[write_index_];
+   * TRB *enqueuePtr = &segments_[segment_][write_index_];
    */
-  size_t write_index_;
+  size_t segment_ = 0;
+  size_t write_index_ = 0;
+  /* Software's copy of the Dequeue Pointer; the xHC may still have to fetch the Link TRB it is at */
+  size_t dequeue_segment_ = 0;
+  size_t dequeue_index_ = 0;
+
+  void FreeSegments();
+  /* TRBs pushed and not consumed yet */
+  size_t Used() const;
+  /* A segment can be inserted after the Enqueue Pointer's unless the Dequeue Pointer is ahead of it there */
+  bool CanGrow() const;
+  /* Insert a new segment right after segment_ */
+  Error InsertSegment();
 
   /**
    * Write data at enqueuePtr; does not increment the pointer
@@ -99,9 +139,9 @@ private:
 
   /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
    *
-   * write_index_ をインクリメントする．その結果 write_index_ がリング末尾
-   * に達したら LinkTRB を適切に配置して write_index_ を 0 に戻し，
-   * cycle bit を反転させる．
+   * write_index_ をインクリメントする．その結果 write_index_ がセグメント
+   * 末尾に達したら次のセグメントへの LinkTRB を配置して次のセグメントに移る．
+   * 最後のセグメントからは先頭に戻り，cycle bit を反転させる．
    *
    * @return 追加された（リング上の）TRB を指すポインタ．
    */
@@ -135,11 +175,22 @@ union EventRingSegmentTableEntry {
  * element in the ERST (0) is pointed to by the ERST Base Address Register
  * (ERSTBA section 5.5.2.3.2). The number of elements in the ERST is defined by
  * the ERST Size Register (ERSTSZ section 5.5.2.3.1).
+ *
+ * 6.5 Event Ring Segment Table: a segment holds 16 to 4096 TRBs; the xHC
+ * supports up to 2^ERST Max (HCSPARAMS2) segments per interrupter.
  */
 class EventRing
 {
 public:
-  Error Initialize(size_t buf_size, InterrupterRegisterSet *interrupter);
+  static const size_t kMinSegmentSize = 16;
+  static const size_t kMaxSegmentSize = 4096;
+
+  /**
+   * @brief Allocate `num_segments` segments sharing `buf_size` TRBs (rounded
+   * up to whole segments of kMinSegmentSize..kMaxSegmentSize), and register
+   * them to `interrupter`
+   */
+  Error Initialize(size_t buf_size, InterrupterRegisterSet *interrupter, size_t num_segments = 1);
 
   /**
    * TRB *getDequeuePointer()
@@ -157,8 +208,10 @@ public:
    * define the Event Ring Dequeue Pointer location to the xHC. Software
    * updates this pointer when it is finished the evaluation of an Event(s) on
    * the Event Ring.
+   *   - `clear_busy`: write 1 to the Event Handler Busy bit (RW1C), i.e. all the
+   *   pending events have been handled; the xHC may interrupt again
    */
-  void WriteDequeuePointer(TRB *p);
+  void WriteDequeuePointer(TRB *p, bool clear_busy = true);
 
   /**
    * If (EventTRB.cycle_bit == CSS);
@@ -170,18 +223,51 @@ public:
   }
 
   /**
-   * TRB *getDequeuePointer()
+   * The software copy of the dequeue pointer; ERDP itself is only written
    */
   TRB *Front() const
   {
-    return ReadDequeuePointer();
+    return dequeue_;
   }
 
+  /** @brief Advance past Front() and tell the xHC (one ERDP write) */
   void Pop();
 
+  /**
+   * Advance past Front() without telling the xHC; a batch of Advance() ends
+   * with one UpdateDequeuePointer()
+   */
+  void Advance();
+
+  /** @brief Write the dequeue pointer to ERDP, and clear Event Handler Busy */
+  void UpdateDequeuePointer();
+
+  /** @brief The total number of TRBs, all segments */
+  size_t Size() const
+  {
+    return buf_size_;
+  }
+  size_t NumSegments() const
+  {
+    return num_segments_;
+  }
+
+  /**
+   * @brief The most events handled between two UpdateDequeuePointer(); the
+   * xHC had at least as many queued, so a value near Size() means the ring is
+   * about to overflow (Event Ring Full Error)
+   */
+  size_t HighWaterMark() const
+  {
+    return high_water_mark_;
+  }
+
 private:
-  TRB *buf_;
-  size_t buf_size_;
+  /* Free the segments and the ERST, if any */
+  void FreeSegments();
+
+  size_t buf_size_ = 0;
+  size_t num_segments_ = 0;
 
   /**
    * The Event Ring Consumer Cycle State (CCS) bit;
@@ -199,7 +285,15 @@ private:
    *   that it has processed all Events in the ring.
    */
   bool cycle_bit_;
-  EventRingSegmentTableEntry *erst_;
-  InterrupterRegisterSet *interrupter_;
+  /* The next event to handle; ahead of ERDP during a batch */
+  TRB *dequeue_ = nullptr;
+  /* The ERST entry `dequeue_` is in, and the end of that segment */
+  size_t segment_ = 0;
+  TRB *segment_end_ = nullptr;
+  /* Advanced since the last UpdateDequeuePointer() */
+  size_t batch_ = 0;
+  size_t high_water_mark_ = 0;
+  EventRingSegmentTableEntry *erst_ = nullptr;
+  InterrupterRegisterSet *interrupter_ = nullptr;
 };
 } // namespace usb::xhci
@@ -319,6 +319,31 @@ union EnableSlotCommandTRB {
   }
 };
 
+union DisableSlotCommandTRB {
+  static const unsigned int Type = 10;
+  std::array<uint32_t, 4> data{};
+  struct
+  {
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t : 32;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 8;
+    uint32_t slot_id : 8;
+  } __attribute__((packed)) bits;
+
+  DisableSlotCommandTRB(uint8_t slot_id)
+  {
+    bits.trb_type = Type;
+    bits.slot_id = slot_id;
+  }
+};
+
 union AddressDeviceCommandTRB {
   static const unsigned int Type = 11;
   std::array<uint32_t, 4> data{};
@@ -546,6 +571,29 @@ union PortStatusChangeEventTRB {
   }
 };
 
+/* 6.4.2.4 Host Controller Event TRB */
+union HostControllerEventTRB {
+  static const unsigned int Type = 37;
+  std::array<uint32_t, 4> data{};
+  struct
+  {
+    uint64_t : 64;
+
+    uint32_t : 24;
+    uint32_t completion_code : 8;
+
+    uint32_t cycle_bit : 1;
+    uint32_t : 9;
+    uint32_t trb_type : 6;
+    uint32_t : 16;
+  } __attribute__((packed)) bits;
+
+  HostControllerEventTRB()
+  {
+    bits.trb_type = Type;
+  }
+};
+
 /**
  * @brief Try cast the `trb` to a more specific type.
  * Look at the `trb_type` field, if unmatch, return `nullptr`
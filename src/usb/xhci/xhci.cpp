@@ -1,6 +1,8 @@
 #include "usb/xhci/xhci.hpp"
 
 #include "logger.hpp"
+#include "timer.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/device.hpp"
 #include "usb/setupdata.hpp"
@@ -26,33 +28,99 @@ Error RegisterCommandRing(Ring *ring, MemMapRegister<CRCR_Bitmap> *crcr)
 enum class ConfigPhase
 {
   kNotConnected,
+  kEnablingSlot,
   kWaitingAddressed,
   kResettingPort,
-  kEnablingSlot,
   kAddressingDevice,
   kInitializingDevice,
   kConfiguringEndpoints,
-  kConfigured,
 };
-/* root hub port はリセット処理をしてからアドレスを割り当てるまでは
- * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
- * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
- * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+
+/**
+ * The enumeration of a device, on a root hub port or on a downstream port of
+ * a hub, concurrent with the others:
+ *   - Enable Slot is queued as soon as the device is connected; the command
+ *   ring runs the commands of every port back to back
+ *   - A USB2 port has to be reset, after which its device answers to the
+ *   default address 0 until Address Device (SET_ADDRESS) completes; only one
+ *   port holds that window at a time, the others wait in kWaitingAddressed
+ *   - A USB3 root hub port is enabled by its link training (4.3), without a
+ *   reset; a USB3 hub routes by the route string, not by the address: neither
+ *   takes the window
+ *   - Past Address Device, the ports go on independently
+ *   - The entry is freed once the endpoints are configured
  */
+struct PortState
+{
+  /* kNotConnected: a free entry */
+  volatile ConfigPhase phase;
+  uint8_t root_port;
+  uint32_t route_string;
+  /* Behind a hub: the hub's slot, the port on it, and the speed it reported; 0 on a root hub port */
+  uint8_t hub_slot_id;
+  uint8_t hub_port;
+  int speed;
+  uint8_t slot_id;
+  /* NowNanoseconds() when the enumeration started */
+  uint64_t start_ns;
+};
 
-std::array<volatile ConfigPhase, 256> port_config_phase{}; // index: port number
+std::array<PortState, 32> port_states{};
+/* The entry of a slot, from Enable Slot to the end of its enumeration */
+std::array<PortState *, 256> port_state_by_slot{};
 
-/** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
- * 0 ならその状態のポートがないことを示す．
- */
-uint8_t addressing_port{0};
+/** The port holding the address 0 window (kResettingPort or kAddressingDevice); nullptr if none */
+PortState *addressing_port{nullptr};
+
+/* The devices being enumerated, and since when (the first one started) */
+int num_enumerating{0};
+int num_enumerated{0};
+uint64_t enumeration_start_ns{0};
 
-void InitializeSlotContext(SlotContext &ctx, Port &port)
+PortState *FindPortState(uint8_t root_port, uint32_t route_string)
 {
-  ctx.bits.route_string = 0;
-  ctx.bits.root_hub_port_num = port.Number();
-  ctx.bits.context_entries = 1;
-  ctx.bits.speed = port.Speed();
+  for (auto &state : port_states)
+  {
+    if (state.phase != ConfigPhase::kNotConnected && state.root_port == root_port &&
+        state.route_string == route_string)
+    {
+      return &state;
+    }
+  }
+  return nullptr;
+}
+
+PortState *AllocPortState()
+{
+  for (auto &state : port_states)
+  {
+    if (state.phase == ConfigPhase::kNotConnected)
+    {
+      return &state;
+    }
+  }
+  return nullptr;
+}
+
+void FreePortState(PortState &state)
+{
+  if (state.slot_id != 0)
+  {
+    port_state_by_slot[state.slot_id] = nullptr;
+  }
+  state.phase = ConfigPhase::kNotConnected;
+  --num_enumerating;
+}
+
+/* The tier of a device below the root hub: the ports of its route string */
+int RouteTier(uint32_t route_string)
+{
+  int tier = 0;
+  for (; route_string != 0; route_string >>= 4)
+  {
+    ++tier;
+  }
+  return tier;
 }
 
 unsigned int DetermineMaxPacketSizeForControlPipe(unsigned int slot_speed)
@@ -93,65 +161,108 @@ void InitializeEP0Context(EndpointContext &ctx, Ring *transfer_ring, unsigned in
   ctx.bits.error_count = 3;
 }
 
-Error ResetPort(Controller &xhc, Port &port)
+/**
+ * 4.5.2 Slot Context Initialization: a LS/FS device behind a HS hub is
+ * reached through the Transaction Translator of that hub, which is the
+ * nearest HS hub upstream
+ */
+void InitializeSlotContext(Controller &xhc, SlotContext &ctx, const PortState &state)
 {
-  const bool is_connected = port.IsConnected();
-  Log(kDebug, "ResetPort: port.IsConnected() = %s\n", is_connected ? "true" : "false");
+  ctx.bits.route_string = state.route_string;
+  ctx.bits.root_hub_port_num = state.root_port;
+  ctx.bits.context_entries = 1;
+  ctx.bits.speed = state.hub_slot_id ? state.speed : xhc.PortAt(state.root_port).Speed();
 
-  if (!is_connected)
+  Device *hub = xhc.DeviceManager()->FindBySlot(state.hub_slot_id);
+  if (hub == nullptr || (ctx.bits.speed != kFullSpeed && ctx.bits.speed != kLowSpeed))
   {
-    return MAKE_ERROR(Error::kSuccess);
+    return;
   }
-
-  if (addressing_port != 0)
+  const auto &hub_ctx = hub->DeviceContext()->slot_context;
+  if (hub_ctx.bits.speed == kHighSpeed)
   {
-    port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
+    ctx.bits.tt_hub_slot_id = state.hub_slot_id;
+    ctx.bits.tt_port_num = state.hub_port;
+    ctx.bits.mtt = hub_ctx.bits.mtt;
   }
   else
   {
-    const auto port_phase = port_config_phase[port.Number()];
-    if (port_phase != ConfigPhase::kNotConnected && port_phase != ConfigPhase::kWaitingAddressed)
-    {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
-    addressing_port = port.Number();
-    port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
-    port.Reset();
+    ctx.bits.tt_hub_slot_id = hub_ctx.bits.tt_hub_slot_id;
+    ctx.bits.tt_port_num = hub_ctx.bits.tt_port_num;
+    ctx.bits.mtt = hub_ctx.bits.mtt;
   }
-  return MAKE_ERROR(Error::kSuccess);
 }
 
-Error EnableSlot(Controller &xhc, Port &port)
+/* The command callbacks of the enumeration (Controller::SubmitCommand()); `arg` is the PortState */
+Error OnSlotEnabled(Controller &xhc, const CommandCompletionEventTRB &event, void *arg);
+Error OnDeviceAddressed(Controller &xhc, const CommandCompletionEventTRB &event, void *arg);
+Error OnEndpointsConfigured(Controller &xhc, const CommandCompletionEventTRB &event, void *arg);
+
+/* Start enumerating the device at (root_port, route_string); behind the port `hub_port` of the hub `hub_slot_id` */
+Error EnableSlot(Controller &xhc, uint8_t root_port, uint32_t route_string, uint8_t hub_slot_id, uint8_t hub_port)
 {
-  const bool is_enabled = port.IsEnabled();
-  const bool reset_completed = port.IsPortResetChanged();
-  Log(kDebug, "EnableSlot: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n", is_enabled ? "true" : "false",
-      reset_completed ? "true" : "false");
+  Log(kDebug, "EnableSlot: port = %d, route = %05x\n", root_port, route_string);
 
-  if (is_enabled && reset_completed)
+  if (FindPortState(root_port, route_string))
   {
-    port.ClearPortResetChange();
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  PortState *state = AllocPortState();
+  if (state == nullptr)
+  {
+    return MAKE_ERROR(Error::kFull);
+  }
 
-    port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
+  EnableSlotCommandTRB cmd{};
+  if (auto err = xhc.SubmitCommand(cmd, OnSlotEnabled, state).error)
+  {
+    return err;
+  }
 
-    EnableSlotCommandTRB cmd{};
-    xhc.CommandRing()->Push(cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+  *state = PortState{ConfigPhase::kEnablingSlot, root_port, route_string, hub_slot_id, hub_port, 0, 0,
+                     NowNanoseconds()};
+  if (num_enumerating++ == 0)
+  {
+    enumeration_start_ns = state->start_ns;
+    num_enumerated = 0;
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error EnableSlot(Controller &xhc, Port &port)
+{
+  const bool is_connected = port.IsConnected();
+  Log(kDebug, "EnableSlot: port = %d, port.IsConnected() = %s\n", port.Number(), is_connected ? "true" : "false");
+
+  if (!is_connected)
+  {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  if (auto err = EnableSlot(xhc, port.Number(), 0, 0, 0))
+  {
+    return err;
   }
+  port.ClearConnectStatusChanged();
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error AddressDevice(Controller &xhc, uint8_t port_id, uint8_t slot_id)
+Error AddressDevice(Controller &xhc, PortState &state)
 {
-  Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  const uint8_t slot_id = state.slot_id;
+  Log(kDebug, "AddressDevice: port_id = %d, route = %05x, slot_id = %d\n", state.root_port, state.route_string,
+      slot_id);
 
-  xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
+  xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id), &xhc);
 
   Device *dev = xhc.DeviceManager()->FindBySlot(slot_id);
   if (dev == nullptr)
   {
     return MAKE_ERROR(Error::kInvalidSlotID);
   }
+  if (auto err = xhc.DeviceManager()->AssignPort(slot_id, state.root_port, state.route_string))
+  {
+    return err;
+  }
 
   memset(&dev->InputContext()->input_control_context, 0, sizeof(InputControlContext));
 
@@ -159,53 +270,254 @@ Error AddressDevice(Controller &xhc, uint8_t port_id, uint8_t slot_id)
   auto slot_ctx = dev->InputContext()->EnableSlotContext();
   auto ep0_ctx = dev->InputContext()->EnableEndpoint(ep0_dci);
 
-  auto port = xhc.PortAt(port_id);
-  InitializeSlotContext(*slot_ctx, port);
+  InitializeSlotContext(xhc, *slot_ctx, state);
 
   InitializeEP0Context(*ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
                        DetermineMaxPacketSizeForControlPipe(slot_ctx->bits.speed));
 
   xhc.DeviceManager()->LoadDCBAA(slot_id);
 
-  port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+  state.phase = ConfigPhase::kAddressingDevice;
 
   AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
-  xhc.CommandRing()->Push(addr_dev_cmd);
-  xhc.DoorbellRegisterAt(0)->Ring(0);
+  return xhc.SubmitCommand(addr_dev_cmd, OnDeviceAddressed, &state).error;
+}
 
+/* Reset the port of `state`: the root hub port itself, or through its hub's driver */
+Error ResetPort(Controller &xhc, PortState &state)
+{
+  state.phase = ConfigPhase::kResettingPort;
+  if (state.hub_slot_id == 0)
+  {
+    xhc.PortAt(state.root_port).Reset();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  Device *hub = xhc.DeviceManager()->FindBySlot(state.hub_slot_id);
+  if (hub == nullptr || hub->Hub() == nullptr)
+  {
+    return MAKE_ERROR(Error::kUnknownDevice);
+  }
+  return hub->Hub()->ResetPort(state.hub_port);
+}
+
+/* The device has a slot: take the address 0 window and reset its port, unless it needs neither */
+Error StartAddressing(Controller &xhc, PortState &state)
+{
+  bool needs_window = true;
+  if (state.hub_slot_id == 0)
+  {
+    auto port = xhc.PortAt(state.root_port);
+    if (port.IsEnabled())
+    {
+      return AddressDevice(xhc, state);
+    }
+  }
+  else if (auto hub = xhc.DeviceManager()->FindBySlot(state.hub_slot_id))
+  {
+    needs_window = hub->DeviceContext()->slot_context.bits.speed < kSuperSpeed;
+  }
+
+  if (!needs_window)
+  {
+    return ResetPort(xhc, state);
+  }
+  if (addressing_port != nullptr)
+  {
+    state.phase = ConfigPhase::kWaitingAddressed;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  addressing_port = &state;
+  return ResetPort(xhc, state);
+}
+
+/* The root hub port reset is done: the device is at address 0 */
+Error OnPortReset(Controller &xhc, Port &port, PortState &state)
+{
+  const bool is_enabled = port.IsEnabled();
+  const bool reset_completed = port.IsPortResetChanged();
+  Log(kDebug, "OnPortReset: port.IsEnabled() = %s, port.IsPortResetChanged() = %s\n", is_enabled ? "true" : "false",
+      reset_completed ? "true" : "false");
+
+  if (is_enabled && reset_completed)
+  {
+    port.ClearPortResetChange();
+    return AddressDevice(xhc, state);
+  }
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error InitializeDevice(Controller &xhc, uint8_t port_id, uint8_t slot_id)
+/* Give the address 0 window to the port that has waited the longest, if any */
+Error ReleaseAddressWindow(Controller &xhc)
+{
+  addressing_port = nullptr;
+  PortState *next = nullptr;
+  for (auto &state : port_states)
+  {
+    if (state.phase == ConfigPhase::kWaitingAddressed && (next == nullptr || state.start_ns < next->start_ns))
+    {
+      next = &state;
+    }
+  }
+  if (next == nullptr)
+  {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  addressing_port = next;
+  return ResetPort(xhc, *next);
+}
+
+Error InitializeDevice(Controller &xhc, PortState &state)
 {
-  Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Log(kDebug, "InitializeDevice: port_id = %d, route = %05x, slot_id = %d\n", state.root_port, state.route_string,
+      state.slot_id);
 
-  auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+  auto dev = xhc.DeviceManager()->FindBySlot(state.slot_id);
   if (dev == nullptr)
   {
     return MAKE_ERROR(Error::kInvalidSlotID);
   }
 
-  port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
+  state.phase = ConfigPhase::kInitializingDevice;
   dev->StartInitialize();
 
   return MAKE_ERROR(Error::kSuccess);
 }
 
-Error CompleteConfiguration(Controller &xhc, uint8_t port_id, uint8_t slot_id)
+Error CompleteConfiguration(Controller &xhc, PortState &state)
 {
-  Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Log(kDebug, "CompleteConfiguration: port_id = %d, route = %05x, slot_id = %d\n", state.root_port,
+      state.route_string, state.slot_id);
 
-  auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+  auto dev = xhc.DeviceManager()->FindBySlot(state.slot_id);
   if (dev == nullptr)
   {
     return MAKE_ERROR(Error::kInvalidSlotID);
   }
 
-  dev->OnEndpointsConfigured();
+  const uint64_t now = NowNanoseconds();
+  ++num_enumerated;
+  Log(kDebug, "port %d (route %05x) configured in %lu us\n", state.root_port, state.route_string,
+      (now - state.start_ns) / 1000);
+  FreePortState(state);
+  if (num_enumerating == 0)
+  {
+    Log(kInfo, "USB: enumerated %d devices in %lu us\n", num_enumerated, (now - enumeration_start_ns) / 1000);
+  }
+
+  /* e.g. a hub starts enumerating its ports from here */
+  return dev->OnEndpointsConfigured();
+}
 
-  port_config_phase[port_id] = ConfigPhase::kConfigured;
-  return MAKE_ERROR(Error::kSuccess);
+/* `arg`: the slot ID; the xHC no longer uses the contexts and rings of the slot */
+Error OnSlotDisabled(Controller &xhc, const CommandCompletionEventTRB &event, void *arg)
+{
+  const auto slot_id = static_cast<uint8_t>(reinterpret_cast<uintptr_t>(arg));
+  if (event.bits.completion_code != 1 /* Success */)
+  {
+    Log(kWarn, "DisableSlot: slot %d: %s\n", slot_id, kTRBCompletionCodeToName[event.bits.completion_code]);
+  }
+  return xhc.DeviceManager()->Remove(slot_id);
+}
+
+/**
+ * Give up on the device of `state` (a command failed or timed out): its slot
+ * is disabled (4.6.4) and its device removed, so that the port is enumerated
+ * again on its next connect status change
+ */
+void FailEnumeration(Controller &xhc, PortState &state)
+{
+  const uint8_t slot_id = state.slot_id;
+  const bool held_window = &state == addressing_port;
+  Log(kWarn, "USB: port %d (route %05x), slot %d: enumeration failed\n", state.root_port, state.route_string,
+      slot_id);
+  FreePortState(state);
+
+  if (slot_id != 0)
+  {
+    DisableSlotCommandTRB cmd{slot_id};
+    if (auto err = xhc.SubmitCommand(cmd, OnSlotDisabled, reinterpret_cast<void *>(uintptr_t{slot_id})).error)
+    {
+      /* No command will target the slot any more: its memory is not touched by the xHC */
+      Log(kError, "DisableSlot: slot %d: %s\n", slot_id, err.Name());
+      xhc.DeviceManager()->Remove(slot_id);
+    }
+  }
+  if (held_window)
+  {
+    if (auto err = ReleaseAddressWindow(xhc))
+    {
+      Log(kError, "ReleaseAddressWindow: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+    }
+  }
+}
+
+Error OnSlotEnabled(Controller &xhc, const CommandCompletionEventTRB &event, void *arg)
+{
+  auto state = reinterpret_cast<PortState *>(arg);
+  if (state->phase != ConfigPhase::kEnablingSlot)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  state->slot_id = event.bits.slot_id;
+  /* e.g. No Slots Available (9) */
+  if (event.bits.completion_code != 1 /* Success */ || event.bits.slot_id == 0)
+  {
+    Log(kWarn, "EnableSlot: port %d (route %05x): %s\n", state->root_port, state->route_string,
+        kTRBCompletionCodeToName[event.bits.completion_code]);
+    FailEnumeration(xhc, *state);
+    return MAKE_ERROR(Error::kCommandFailed);
+  }
+  port_state_by_slot[state->slot_id] = state;
+  return StartAddressing(xhc, *state);
+}
+
+Error OnDeviceAddressed(Controller &xhc, const CommandCompletionEventTRB &event, void *arg)
+{
+  auto state = reinterpret_cast<PortState *>(arg);
+  if (state->phase != ConfigPhase::kAddressingDevice)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+
+  if (event.bits.completion_code != 1 /* Success */)
+  {
+    Log(kWarn, "AddressDevice: slot %d: %s\n", state->slot_id, kTRBCompletionCodeToName[event.bits.completion_code]);
+    FailEnumeration(xhc, *state);
+    return MAKE_ERROR(Error::kCommandFailed);
+  }
+  if (state == addressing_port)
+  {
+    if (auto err = ReleaseAddressWindow(xhc))
+    {
+      return err;
+    }
+  }
+  return InitializeDevice(xhc, *state);
+}
+
+Error OnEndpointsConfigured(Controller &xhc, const CommandCompletionEventTRB &event, void *arg)
+{
+  auto state = reinterpret_cast<PortState *>(arg);
+  if (event.bits.completion_code != 1 /* Success */)
+  {
+    Log(kWarn, "ConfigureEndpoint: slot %d: %s\n", event.bits.slot_id,
+        kTRBCompletionCodeToName[event.bits.completion_code]);
+    if (state)
+    {
+      FailEnumeration(xhc, *state);
+    }
+    return MAKE_ERROR(Error::kCommandFailed);
+  }
+  /* The slot context of an enumerated hub (ConfigureHub()) */
+  if (state == nullptr)
+  {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+  if (state->phase != ConfigPhase::kConfiguringEndpoints)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  return CompleteConfiguration(xhc, *state);
 }
 
 Error OnEvent(Controller &xhc, PortStatusChangeEventTRB &trb)
@@ -214,12 +526,24 @@ Error OnEvent(Controller &xhc, PortStatusChangeEventTRB &trb)
   auto port_id = trb.bits.port_id;
   auto port = xhc.PortAt(port_id);
 
-  switch (port_config_phase[port_id])
+  PortState *state = FindPortState(port_id, 0);
+  if (state == nullptr)
   {
-  case ConfigPhase::kNotConnected:
-    return ResetPort(xhc, port);
-  case ConfigPhase::kResettingPort:
+    if (xhc.DeviceManager()->FindByPort(port_id, 0))
+    {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
     return EnableSlot(xhc, port);
+  }
+  switch (state->phase)
+  {
+  case ConfigPhase::kResettingPort:
+    return OnPortReset(xhc, port, *state);
+  case ConfigPhase::kEnablingSlot:
+  case ConfigPhase::kWaitingAddressed:
+  case ConfigPhase::kAddressingDevice:
+    /* e.g. the connect status change of a port configured before its event: handled at its next step */
+    return MAKE_ERROR(Error::kSuccess);
   default:
     return MAKE_ERROR(Error::kInvalidPhase);
   }
@@ -238,8 +562,8 @@ Error OnEvent(Controller &xhc, TransferEventTRB &trb)
     return err;
   }
 
-  const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-  if (dev->IsInitialized() && port_config_phase[port_id] == ConfigPhase::kInitializingDevice)
+  PortState *state = port_state_by_slot[slot_id];
+  if (state && dev->IsInitialized() && state->phase == ConfigPhase::kInitializingDevice)
   {
     return ConfigureEndpoints(xhc, *dev);
   }
@@ -248,72 +572,56 @@ Error OnEvent(Controller &xhc, TransferEventTRB &trb)
 
 Error OnEvent(Controller &xhc, CommandCompletionEventTRB &trb)
 {
-  const auto issuer_type = trb.Pointer()->bits.trb_type;
-  const auto slot_id = trb.bits.slot_id;
-  Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n", trb.bits.slot_id, kTRBTypeToName[issuer_type]);
+  return xhc.OnCommandCompleted(trb);
+}
+
+/* e.g. the Event Ring Full Error (21): events were lost */
+Error OnEvent(Controller &xhc, HostControllerEventTRB &trb)
+{
+  Log(kWarn, "HostControllerEvent: completion code %u\n", trb.bits.completion_code);
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-  if (issuer_type == EnableSlotCommandTRB::Type)
+/* Counted (DispatchEvent()), and reported the first time */
+Error OnUnhandledEvent(Controller &xhc, TRB &trb)
+{
+  if (xhc.EventCount(trb.bits.trb_type) == 1)
   {
-    if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot)
-    {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
-
-    return AddressDevice(xhc, addressing_port, slot_id);
+    Log(kWarn, "unhandled event: %s (%u)\n", kTRBTypeToName[trb.bits.trb_type], trb.bits.trb_type);
   }
-  else if (issuer_type == AddressDeviceCommandTRB::Type)
-  {
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr)
-    {
-      return MAKE_ERROR(Error::kInvalidSlotID);
-    }
+  return MAKE_ERROR(Error::kSuccess);
+}
 
-    auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
+template <class EventTRBType> Error OnEventOfType(Controller &xhc, TRB &trb)
+{
+  return OnEvent(xhc, reinterpret_cast<EventTRBType &>(trb));
+}
 
-    if (port_id != addressing_port)
-    {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
-    if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice)
-    {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
+using EventHandler = Error (*)(Controller &xhc, TRB &trb);
 
-    addressing_port = 0;
-    for (uint64_t i = 0; i < port_config_phase.size(); ++i)
-    {
-      if (port_config_phase[i] == ConfigPhase::kWaitingAddressed)
-      {
-        auto port = xhc.PortAt(i);
-        if (auto err = ResetPort(xhc, port); err)
-        {
-          return err;
-        }
-        break;
-      }
-    }
-
-    return InitializeDevice(xhc, port_id, slot_id);
-  }
-  else if (issuer_type == ConfigureEndpointCommandTRB::Type)
+/* Indexed by the TRB Type, which is 6 bits */
+constexpr std::array<EventHandler, 64> MakeEventHandlers()
+{
+  std::array<EventHandler, 64> handlers{};
+  for (auto &handler : handlers)
   {
-    auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
-    if (dev == nullptr)
-    {
-      return MAKE_ERROR(Error::kInvalidSlotID);
-    }
-
-    auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-    if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints)
-    {
-      return MAKE_ERROR(Error::kInvalidPhase);
-    }
-
-    return CompleteConfiguration(xhc, port_id, slot_id);
+    handler = OnUnhandledEvent;
   }
+  handlers[TransferEventTRB::Type] = OnEventOfType<TransferEventTRB>;
+  handlers[CommandCompletionEventTRB::Type] = OnEventOfType<CommandCompletionEventTRB>;
+  handlers[PortStatusChangeEventTRB::Type] = OnEventOfType<PortStatusChangeEventTRB>;
+  handlers[HostControllerEventTRB::Type] = OnEventOfType<HostControllerEventTRB>;
+  return handlers;
+}
+
+constexpr std::array<EventHandler, 64> kEventHandlers = MakeEventHandlers();
 
-  return MAKE_ERROR(Error::kInvalidPhase);
+/* Handle one event TRB; the caller advances the event ring */
+Error DispatchEvent(Controller &xhc, TRB *event_trb)
+{
+  const unsigned int type = event_trb->bits.trb_type;
+  xhc.CountEvent(type);
+  return kEventHandlers[type](xhc, *event_trb);
 }
 
 void RequestHCOwnership(uintptr_t mmio_base, HCCPARAMS1_Bitmap hccp)
@@ -428,7 +736,6 @@ Error Controller::Initialize()
   dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
   op_->DCBAAP.Write(dcbaap);
 
-  auto primary_interrupter = &InterrupterRegisterSets()[0];
   if (auto err = cr_.Initialize(32))
   {
     return err;
@@ -437,16 +744,39 @@ Error Controller::Initialize()
   {
     return err;
   }
-  if (auto err = er_.Initialize(32, primary_interrupter))
+
+  const size_t max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+  if (num_interrupters_ > kMaxInterrupters)
   {
-    return err;
+    num_interrupters_ = kMaxInterrupters;
   }
+  if (num_interrupters_ > max_interrupters)
+  {
+    num_interrupters_ = max_interrupters;
+  }
+  const size_t max_segments = size_t{1} << cap_->HCSPARAMS2.Read().bits.event_ring_segment_table_max;
+  const size_t segments = event_ring_segments_ < max_segments ? event_ring_segments_ : max_segments;
+  for (size_t i = 0; i < num_interrupters_; ++i)
+  {
+    auto interrupter = &InterrupterRegisterSets()[i];
+    if (auto err = er_[i].Initialize(event_ring_trbs_, interrupter, segments))
+    {
+      return err;
+    }
 
-  // Enable interrupt for the primary interrupter
-  auto iman = primary_interrupter->IMAN.Read();
-  iman.bits.interrupt_pending = true;
-  iman.bits.interrupt_enable = true;
-  primary_interrupter->IMAN.Write(iman);
+    irq_[i] = InterrupterState{};
+    irq_[i].window_start_ns = NowNanoseconds();
+    SetInterruptModeration(i, kAdaptiveMinInterval);
+    irq_[i].stats.adaptive = true;
+
+    // Enable interrupt for the interrupter
+    auto iman = interrupter->IMAN.Read();
+    iman.bits.interrupt_pending = true;
+    iman.bits.interrupt_enable = true;
+    interrupter->IMAN.Write(iman);
+  }
+  Log(kDebug, "event rings: %lu x %lu TRBs in %lu segments\n", num_interrupters_, er_[0].Size(),
+      er_[0].NumSegments());
 
   // Enable interrupt for the controller
   usbcmd = op_->USBCMD.Read();
@@ -473,20 +803,295 @@ Error Controller::Run()
   return MAKE_ERROR(Error::kSuccess);
 }
 
+void Controller::SetInterruptModeration(size_t index, uint16_t interval)
+{
+  auto &imod_reg = InterrupterRegisterSets()[index].IMOD;
+  auto imod = imod_reg.Read();
+  imod.bits.interrupt_moderation_interval = interval;
+  /* The counter counts down from the interval after each interrupt; restart it */
+  imod.bits.interrupt_moderation_counter = 0;
+  imod_reg.Write(imod);
+  irq_[index].stats.moderation_interval = interval;
+  irq_[index].stats.adaptive = false;
+}
+
+void Controller::SetAdaptiveModeration(size_t index, bool adaptive)
+{
+  irq_[index].stats.adaptive = adaptive;
+}
+
+void Controller::OnEventsHandled(size_t index, size_t n)
+{
+  auto &irq = irq_[index];
+  irq.stats.events += n;
+
+  const uint64_t now = NowNanoseconds();
+  const uint64_t elapsed = now - irq.window_start_ns;
+  if (elapsed < kAdaptiveWindowNs)
+  {
+    return;
+  }
+  const uint64_t interrupts = irq.stats.interrupts - irq.window_interrupts;
+  const uint64_t events = irq.stats.events - irq.window_events;
+  irq.stats.interrupts_per_sec = interrupts * 1000000000 / elapsed;
+  irq.stats.events_per_sec = events * 1000000000 / elapsed;
+  irq.window_start_ns = now;
+  irq.window_interrupts = irq.stats.interrupts;
+  irq.window_events = irq.stats.events;
+  if (!irq.stats.adaptive)
+  {
+    return;
+  }
+
+  uint32_t interval = irq.stats.moderation_interval;
+  if (elapsed >= 2 * kAdaptiveWindowNs)
+  {
+    /* Idle for a window or more: the first events of a new burst get the lowest latency */
+    interval = kAdaptiveMinInterval;
+  }
+  else if (irq.stats.interrupts_per_sec > kAdaptiveHighIRQRate)
+  {
+    interval = interval * 2 < kAdaptiveMaxInterval ? interval * 2 : kAdaptiveMaxInterval;
+  }
+  else if (irq.stats.events_per_sec < kAdaptiveLowEventRate)
+  {
+    interval = interval / 2 > kAdaptiveMinInterval ? interval / 2 : kAdaptiveMinInterval;
+  }
+  if (interval != irq.stats.moderation_interval)
+  {
+    SetInterruptModeration(index, interval);
+    irq.stats.adaptive = true;
+  }
+}
+
+Controller::InterrupterStats Controller::Stats(size_t index) const
+{
+  return irq_[index].stats;
+}
+
 DoorbellRegister *Controller::DoorbellRegisterAt(uint8_t index)
 {
   return &DoorbellRegisters()[index];
 }
 
+bool Controller::CommandPending(uint64_t token) const
+{
+  for (const auto &cmd : commands_)
+  {
+    if (cmd.token == token && token != 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t Controller::TrackCommand(const TRB *trb, CommandCallback *callback, void *arg, uint64_t timeout_ns)
+{
+  PendingCommand *entry = nullptr;
+  for (auto &cmd : commands_)
+  {
+    if (cmd.token == 0)
+    {
+      entry = &cmd;
+      break;
+    }
+  }
+  /* SubmitCommand() has checked num_commands_ */
+  const uint64_t token = next_command_token_++;
+  *entry = PendingCommand{token, trb, callback, arg, NowNanoseconds() + timeout_ns};
+  ++num_commands_;
+
+  DoorbellRegisterAt(0)->Ring(0);
+  ArmCommandTimer();
+  return token;
+}
+
+Error Controller::OnCommandCompleted(const CommandCompletionEventTRB &event)
+{
+  const int code = event.bits.completion_code;
+  Log(kDebug, "CommandCompletionEvent: slot_id = %d, code = %d, issuer = %s\n", event.bits.slot_id, code,
+      kTRBTypeToName[event.Pointer()->bits.trb_type]);
+
+  /* 4.6.1.2 The ring has stopped at this TRB after an abort: it has not been executed */
+  if (code == 24 /* Command Ring Stopped */)
+  {
+    aborting_commands_ = false;
+    if (num_commands_ > 0)
+    {
+      DoorbellRegisterAt(0)->Ring(0);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  cr_.OnConsumed(event.Pointer());
+  for (auto &cmd : commands_)
+  {
+    if (cmd.token != 0 && cmd.trb == event.Pointer())
+    {
+      const PendingCommand done = cmd;
+      cmd.token = 0;
+      --num_commands_;
+      ArmCommandTimer();
+      return done.callback ? done.callback(*this, event, done.arg) : MAKE_ERROR(Error::kSuccess);
+    }
+  }
+  /* e.g. one failed by OnCommandTimer() before the xHC got to it; a slot it has enabled is not used */
+  if (event.Pointer()->bits.trb_type == EnableSlotCommandTRB::Type && event.bits.completion_code == 1 /* Success */ &&
+      event.bits.slot_id != 0)
+  {
+    DisableSlotCommandTRB cmd{static_cast<uint8_t>(event.bits.slot_id)};
+    return SubmitCommand(cmd, OnSlotDisabled, reinterpret_cast<void *>(uintptr_t{event.bits.slot_id})).error;
+  }
+  return MAKE_ERROR(Error::kNoWaiter);
+}
+
+void Controller::ArmCommandTimer()
+{
+  uint64_t deadline = 0;
+  for (const auto &cmd : commands_)
+  {
+    if (cmd.token != 0 && (deadline == 0 || cmd.deadline_ns < deadline))
+    {
+      deadline = cmd.deadline_ns;
+    }
+  }
+  /* A timer firing early only re-arms itself: keep it rather than Cancel() and Add() per command */
+  if (deadline == 0 || (command_timer_ != 0 && command_timer_deadline_ <= deadline))
+  {
+    return;
+  }
+  if (command_timer_ != 0)
+  {
+    timer_manager->Cancel(command_timer_);
+    command_timer_ = 0;
+  }
+  auto [id, err] = timer_manager->Add(deadline, 0, OnCommandTimer, this);
+  if (err)
+  {
+    Log(kWarn, "xhc: no timer for the command timeouts: %s\n", err.Name());
+    return;
+  }
+  command_timer_ = id;
+  command_timer_deadline_ = deadline;
+}
+
+void Controller::OnCommandTimer(uint64_t now_ns, void *arg)
+{
+  auto xhc = reinterpret_cast<Controller *>(arg);
+  xhc->command_timer_ = 0;
+  xhc->CheckCommandDeadlines(now_ns);
+  xhc->ArmCommandTimer();
+}
+
+void Controller::CheckCommandDeadlines(uint64_t now_ns)
+{
+  PendingCommand *oldest = nullptr;
+  for (auto &cmd : commands_)
+  {
+    if (cmd.token != 0 && (oldest == nullptr || cmd.deadline_ns < oldest->deadline_ns))
+    {
+      oldest = &cmd;
+    }
+  }
+  if (oldest == nullptr || oldest->deadline_ns > now_ns)
+  {
+    return;
+  }
+
+  if (!aborting_commands_)
+  {
+    /* 4.6.1.2 The command being executed completes as Command Aborted, then the ring stops */
+    Log(kWarn, "xhc: %s timed out, aborting the command ring\n", kTRBTypeToName[oldest->trb->bits.trb_type]);
+    aborting_commands_ = true;
+    oldest->deadline_ns = now_ns + kCommandAbortTimeoutNs;
+    auto crcr = op_->CRCR.Read();
+    crcr.bits.command_abort = 1;
+    op_->CRCR.Write(crcr);
+    return;
+  }
+
+  /* The xHC has not stopped the ring either: give up on every command in flight */
+  Log(kError, "xhc: the command ring did not stop, failing %lu commands\n", num_commands_);
+  aborting_commands_ = false;
+  for (auto &cmd : commands_)
+  {
+    if (cmd.token == 0)
+    {
+      continue;
+    }
+    const PendingCommand done = cmd;
+    cmd.token = 0;
+    --num_commands_;
+
+    CommandCompletionEventTRB event{};
+    event.SetPointer(const_cast<TRB *>(done.trb));
+    event.bits.completion_code = 25 /* Command Aborted */;
+    /* The Slot ID field of the command TRBs; 0 in Enable Slot */
+    event.bits.slot_id = done.trb->data[3] >> 24;
+    if (done.callback)
+    {
+      if (auto err = done.callback(*this, event, done.arg))
+      {
+        Log(kError, "xhc: command callback: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+      }
+    }
+  }
+}
+
 Error ConfigurePort(Controller &xhc, Port &port)
 {
-  if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected)
+  if (FindPortState(port.Number(), 0) == nullptr && xhc.DeviceManager()->FindByPort(port.Number(), 0) == nullptr)
   {
-    return ResetPort(xhc, port);
+    return EnableSlot(xhc, port);
   }
   return MAKE_ERROR(Error::kSuccess);
 }
 
+Error ConfigureHub(Controller &xhc, Device &hub, int num_ports, int think_time, bool multi_tt)
+{
+  memset(&hub.InputContext()->input_control_context, 0, sizeof(InputControlContext));
+  memcpy(&hub.InputContext()->slot_context, &hub.DeviceContext()->slot_context, sizeof(SlotContext));
+
+  /* 4.6.6 Configure Endpoint with the Slot Context only: the endpoints are kept */
+  auto slot_ctx = hub.InputContext()->EnableSlotContext();
+  slot_ctx->bits.hub = 1;
+  slot_ctx->bits.num_ports = num_ports;
+  /* The TT of a HS hub only */
+  slot_ctx->bits.ttt = slot_ctx->bits.speed == kHighSpeed ? think_time : 0;
+  slot_ctx->bits.mtt = multi_tt;
+
+  ConfigureEndpointCommandTRB cmd{hub.InputContext(), hub.SlotID()};
+  return xhc.SubmitCommand(cmd, OnEndpointsConfigured, nullptr).error;
+}
+
+Error ConfigureHubPort(Controller &xhc, Device &hub, int port)
+{
+  const auto &hub_ctx = hub.DeviceContext()->slot_context;
+  const int tier = RouteTier(hub_ctx.bits.route_string);
+  /* A route string has 5 tiers of 4 bits */
+  if (tier >= 5 || port < 1 || port > 15)
+  {
+    return MAKE_ERROR(Error::kIndexOutOfRange);
+  }
+  return EnableSlot(xhc, hub_ctx.bits.root_hub_port_num, hub_ctx.bits.route_string | port << (4 * tier),
+                    hub.SlotID(), port);
+}
+
+Error OnHubPortReset(Controller &xhc, Device &hub, int port, int speed)
+{
+  const auto &hub_ctx = hub.DeviceContext()->slot_context;
+  const int tier = RouteTier(hub_ctx.bits.route_string);
+  PortState *state =
+      FindPortState(hub_ctx.bits.root_hub_port_num, hub_ctx.bits.route_string | port << (4 * tier));
+  if (state == nullptr || state->phase != ConfigPhase::kResettingPort)
+  {
+    return MAKE_ERROR(Error::kInvalidPhase);
+  }
+  state->speed = speed;
+  return AddressDevice(xhc, *state);
+}
+
 Error ConfigureEndpoints(Controller &xhc, Device &dev)
 {
   const auto configs = dev.EndpointConfigs();
@@ -497,8 +1102,8 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev)
 
   auto slot_ctx = dev.InputContext()->EnableSlotContext();
   slot_ctx->bits.context_entries = 31;
-  const auto port_id{dev.DeviceContext()->slot_context.bits.root_hub_port_num};
-  const int port_speed{xhc.PortAt(port_id).Speed()};
+  /* The speed of the device, which is not the root hub port's behind a hub */
+  const int port_speed{dev.DeviceContext()->slot_context.bits.speed};
   if (port_speed == 0 || port_speed > kSuperSpeedPlus)
   {
     return MAKE_ERROR(Error::kUnknownXHCISpeedID);
@@ -534,10 +1139,14 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev)
       break;
     }
     ep_ctx->bits.max_packet_size = configs[i].max_packet_size;
-    ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
-    ep_ctx->bits.average_trb_length = 1;
-
-    auto tr = dev.AllocTransferRing(ep_dci, 32);
+    const bool is_bulk = configs[i].ep_type == EndpointType::kBulk;
+    /* Bulk endpoints are not periodic: Interval is 0; 4.14.1.1 suggests 3K as their Average TRB Length */
+    ep_ctx->bits.interval = is_bulk ? 0 : convert_interval(configs[i].ep_type, configs[i].interval);
+    ep_ctx->bits.average_trb_length = is_bulk ? 3072 : 1;
+
+    dev.SetInterrupterTarget(ep_dci, xhc.InterrupterFor(configs[i].ep_type));
+    /* A bulk TD takes a TRB per 64 KiB, and several are queued at once */
+    auto tr = dev.AllocTransferRing(ep_dci, is_bulk ? 256 : 32);
     ep_ctx->SetTransferRingBuffer(tr->Buffer());
 
     ep_ctx->bits.dequeue_cycle_state = 1;
@@ -546,13 +1155,14 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev)
     ep_ctx->bits.error_count = 3;
   }
 
-  port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+  PortState *state = port_state_by_slot[dev.SlotID()];
+  if (state)
+  {
+    state->phase = ConfigPhase::kConfiguringEndpoints;
+  }
 
   ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
-  xhc.CommandRing()->Push(cmd);
-  xhc.DoorbellRegisterAt(0)->Ring(0);
-
-  return MAKE_ERROR(Error::kSuccess);
+  return xhc.SubmitCommand(cmd, OnEndpointsConfigured, state).error;
 }
 
 Error __attribute__((no_caller_saved_registers)) ProcessEvent(Controller &xhc)
@@ -562,25 +1172,40 @@ Error __attribute__((no_caller_saved_registers)) ProcessEvent(Controller &xhc)
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error err = MAKE_ERROR(Error::kNotImplemented);
-  TRB *event_trb = xhc.PrimaryEventRing()->Front();
-  // volatile TRB *debug_event_trb = event_trb;
-  //(void)debug_event_trb;
-  // debug_break();
-  if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb))
-  {
-    err = OnEvent(xhc, *trb);
-  }
-  else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb))
+  Error err = DispatchEvent(xhc, xhc.PrimaryEventRing()->Front());
+  xhc.PrimaryEventRing()->Pop();
+
+  return err;
+}
+
+size_t ProcessEvents(Controller &xhc, size_t interrupter)
+{
+  EventRing *er = xhc.EventRingAt(interrupter);
+  /* Let the xHC reuse the handled half while a long burst is still being drained; at least every TRB */
+  const size_t flush_interval = er->Size() / 2 > 0 ? er->Size() / 2 : 1;
+  size_t handled = 0;
+  while (er->HasFront())
   {
-    err = OnEvent(xhc, *trb);
+    if (auto err = DispatchEvent(xhc, er->Front()))
+    {
+      Log(kError, "Error while ProcessEvent: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+    }
+    er->Advance();
+    if (++handled % flush_interval == 0)
+    {
+      er->WriteDequeuePointer(er->Front(), false);
+    }
   }
-  else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb))
+  xhc.OnEventsHandled(interrupter, handled);
+  if (handled > 0)
   {
-    err = OnEvent(xhc, *trb);
+    const size_t high_water_mark = er->HighWaterMark();
+    er->UpdateDequeuePointer();
+    if (er->HighWaterMark() > high_water_mark && er->HighWaterMark() * 4 > er->Size() * 3)
+    {
+      Log(kWarn, "event ring %lu: %lu of %lu TRBs in one drain\n", interrupter, er->HighWaterMark(), er->Size());
+    }
   }
-  xhc.PrimaryEventRing()->Pop();
-
-  return err;
+  return handled;
 }
 } // namespace usb::xhci
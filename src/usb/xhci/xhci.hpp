@@ -6,6 +6,8 @@
 
 #pragma once
 
+#include <array>
+
 #include "error.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/devmgr.hpp"
@@ -19,19 +21,146 @@ class Controller
 {
 public:
   Controller(uintptr_t mmio_base);
+  /**
+   * @brief The size of the primary event ring, `trbs` in total over
+   * `segments`; before Initialize(). The segments are capped to what the
+   * xHC supports (HCSPARAMS2 ERST Max)
+   */
+  void SetEventRingSize(size_t trbs, size_t segments)
+  {
+    event_ring_trbs_ = trbs;
+    event_ring_segments_ = segments;
+  }
   Error Initialize();
   Error Run();
   Ring *CommandRing()
   {
     return &cr_;
   }
+
+  /* Commands that do not complete in 5 s are aborted */
+  static const uint64_t kCommandTimeoutNs = 5000000000;
+  static const size_t kMaxCommands = 32;
+
+  /**
+   * @brief Called with the Command Completion Event of a command (its
+   * Completion Code, Slot ID); Command Aborted (25) if it timed out
+   */
+  using CommandCallback = Error(Controller &xhc, const CommandCompletionEventTRB &event, void *arg);
+
+  /**
+   * @brief Queue `cmd` on the command ring and ring the doorbell
+   *
+   * The completion event is matched to the command by its TRB pointer, and
+   * `callback(xhc, event, arg)` is called from it (if not nullptr): up to
+   * kMaxCommands commands may be in flight. A command not completed within
+   * `timeout_ns` (on the NowNanoseconds() clock) has the command ring
+   * aborted (4.6.1.2), which completes it as Command Aborted.
+   *
+   * @return a token for CommandPending() (never 0), or Error::kFull
+   */
+  template <class CommandTRB>
+  WithError<uint64_t> SubmitCommand(const CommandTRB &cmd, CommandCallback *callback, void *arg,
+                                    uint64_t timeout_ns = kCommandTimeoutNs)
+  {
+    if (num_commands_ == commands_.size())
+    {
+      return {0, MAKE_ERROR(Error::kFull)};
+    }
+    TRB *trb = cr_.Push(cmd);
+    if (trb == nullptr)
+    {
+      return {0, MAKE_ERROR(Error::kFull)};
+    }
+    return {TrackCommand(trb, callback, arg, timeout_ns), MAKE_ERROR(Error::kSuccess)};
+  }
+  /** @brief Whether the command of `token` (from SubmitCommand()) has not completed yet */
+  bool CommandPending(uint64_t token) const;
+  /** @brief Complete the command `event` is for; from the Command Completion Event handler */
+  Error OnCommandCompleted(const CommandCompletionEventTRB &event);
   /**
    * EventRing *getEventRing()
    */
   EventRing *PrimaryEventRing()
   {
-    return &er_;
+    return &er_[0];
   }
+  /** @brief The event ring of interrupter `index` (< NumInterrupters()) */
+  EventRing *EventRingAt(size_t index)
+  {
+    return &er_[index];
+  }
+  size_t NumInterrupters() const
+  {
+    return num_interrupters_;
+  }
+  /**
+   * @brief Use `n` interrupters, each with its own event ring (and MSI-X
+   * vector n); before Initialize(). Capped to kMaxInterrupters and to what
+   * the xHC supports (HCSPARAMS1 MaxIntrs)
+   */
+  void SetNumInterrupters(size_t n)
+  {
+    num_interrupters_ = n;
+  }
+  /**
+   * @brief The interrupter that receives the transfer events of `type`
+   * endpoints: the bulk and isochronous traffic goes to interrupter 1 (if
+   * any), so that it does not delay the HID events; the command completion
+   * and port status change events always go to the primary one
+   */
+  uint8_t InterrupterFor(EndpointType type) const
+  {
+    if (num_interrupters_ > 1 && (type == EndpointType::kBulk || type == EndpointType::kIsochronous))
+    {
+      return 1;
+    }
+    return 0;
+  }
+  /**
+   * 4.17.2 Interrupt Moderation: an interrupter raises at most one interrupt
+   * per IMODI x 250ns; the events in between are handled by the same one
+   */
+  struct InterrupterStats
+  {
+    uint64_t interrupts;
+    uint64_t events;
+    /* Over the last adaptation window */
+    uint64_t interrupts_per_sec;
+    uint64_t events_per_sec;
+    /* IMODI, in 250ns */
+    uint16_t moderation_interval;
+    bool adaptive;
+  };
+
+  /** @brief Moderate interrupter `index` to at most one interrupt per `interval` x 250ns (0: none); not adaptive */
+  void SetInterruptModeration(size_t index, uint16_t interval);
+  /**
+   * @brief Let the interval of interrupter `index` follow the load: doubled
+   * while the interrupt rate is above kAdaptiveHighIRQRate, halved while the
+   * event rate is below kAdaptiveLowEventRate, within
+   * [kAdaptiveMinInterval, kAdaptiveMaxInterval]
+   */
+  void SetAdaptiveModeration(size_t index, bool adaptive);
+  /** @brief From the interrupt handler of interrupter `index` */
+  void OnInterrupt(size_t index)
+  {
+    ++irq_[index].stats.interrupts;
+  }
+  /** @brief `n` events of interrupter `index` handled; adapts its moderation, see SetAdaptiveModeration() */
+  void OnEventsHandled(size_t index, size_t n);
+  InterrupterStats Stats(size_t index) const;
+  /** @brief Called for every event TRB dispatched, with its TRB Type */
+  void CountEvent(unsigned int trb_type)
+  {
+    ++event_counts_[trb_type];
+  }
+  /** @brief Events of TRB Type `trb_type` dispatched so far, the unhandled ones included */
+  uint64_t EventCount(unsigned int trb_type) const
+  {
+    return event_counts_[trb_type];
+  }
+
   DoorbellRegister *DoorbellRegisterAt(uint8_t index);
   Port PortAt(uint8_t port_num)
   {
@@ -48,6 +177,36 @@ public:
 
 private:
   static const size_t kDeviceSize = 8;
+  static const size_t kMaxInterrupters = 4;
+  /* 10us .. 1ms (the reset default); 250ns units */
+  static const uint16_t kAdaptiveMinInterval = 40;
+  static const uint16_t kAdaptiveMaxInterval = 4000;
+  static const uint64_t kAdaptiveHighIRQRate = 8000;
+  static const uint64_t kAdaptiveLowEventRate = 1000;
+  static const uint64_t kAdaptiveWindowNs = 100000000;
+
+  struct InterrupterState
+  {
+    InterrupterStats stats;
+    uint64_t window_start_ns;
+    uint64_t window_interrupts;
+    uint64_t window_events;
+  };
+  /* A command in flight; token 0: a free entry */
+  struct PendingCommand
+  {
+    uint64_t token;
+    const TRB *trb;
+    CommandCallback *callback;
+    void *arg;
+    uint64_t deadline_ns;
+  };
+  /* How long the xHC may take to stop the command ring once asked to abort */
+  static const uint64_t kCommandAbortTimeoutNs = 1000000000;
+
+  /* 32 TRBs overflow when several devices are busy */
+  static const size_t kDefaultEventRingTRBs = 256;
+  static const size_t kDefaultEventRingSegments = 4;
 
   /* The declaration/initialization order matters in instantiation */
   const uintptr_t mmio_base_;
@@ -62,7 +221,30 @@ private:
 
   class DeviceManager devmgr_;
   Ring cr_;
-  EventRing er_;
+  /* er_[i] is the event ring of interrupter i */
+  std::array<EventRing, kMaxInterrupters> er_;
+  size_t num_interrupters_ = 1;
+  std::array<InterrupterState, kMaxInterrupters> irq_{};
+  /* Indexed by the TRB Type */
+  std::array<uint64_t, 64> event_counts_{};
+  size_t event_ring_trbs_ = kDefaultEventRingTRBs;
+  size_t event_ring_segments_ = kDefaultEventRingSegments;
+
+  std::array<PendingCommand, kMaxCommands> commands_{};
+  size_t num_commands_ = 0;
+  uint64_t next_command_token_ = 1;
+  /* The TimerManager timer checking the deadlines, and when it fires; 0 if none */
+  uint64_t command_timer_ = 0;
+  uint64_t command_timer_deadline_ = 0;
+  /* CRCR.CA is written, and the Command Ring Stopped event not received yet */
+  bool aborting_commands_ = false;
+
+  /* Record a command pushed at `trb`, and ring the doorbell; returns its token */
+  uint64_t TrackCommand(const TRB *trb, CommandCallback *callback, void *arg, uint64_t timeout_ns);
+  /* Make the timer fire at the earliest deadline of the commands in flight */
+  void ArmCommandTimer();
+  static void OnCommandTimer(uint64_t now_ns, void *arg);
+  void CheckCommandDeadlines(uint64_t now_ns);
 
   InterrupterRegisterSetArray InterrupterRegisterSets() const
   {
@@ -80,8 +262,22 @@ private:
   }
 };
 
+/**
+ * @brief Start enumerating `port`, if connected and not yet; returns at once,
+ * so that the ports are enumerated concurrently (see PortState in xhci.cpp)
+ */
 Error ConfigurePort(Controller &xhc, Port &port);
 Error ConfigureEndpoints(Controller &xhc, Device &dev);
+/** @brief Tell the xHC that `hub` is a hub (its Slot Context: Hub, Number of Ports, TTT, MTT) */
+Error ConfigureHub(Controller &xhc, Device &hub, int num_ports, int think_time, bool multi_tt);
+/**
+ * @brief Start enumerating the device connected to downstream `port` of
+ * `hub`, like ConfigurePort(); the hub driver is asked to reset the port
+ * (HubDriver::ResetPort()) when its turn comes
+ */
+Error ConfigureHubPort(Controller &xhc, Device &hub, int port);
+/** @brief The reset of downstream `port` of `hub` is done; its device runs at `speed` (a Protocol Speed ID) */
+Error OnHubPortReset(Controller &xhc, Device &hub, int port, int speed);
 
 /** @brief イベントリングに登録されたイベントを高々1つ処理する．
  *
@@ -91,4 +287,13 @@ Error ConfigureEndpoints(Controller &xhc, Device &dev);
  * @return イベントを正常に処理できたら Error::kSuccess
  */
 Error __attribute__((no_caller_saved_registers)) ProcessEvent(Controller &xhc);
+
+/**
+ * @brief Handle every pending event of the event ring of `interrupter`
+ *
+ * ERDP is written once at the end (clearing Event Handler Busy), rather than
+ * once per event; the errors of the handlers are logged. Returns the number
+ * of events handled.
+ */
+size_t ProcessEvents(Controller &xhc, size_t interrupter = 0);
 } // namespace usb::xhci
@@ -7,21 +7,101 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Word sized accessors for the mem* and str* routines.
+ * `kword_t` is the native word (4 bytes in 32bit, 8 bytes in 64bit);
+ * `kword_unaligned_t` may be read from any address (x86 allows it), the
+ * `may_alias` keeps the compiler from assuming the underlying type.
+ */
+typedef uintptr_t __attribute__((__may_alias__)) kword_t;
+typedef uintptr_t __attribute__((__may_alias__, __aligned__(1)))
+kword_unaligned_t;
+#define KWORD_SIZE sizeof(kword_t)
+/* Below this size, aligning the head costs more than it saves */
+#define KUTIL_WORD_THRESHOLD (KWORD_SIZE * 4)
+/* 0x01 in every byte */
+#define KWORD_LOWS ((kword_t)-1 / 0xff)
+/* 0x80 in every byte */
+#define KWORD_HIGHS (KWORD_LOWS * 0x80)
+/*
+ * Non-zero if any byte of `w` is 0x00. The lowest 0x80 marks the first zero
+ * byte (little endian); bits above it may be false positives.
+ */
+#define KWORD_HAS_ZERO(w) (((w) - KWORD_LOWS) & ~(w) & KWORD_HIGHS)
+
+/*
+ * Index of the first zero byte in a word, `haszero` is KWORD_HAS_ZERO(w) != 0
+ */
+static inline size_t __kword_first_zero(kword_t haszero) {
+  return (size_t)__builtin_ctzl((unsigned long)haszero) / 8;
+}
+
+/*
+ * Load the aligned word that contains `p`, with the bytes before `p` forced
+ * to 0xff (non-zero).
+ * An aligned word never crosses a page boundary, so reading the whole word
+ * cannot fault even if the string ends (or the page ends) within it.
+ */
+static inline kword_t __kword_load_head(const char *p, const kword_t **w) {
+  const uintptr_t mis = (uintptr_t)p & (KWORD_SIZE - 1);
+  *w = (const kword_t *)((uintptr_t)p - mis);
+  if (!mis)
+    return **w;
+  return **w | (((kword_t)1 << (mis * 8)) - 1);
+}
+
+/*
+ * Copy src (including the '\0') to dest
+ * Return the pointer to the '\0' in dest
+ */
 void *kstrcpy(char *dest, const char *src) {
-  while (*src) {
-    *dest++ = *src++;
-  }
-  *dest = '\0';
-  return dest;
+  const size_t len = kstrlen(src);
+  kmemcpy(dest, src, len + 1);
+  return dest + len;
+}
+
+/*
+ * Copy at most `size - 1` bytes of src to dest, always '\0' terminated
+ * (if size > 0)
+ * Return the number of bytes copied, excluding the '\0', i.e.,
+ * kstrlen(dest); the caller does not need to recompute it.
+ */
+size_t kstrlcpy(char *dest, const char *src, size_t size) {
+  if (size == 0)
+    return 0;
+  const size_t len = kstrnlen(src, size - 1);
+  kmemcpy(dest, src, len);
+  dest[len] = '\0';
+  return len;
 }
 
 /**
  * Compare S1 and S2, returning less than, equal to or greater than zero if S1
  * is lexicographically less than, equal to or greater than S2.
+ *
+ * When S1 and S2 share the same misalignment, compare a word at a time once
+ * both are aligned; otherwise one of the two word reads would be unaligned
+ * and may cross into an unmapped page, so compare byte by byte.
  */
 int32_t kstrcmp(const unsigned char *p1, const unsigned char *p2) {
   const unsigned char *s1 = (const unsigned char *)p1;
   const unsigned char *s2 = (const unsigned char *)p2;
+  if ((((uintptr_t)s1 ^ (uintptr_t)s2) & (KWORD_SIZE - 1)) == 0) {
+    while ((uintptr_t)s1 & (KWORD_SIZE - 1)) {
+      if (!*s1 || *s1 != *s2)
+        return *s1 - *s2;
+      s1++;
+      s2++;
+    }
+    const kword_t *w1 = (const kword_t *)s1;
+    const kword_t *w2 = (const kword_t *)s2;
+    while (*w1 == *w2 && !KWORD_HAS_ZERO(*w1)) {
+      w1++;
+      w2++;
+    }
+    s1 = (const unsigned char *)w1;
+    s2 = (const unsigned char *)w2;
+  }
   while (*s1 && (*s1 == *s2)) {
     s1++;
     s2++;
@@ -30,19 +110,58 @@ int32_t kstrcmp(const unsigned char *p1, const unsigned char *p2) {
   return *(const uint8_t *)s1 - *(const uint8_t *)s2;
 }
 
-size_t kstrlen(const char *str) {
-  size_t len = 0;
-  while (str[len] != '\0') {
-    len++;
+/**
+ * Compare at most n bytes of S1 and S2, see kstrcmp()
+ */
+int32_t kstrncmp(const unsigned char *p1, const unsigned char *p2, size_t n) {
+  const unsigned char *s1 = (const unsigned char *)p1;
+  const unsigned char *s2 = (const unsigned char *)p2;
+  for (; n > 0; n--) {
+    if (!*s1 || *s1 != *s2)
+      return *s1 - *s2;
+    s1++;
+    s2++;
   }
-  return len;
+  return 0;
+}
+
+/* Word at a time, see KWORD_HAS_ZERO */
+size_t kstrlen(const char *str) {
+  const kword_t *w;
+  kword_t v = __kword_load_head(str, &w);
+  while (!KWORD_HAS_ZERO(v))
+    v = *++w;
+  return (uintptr_t)w + __kword_first_zero(KWORD_HAS_ZERO(v)) -
+         (uintptr_t)str;
 }
 
+/*
+ * Word at a time, see KWORD_HAS_ZERO
+ * Never reads past the aligned word that contains str[max - 1]
+ */
 size_t kstrnlen(const char *str, size_t max) {
+  if (max == 0)
+    return 0;
+  const kword_t *w;
+  kword_t v = __kword_load_head(str, &w);
+  /* Bytes of str covered so far */
+  size_t scanned = KWORD_SIZE - ((uintptr_t)str & (KWORD_SIZE - 1));
+  while (!KWORD_HAS_ZERO(v)) {
+    if (scanned >= max)
+      return max;
+    v = *++w;
+    scanned += KWORD_SIZE;
+  }
+  const size_t len =
+      (uintptr_t)w + __kword_first_zero(KWORD_HAS_ZERO(v)) - (uintptr_t)str;
+  return len < max ? len : max;
+}
+
+/* The reference implementation, one byte per iteration */
+size_t __kstrlen_byte(const char *str) {
   size_t len = 0;
-  for (len = 0; len < max; len++) {
-    if (str[len] == '\0')
-      break;
+  while (str[len] != '\0') {
+    len++;
   }
   return len;
 }
@@ -58,22 +177,132 @@ void memset(void *ptr, int c, size_t size) {
   return;
 }
 
+static bool __kutil_has_erms = false;
+
+static void *(*__kmemcpy_impl)(void *, const void *,
+                               size_t) = __kmemcpy_word;
+static void *(*__kmemset_impl)(void *, int, size_t) = __kmemset_word;
+
+/*
+ * Return true if the CPUID instruction is available, i.e., the ID flag
+ * (bit 21) in EFLAGS can be toggled. Always true in 64bit.
+ */
+static bool __kutil_has_cpuid(void) {
+#if defined(__x86_64__)
+  return true;
+#else
+  uint32_t before, after;
+  __asm__ volatile("pushfl\n\t"
+                   "pushfl\n\t"
+                   "popl %0\n\t"
+                   "movl %0, %1\n\t"
+                   "xorl $0x00200000, %1\n\t"
+                   "pushl %1\n\t"
+                   "popfl\n\t"
+                   "pushfl\n\t"
+                   "popl %1\n\t"
+                   "popfl"
+                   : "=&r"(before), "=&r"(after));
+  return ((before ^ after) & 0x00200000) != 0;
+#endif
+}
+
+static void __kutil_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+                          uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+  __asm__ volatile("cpuid"
+                   : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                   : "a"(leaf), "c"(subleaf));
+}
+
+/**
+ * Select the mem* implementations according to the CPU features
+ *   - ERMS (Enhanced REP MOVSB/STOSB, CPUID.(EAX=07H, ECX=0H):EBX[bit 9]),
+ *   use `rep movsb/stosb`, the microcode picks the best strategy
+ *   - otherwise use the native word loops
+ * Before the call, the word loops are used, so it is safe to call kmemset
+ * etc. at any time.
+ */
+void kutil_init(void) {
+  uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+  __kutil_has_erms = false;
+  if (__kutil_has_cpuid()) {
+    __kutil_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    /* eax: the max standard leaf */
+    if (eax >= 7) {
+      __kutil_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+      __kutil_has_erms = isMaskBitsAllSet(ebx, 1 << 9);
+    }
+  }
+
+  if (__kutil_has_erms) {
+    __kmemcpy_impl = __kmemcpy_erms;
+    __kmemset_impl = __kmemset_erms;
+  } else {
+    __kmemcpy_impl = __kmemcpy_word;
+    __kmemset_impl = __kmemset_word;
+  }
+  return;
+}
+
+bool kutil_cpu_has_erms(void) { return __kutil_has_erms; }
+
 /* Fill "*ptr" with (char)"c" * "size" */
 void *kmemset(void *ptr, int c, size_t size) {
-  /* write size * c to (*ptr) */
+  return __kmemset_impl(ptr, c, size);
+}
+
+/**
+ * @size size of the memory in bytes
+ * WARN: dst and src must not overlap, use kmemmove() otherwise
+ */
+void *kmemcpy(void *dst, const void *src, size_t size) {
+  return __kmemcpy_impl(dst, src, size);
+}
+
+/**
+ * Copy `size` bytes from src to dst, the two regions may overlap
+ *   - dst below src (or no overlap): copy forward
+ *   - dst above src: copy backward, from the tail
+ */
+void *kmemmove(void *dst, const void *src, size_t size) {
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+  if (d == s || size == 0)
+    return dst;
+  if ((uintptr_t)d < (uintptr_t)s || (uintptr_t)d >= (uintptr_t)s + size)
+    return __kmemcpy_impl(dst, src, size);
+
+  d += size;
+  s += size;
+  if (size >= KUTIL_WORD_THRESHOLD) {
+    /* Align the tail of dst */
+    while ((uintptr_t)d & (KWORD_SIZE - 1)) {
+      *--d = *--s;
+      size--;
+    }
+    /* d > s, so a word written never clobbers a word not yet read */
+    for (; size >= KWORD_SIZE; size -= KWORD_SIZE) {
+      d -= KWORD_SIZE;
+      s -= KWORD_SIZE;
+      *(kword_t *)d = *(const kword_unaligned_t *)s;
+    }
+  }
+  while (size--)
+    *--d = *--s;
+  return dst;
+}
+
+/* The reference implementation, one byte per iteration */
+void *__kmemset_byte(void *ptr, int c, size_t size) {
   char *dst = (char *)ptr;
-  //	while (size--)
-  //		*dst++ = c;
   for (size_t i = 0; i < size; i++) {
     dst[i] = (char)c;
   }
   return ptr;
 }
 
-/**
- * @size size of the memory in bytes
- */
-void *kmemcpy(void *dst, const void *src, size_t size) {
+/* The reference implementation, one byte per iteration */
+void *__kmemcpy_byte(void *dst, const void *src, size_t size) {
   char *c_dst = (char *)dst;
   const char *c_src = (char *)src;
   for (size_t i = 0; i < size; i++) {
@@ -82,6 +311,92 @@ void *kmemcpy(void *dst, const void *src, size_t size) {
   return dst;
 }
 
+/**
+ * Native word loop
+ *   - byte stores until dst is word aligned (the head)
+ *   - 4 words per iteration, then 1 word per iteration
+ *   - byte stores for the rest (the tail)
+ */
+void *__kmemset_word(void *ptr, int c, size_t size) {
+  uint8_t *d = (uint8_t *)ptr;
+  if (size >= KUTIL_WORD_THRESHOLD) {
+    /* e.g., 0xab -> 0xabababab */
+    const kword_t pattern = KWORD_LOWS * (uint8_t)c;
+    while ((uintptr_t)d & (KWORD_SIZE - 1)) {
+      *d++ = (uint8_t)c;
+      size--;
+    }
+    kword_t *dw = (kword_t *)d;
+    for (; size >= KWORD_SIZE * 4; size -= KWORD_SIZE * 4) {
+      dw[0] = pattern;
+      dw[1] = pattern;
+      dw[2] = pattern;
+      dw[3] = pattern;
+      dw += 4;
+    }
+    for (; size >= KWORD_SIZE; size -= KWORD_SIZE)
+      *dw++ = pattern;
+    d = (uint8_t *)dw;
+  }
+  while (size--)
+    *d++ = (uint8_t)c;
+  return ptr;
+}
+
+/**
+ * Native word loop, see __kmemset_word()
+ * Only dst is aligned; the src is read unaligned if necessary
+ */
+void *__kmemcpy_word(void *dst, const void *src, size_t size) {
+  uint8_t *d = (uint8_t *)dst;
+  const uint8_t *s = (const uint8_t *)src;
+  if (size >= KUTIL_WORD_THRESHOLD) {
+    while ((uintptr_t)d & (KWORD_SIZE - 1)) {
+      *d++ = *s++;
+      size--;
+    }
+    kword_t *dw = (kword_t *)d;
+    const kword_unaligned_t *sw = (const kword_unaligned_t *)s;
+    /* Load all 4 before storing, so that kmemmove() can copy forward */
+    for (; size >= KWORD_SIZE * 4; size -= KWORD_SIZE * 4) {
+      const kword_t w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+      dw[0] = w0;
+      dw[1] = w1;
+      dw[2] = w2;
+      dw[3] = w3;
+      dw += 4;
+      sw += 4;
+    }
+    for (; size >= KWORD_SIZE; size -= KWORD_SIZE)
+      *dw++ = *sw++;
+    d = (uint8_t *)dw;
+    s = (const uint8_t *)sw;
+  }
+  while (size--)
+    *d++ = *s++;
+  return dst;
+}
+
+/* Enhanced REP STOSB */
+void *__kmemset_erms(void *ptr, int c, size_t size) {
+  void *d = ptr;
+  __asm__ volatile("rep stosb"
+                   : "+D"(d), "+c"(size)
+                   : "a"(c)
+                   : "memory");
+  return ptr;
+}
+
+/* Enhanced REP MOVSB, DF is assumed to be cleared (as the ABI requires) */
+void *__kmemcpy_erms(void *dst, const void *src, size_t size) {
+  void *d = dst;
+  __asm__ volatile("rep movsb"
+                   : "+D"(d), "+S"(src), "+c"(size)
+                   :
+                   : "memory");
+  return dst;
+}
+
 /*
  * Write the ascii representation of hex_number at &hex_number.
  * Usage: kfprint((hex_to_ascii(buf, &hex, sizeof(hex)))),4);
@@ -195,6 +510,128 @@ void arr_remove_element_u32(uint32_t arr[], uint32_t index_to_remove[],
   return;
 }
 
+/*
+ * Compare the word loops, the erms and the dispatched kmem* against the
+ * byte loops; on every (dst, src) misalignment and on the head/tail sizes
+ */
+static bool test_kutil_mem() {
+  uint8_t src[96], expected[96], dst[96];
+  void *(*cpys[])(void *, const void *, size_t) = {
+      __kmemcpy_word, __kmemcpy_erms, kmemcpy, kmemmove};
+  void *(*sets[])(void *, int, size_t) = {__kmemset_word, __kmemset_erms,
+                                          kmemset};
+  const size_t sizes[] = {0, 1, 7, 15, 16, 17, 33, 64};
+
+  for (size_t i = 0; i < sizeof(src); i++)
+    src[i] = (uint8_t)(i * 7 + 3);
+
+  for (size_t f = 0; f < sizeof(cpys) / sizeof(cpys[0]); f++) {
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+      for (size_t doff = 0; doff < 8; doff++) {
+        for (size_t soff = 0; soff < 8; soff++) {
+          __kmemset_byte(dst, 0xee, sizeof(dst));
+          __kmemset_byte(expected, 0xee, sizeof(expected));
+          __kmemcpy_byte(expected + doff, src + soff, sizes[n]);
+          if (cpys[f](dst + doff, src + soff, sizes[n]) != dst + doff)
+            return false;
+          if (kmemcmp(dst, expected, sizeof(dst)) != 0)
+            return false;
+        }
+      }
+    }
+  }
+
+  for (size_t f = 0; f < sizeof(sets) / sizeof(sets[0]); f++) {
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+      for (size_t doff = 0; doff < 8; doff++) {
+        __kmemset_byte(dst, 0xee, sizeof(dst));
+        __kmemset_byte(expected, 0xee, sizeof(expected));
+        __kmemset_byte(expected + doff, 0x1a5, sizes[n]);
+        if (sets[f](dst + doff, 0x1a5, sizes[n]) != dst + doff)
+          return false;
+        if (kmemcmp(dst, expected, sizeof(dst)) != 0)
+          return false;
+      }
+    }
+  }
+
+  /* Overlap, both directions */
+  for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+    for (size_t shift = 1; shift < 9; shift++) {
+      __kmemcpy_byte(dst, src, sizeof(dst));
+      __kmemcpy_byte(expected, src, sizeof(expected));
+      /* dst above src, copy the reference backward */
+      for (size_t i = sizes[n]; i > 0; i--)
+        expected[8 + shift + i - 1] = expected[8 + i - 1];
+      kmemmove(dst + 8 + shift, dst + 8, sizes[n]);
+      if (kmemcmp(dst, expected, sizeof(dst)) != 0)
+        return false;
+
+      __kmemcpy_byte(dst, src, sizeof(dst));
+      __kmemcpy_byte(expected, src, sizeof(expected));
+      for (size_t i = 0; i < sizes[n]; i++)
+        expected[8 + i] = expected[8 + shift + i];
+      kmemmove(dst + 8, dst + 8 + shift, sizes[n]);
+      if (kmemcmp(dst, expected, sizeof(dst)) != 0)
+        return false;
+    }
+  }
+  return true;
+}
+
+
+/*
+ * Put the '\0' at every position, for every start alignment; compare against
+ * the byte loop
+ */
+static bool test_kutil_str() {
+  char buf[64], cpy[64 + 8];
+  for (size_t start = 0; start < 8; start++) {
+    for (size_t len = 0; start + len < sizeof(buf); len++) {
+      __kmemset_byte(buf, 'a', sizeof(buf));
+      buf[start + len] = '\0';
+      const char *s = buf + start;
+      if (kstrlen(s) != len || __kstrlen_byte(s) != len)
+        return false;
+      for (size_t max = 0; max < len + 10; max++) {
+        if (kstrnlen(s, max) != (len < max ? len : max))
+          return false;
+      }
+      __kmemset_byte(cpy, 0x7f, sizeof(cpy));
+      if (kstrcpy(cpy + (len & 7), s) != cpy + (len & 7) + len)
+        return false;
+      if (kmemcmp(cpy + (len & 7), s, len + 1) != 0)
+        return false;
+      if (kstrlcpy(cpy, s, 5) != (len < 4 ? len : 4) ||
+          kstrlen(cpy) != (len < 4 ? len : 4))
+        return false;
+    }
+  }
+
+  /* Same and different alignments, difference at every position */
+  const unsigned char *a = (const unsigned char *)"the quick brown fox jumps";
+  unsigned char b[64];
+  const size_t alen = __kstrlen_byte((const char *)a);
+  for (size_t off = 0; off < 8; off++) {
+    kmemcpy(b + off, a, alen + 1);
+    if (kstrcmp(a, b + off) != 0 || kstrncmp(a, b + off, 100) != 0)
+      return false;
+    for (size_t i = 0; i < alen; i++) {
+      b[off + i] = a[i] + 1;
+      if (kstrcmp(a, b + off) >= 0 || kstrcmp(b + off, a) <= 0)
+        return false;
+      if (kstrncmp(a, b + off, i) != 0 || kstrncmp(a, b + off, i + 1) >= 0)
+        return false;
+      b[off + i] = a[i];
+    }
+    /* b is a prefix of a */
+    b[off + alen - 1] = '\0';
+    if (kstrcmp(a, b + off) <= 0 || kstrcmp(b + off, a) >= 0)
+      return false;
+  }
+  return true;
+}
+
 bool test_kutil() {
   if (isMaskBitsAllSet(0b10111111, 0b1010) != true)
     return false;
@@ -216,5 +653,9 @@ bool test_kutil() {
     if (arr[i] != expected_arr[i])
       return false;
   }
+  if (!test_kutil_mem())
+    return false;
+  if (!test_kutil_str())
+    return false;
   return true;
 }
@@ -10,15 +10,26 @@ extern "C" {
 #include <stdint.h>
 bool test_kutil();
 void *kstrcpy(char *dest, const char *src);
+size_t kstrlcpy(char *dest, const char *src, size_t size);
 size_t kstrlen(const char *str);
 size_t kstrnlen(const char *str, size_t max);
+size_t __kstrlen_byte(const char *str);
+void kutil_init(void);
+bool kutil_cpu_has_erms(void);
 void *kmemcpy(void *dst, const void *src, size_t size);
+void *kmemmove(void *dst, const void *src, size_t size);
+void *__kmemcpy_byte(void *dst, const void *src, size_t size);
+void *__kmemcpy_word(void *dst, const void *src, size_t size);
+void *__kmemcpy_erms(void *dst, const void *src, size_t size);
 void *hex_to_ascii(char *ascii_str_buf, void *hex_number, size_t size);
 bool is_digit(char c);
 int32_t to_digit(char c);
 int32_t kmemcmp(const void *str1, const void *str2, size_t n);
 void memset(void *ptr, int c, size_t size);
 void *kmemset(void *ptr, int c, size_t size);
+void *__kmemset_byte(void *ptr, int c, size_t size);
+void *__kmemset_word(void *ptr, int c, size_t size);
+void *__kmemset_erms(void *ptr, int c, size_t size);
 bool isMaskBitsAllSet(uint32_t data, uint32_t mask);
 bool isMaskBitsAllClear(uint32_t data, uint32_t mask);
 uintptr_t align_address_to_upper(uintptr_t addr, uint32_t ALIGN);
@@ -26,6 +37,7 @@ uintptr_t align_address_to_lower(uintptr_t val, uint32_t ALIGN);
 void arr_remove_element_u32(uint32_t arr[], uint32_t index_to_remove[],
                             uint32_t arr_size, uint32_t index_to_remove_size);
 int32_t kstrcmp(const unsigned char *p1, const unsigned char *p2);
+int32_t kstrncmp(const unsigned char *p1, const unsigned char *p2, size_t n);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,281 @@
+/**
+ * Spin locks (see spinlock.h)
+ *   - The kernel runs on one CPU: a lock only waits for an interrupt handler of
+ *   another task's critical section, which is what the _irqsave variants rule
+ *   out; the atomic operations keep the locks correct on more CPUs too
+ */
+#include "util/spinlock.h"
+#include "io/io.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+static inline void cpu_relax(void)
+{
+	__asm__ volatile("pause" ::: "memory");
+}
+
+/* Called with the lock just taken; `spin_from` is 0 if it was not contended */
+static void lockstat_acquired(LOCKSTAT *stat, uint64_t spin_from)
+{
+	if (!stat)
+		return;
+	const uint64_t now = _io_rdtsc();
+	stat->acquisitions++;
+	if (spin_from)
+	{
+		stat->contended++;
+		stat->spin_cycles += now - spin_from;
+	}
+	stat->acquired_at = now;
+}
+
+/* Called with the lock still held */
+static void lockstat_releasing(LOCKSTAT *stat)
+{
+	if (!stat)
+		return;
+	const uint64_t hold = _io_rdtsc() - stat->acquired_at;
+	if (hold > stat->max_hold_cycles)
+		stat->max_hold_cycles = hold;
+}
+
+/* The TSC only when the statistics want it */
+static inline uint64_t lockstat_spin_from(const LOCKSTAT *stat)
+{
+	return stat ? _io_rdtsc() : 0;
+}
+
+static inline bool irqsave(void)
+{
+	const bool isCli = io_get_is_cli();
+	if (!isCli)
+		_io_cli();
+	return isCli;
+}
+
+static inline void irqrestore(bool isCli)
+{
+	if (!isCli)
+		_io_sti();
+}
+
+void lockstat_reset(LOCKSTAT *stat)
+{
+	if (!stat)
+		return;
+	stat->acquisitions = 0;
+	stat->contended = 0;
+	stat->spin_cycles = 0;
+	stat->max_hold_cycles = 0;
+	stat->acquired_at = 0;
+}
+
+/*
+ * SPINLOCK
+ */
+
+void spinlock_init(SPINLOCK *lock, LOCKSTAT *stat)
+{
+	lock->locked = 0;
+	lock->stat = stat;
+}
+
+void spinlock_lock(SPINLOCK *lock)
+{
+	uint64_t spin_from = 0;
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+	{
+		if (!spin_from)
+			spin_from = lockstat_spin_from(lock->stat);
+		/* Spin on a read; the exchange is only retried once it looks free */
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+			cpu_relax();
+	}
+	lockstat_acquired(lock->stat, spin_from);
+}
+
+/*
+ * Return true if the lock is taken
+ */
+bool spinlock_trylock(SPINLOCK *lock)
+{
+	if (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+		return false;
+	if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+		return false;
+	lockstat_acquired(lock->stat, 0);
+	return true;
+}
+
+void spinlock_unlock(SPINLOCK *lock)
+{
+	lockstat_releasing(lock->stat);
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+bool spinlock_lock_irqsave(SPINLOCK *lock)
+{
+	const bool isCli = irqsave();
+	spinlock_lock(lock);
+	return isCli;
+}
+
+void spinlock_unlock_irqrestore(SPINLOCK *lock, bool isCli)
+{
+	spinlock_unlock(lock);
+	irqrestore(isCli);
+}
+
+/*
+ * TICKETLOCK
+ */
+
+void ticketlock_init(TICKETLOCK *lock, LOCKSTAT *stat)
+{
+	lock->next = 0;
+	lock->owner = 0;
+	lock->stat = stat;
+}
+
+void ticketlock_lock(TICKETLOCK *lock)
+{
+	const uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	uint64_t spin_from = 0;
+	if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+	{
+		spin_from = lockstat_spin_from(lock->stat);
+		while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+			cpu_relax();
+	}
+	lockstat_acquired(lock->stat, spin_from);
+}
+
+void ticketlock_unlock(TICKETLOCK *lock)
+{
+	lockstat_releasing(lock->stat);
+	/* Only the owner writes `owner` */
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+bool ticketlock_lock_irqsave(TICKETLOCK *lock)
+{
+	const bool isCli = irqsave();
+	ticketlock_lock(lock);
+	return isCli;
+}
+
+void ticketlock_unlock_irqrestore(TICKETLOCK *lock, bool isCli)
+{
+	ticketlock_unlock(lock);
+	irqrestore(isCli);
+}
+
+/*
+ * MCSLOCK
+ * J. M. Mellor-Crummey and M. L. Scott, "Algorithms for Scalable
+ * Synchronization on Shared-Memory Multiprocessors", 1991
+ */
+
+void mcslock_init(MCSLOCK *lock, LOCKSTAT *stat)
+{
+	lock->tail = NULL;
+	lock->stat = stat;
+}
+
+void mcslock_lock(MCSLOCK *lock, MCSNODE *node)
+{
+	node->next = NULL;
+	node->waiting = 1;
+	MCSNODE *pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	uint64_t spin_from = 0;
+	if (pred)
+	{
+		spin_from = lockstat_spin_from(lock->stat);
+		/* Queue behind the predecessor, and wait for it to hand the lock over */
+		__atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&node->waiting, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+	lockstat_acquired(lock->stat, spin_from);
+}
+
+void mcslock_unlock(MCSLOCK *lock, MCSNODE *node)
+{
+	lockstat_releasing(lock->stat);
+	MCSNODE *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (!next)
+	{
+		MCSNODE *expected = node;
+		/* No waiter: free the lock */
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		/* A waiter swapped the tail, but has not linked itself yet */
+		while (!(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)))
+			cpu_relax();
+	}
+	__atomic_store_n(&next->waiting, 0, __ATOMIC_RELEASE);
+}
+
+bool mcslock_lock_irqsave(MCSLOCK *lock, MCSNODE *node)
+{
+	const bool isCli = irqsave();
+	mcslock_lock(lock, node);
+	return isCli;
+}
+
+void mcslock_unlock_irqrestore(MCSLOCK *lock, MCSNODE *node, bool isCli)
+{
+	mcslock_unlock(lock, node);
+	irqrestore(isCli);
+}
+
+bool test_spinlock(void)
+{
+	LOCKSTAT stat;
+	lockstat_reset(&stat);
+
+	SPINLOCK s;
+	spinlock_init(&s, &stat);
+	spinlock_lock(&s);
+	if (spinlock_trylock(&s))
+		return false;
+	spinlock_unlock(&s);
+	if (!spinlock_trylock(&s))
+		return false;
+	spinlock_unlock(&s);
+	if (stat.acquisitions != 2 || stat.contended != 0)
+		return false;
+
+	TICKETLOCK t;
+	ticketlock_init(&t, &stat);
+	for (int i = 0; i < 3; i++)
+	{
+		ticketlock_lock(&t);
+		if (t.next != (uint32_t)i + 1 || t.owner != (uint32_t)i)
+			return false;
+		ticketlock_unlock(&t);
+	}
+	if (t.owner != t.next || stat.acquisitions != 5)
+		return false;
+
+	MCSLOCK m;
+	MCSNODE n;
+	mcslock_init(&m, NULL);
+	mcslock_lock(&m, &n);
+	if (m.tail != &n)
+		return false;
+	mcslock_unlock(&m, &n);
+	if (m.tail)
+		return false;
+
+	/* The interrupt flag is restored as it was */
+	const bool wasCli = io_get_is_cli();
+	const bool isCli = mcslock_lock_irqsave(&m, &n);
+	if (isCli != wasCli || !io_get_is_cli())
+		return false;
+	mcslock_unlock_irqrestore(&m, &n, isCli);
+	if (io_get_is_cli() != wasCli)
+		return false;
+	return true;
+}
@@ -0,0 +1,83 @@
+#ifndef UTIL_SPINLOCK_H_
+#define UTIL_SPINLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Spin locks
+ *   - SPINLOCK: test-and-test-and-set; the waiters spin on a plain read
+ *   - TICKETLOCK: FIFO order; a waiter takes a ticket and waits for its turn
+ *   - MCSLOCK: FIFO order; each waiter spins on its own MCSNODE (on its stack),
+ *   so the lock word is written once per acquisition, not once per spin
+ *
+ * A lock also taken in an interrupt handler must be taken with the _irqsave
+ * variant everywhere else: the handler would spin forever on a lock held by
+ * the code it interrupted. The _irqsave variants return whether interrupts
+ * were already off ("isCli"), which is passed back to the _irqrestore one.
+ */
+
+/**
+ * Optional statistics of one lock (attached on init, NULL for none)
+ *   - all in TSC cycles; the spin is only measured when the first try fails
+ */
+typedef struct LOCKSTAT {
+	uint32_t acquisitions;
+	/* Acquisitions that had to wait */
+	uint32_t contended;
+	uint64_t spin_cycles;
+	uint64_t max_hold_cycles;
+	/* TSC of the current acquisition */
+	uint64_t acquired_at;
+} LOCKSTAT;
+
+typedef struct SPINLOCK {
+	volatile uint32_t locked;
+	LOCKSTAT *stat;
+} SPINLOCK;
+
+typedef struct TICKETLOCK {
+	/* The ticket of the next comer */
+	volatile uint32_t next;
+	/* The ticket being served */
+	volatile uint32_t owner;
+	LOCKSTAT *stat;
+} TICKETLOCK;
+
+typedef struct MCSNODE {
+	struct MCSNODE *volatile next;
+	/* Cleared by the predecessor on its unlock */
+	volatile uint32_t waiting;
+} MCSNODE;
+
+typedef struct MCSLOCK {
+	/* The last waiter (or the owner), NULL when free */
+	MCSNODE *volatile tail;
+	LOCKSTAT *stat;
+} MCSLOCK;
+
+void lockstat_reset(LOCKSTAT *stat);
+
+void spinlock_init(SPINLOCK *lock, LOCKSTAT *stat);
+void spinlock_lock(SPINLOCK *lock);
+bool spinlock_trylock(SPINLOCK *lock);
+void spinlock_unlock(SPINLOCK *lock);
+bool spinlock_lock_irqsave(SPINLOCK *lock);
+void spinlock_unlock_irqrestore(SPINLOCK *lock, bool isCli);
+
+void ticketlock_init(TICKETLOCK *lock, LOCKSTAT *stat);
+void ticketlock_lock(TICKETLOCK *lock);
+void ticketlock_unlock(TICKETLOCK *lock);
+bool ticketlock_lock_irqsave(TICKETLOCK *lock);
+void ticketlock_unlock_irqrestore(TICKETLOCK *lock, bool isCli);
+
+/* `node` must stay valid until the unlock, and is passed to it */
+void mcslock_init(MCSLOCK *lock, LOCKSTAT *stat);
+void mcslock_lock(MCSLOCK *lock, MCSNODE *node);
+void mcslock_unlock(MCSLOCK *lock, MCSNODE *node);
+bool mcslock_lock_irqsave(MCSLOCK *lock, MCSNODE *node);
+void mcslock_unlock_irqrestore(MCSLOCK *lock, MCSNODE *node, bool isCli);
+
+bool test_spinlock(void);
+
+#endif